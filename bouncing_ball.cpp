@@ -2,8 +2,43 @@
 #include <cmath>
 #include <algorithm>
 #include <iostream>
+#include <iomanip>
 #include <vector>
 #include <string>
+#include <cstdlib>
+#include <cstddef>
+#include <cstdint>
+#include <climits>
+#include <cstdio>
+#include <deque>
+#include <map>
+#include <fstream>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <atomic>
+#include <cstring>
+#include <functional>
+#include <new>
+#include <random>
+#include <memory>
+#include <sstream>
+#include <cerrno>
+#include <csignal>
+#include <fcntl.h>
+#include <poll.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+#include <sys/uio.h>
+#include <sys/wait.h>
+#include <unistd.h>
+#ifdef __linux__
+#include <linux/io_uring.h>
+#include <sys/prctl.h>
+#include <sys/syscall.h>
+#endif
 
 // Constants
 const float PI = 3.14159265f;
@@ -13,99 +48,7941 @@ const float ROTATION_SPEED = 30.f; // degrees per second
 const float GRAVITY = 0.f;         // pixels per second squared (downward)
 const float FRICTION_COEFFICIENT = 0.f; // fraction of velocity lost per second
 
+// Contact response constants:
+const float RESTITUTION = 1.f;     // normal bounciness (1 = perfectly elastic)
+const float WALL_FRICTION = 0.2f;  // Coulomb friction coefficient between ball and edge/ball
+const float RESTITUTION_THRESHOLD = 30.f; // pixels per second; slower impacts do not bounce
+
+// Contact solver constants:
+const int SOLVER_ITERATIONS = 8;   // velocity iterations per step
+const float BAUMGARTE = 0.2f;      // fraction of the overlap corrected per step
+const float PENETRATION_SLOP = 0.5f; // pixels of overlap tolerated without correction
+
+// Sleep constants:
+const float SLEEP_LINEAR_VELOCITY = 5.f;   // pixels per second
+const float SLEEP_ANGULAR_VELOCITY = 0.2f; // radians per second
+const float TIME_TO_SLEEP = 0.5f;          // seconds a whole island must stay slow before it sleeps
+
+// Culling constants:
+const float TIME_TO_ESCAPE = 0.5f; // seconds a ball must stay wholly outside the polygon before it is culled
+
+//------------------------------------------------------------
+// Utility functions for vector math
+//------------------------------------------------------------
+template <typename T>
+inline T dot(const sf::Vector2<T> &a, const sf::Vector2<T> &b) {
+    return a.x * b.x + a.y * b.y;
+}
+
+template <typename T>
+inline T length(const sf::Vector2<T> &v) {
+    using std::sqrt;
+    return sqrt(v.x * v.x + v.y * v.y);
+}
+
+template <typename T>
+inline sf::Vector2<T> normalize(const sf::Vector2<T> &v) {
+    T len = length(v);
+    if (len != T(0))
+        return sf::Vector2<T>(v.x / len, v.y / len);
+    return sf::Vector2<T>(T(0), T(0));
+}
+
+inline std::int32_t floorToInt(float v) {
+    return static_cast<std::int32_t>(std::floor(v));
+}
+
+//------------------------------------------------------------
+// Q32.32 fixed-point scalar for the deterministic physics mode. Every operation is integer
+// arithmetic, with 128-bit intermediates from the GCC/Clang __int128 extension, so a replay
+// gives the same state on any machine and with any optimization flags those compilers take.
+// Converting from float truncates to a multiple of 2^-32, which is close enough for the
+// float constants above to be used as they are.
+//------------------------------------------------------------
+#ifndef __SIZEOF_INT128__
+#error "The fixed-point mode needs a compiler with __int128 (GCC or Clang)"
+#endif
+struct Fixed {
+    std::int64_t raw = 0;
+
+    Fixed() {}
+    explicit Fixed(int v) : raw(static_cast<std::int64_t>(v) * ONE) {}
+    explicit Fixed(float v) : raw(static_cast<std::int64_t>(static_cast<double>(v) * ONE)) {}
+    explicit Fixed(double v) : raw(static_cast<std::int64_t>(v * ONE)) {}
+    explicit operator float() const { return static_cast<float>(static_cast<double>(raw) / ONE); }
+    explicit operator double() const { return static_cast<double>(raw) / ONE; }
+
+    static Fixed fromRaw(std::int64_t r)
+    {
+        Fixed f;
+        f.raw = r;
+        return f;
+    }
+
+    static constexpr std::int64_t ONE = std::int64_t(1) << 32;
+};
+
+inline Fixed operator+(Fixed a, Fixed b) { return Fixed::fromRaw(a.raw + b.raw); }
+inline Fixed operator-(Fixed a, Fixed b) { return Fixed::fromRaw(a.raw - b.raw); }
+inline Fixed operator-(Fixed a) { return Fixed::fromRaw(-a.raw); }
+inline Fixed operator*(Fixed a, Fixed b) { return Fixed::fromRaw(static_cast<std::int64_t>((static_cast<__int128>(a.raw) * b.raw) >> 32)); }
+inline Fixed operator/(Fixed a, Fixed b)
+{
+    if (b.raw == 0)
+        return Fixed::fromRaw(a.raw < 0 ? INT64_MIN : INT64_MAX);
+    return Fixed::fromRaw(static_cast<std::int64_t>((static_cast<__int128>(a.raw) << 32) / b.raw));
+}
+inline Fixed &operator+=(Fixed &a, Fixed b) { return a = a + b; }
+inline Fixed &operator-=(Fixed &a, Fixed b) { return a = a - b; }
+inline Fixed &operator*=(Fixed &a, Fixed b) { return a = a * b; }
+inline Fixed &operator/=(Fixed &a, Fixed b) { return a = a / b; }
+inline bool operator==(Fixed a, Fixed b) { return a.raw == b.raw; }
+inline bool operator!=(Fixed a, Fixed b) { return a.raw != b.raw; }
+inline bool operator<(Fixed a, Fixed b) { return a.raw < b.raw; }
+inline bool operator>(Fixed a, Fixed b) { return a.raw > b.raw; }
+inline bool operator<=(Fixed a, Fixed b) { return a.raw <= b.raw; }
+inline bool operator>=(Fixed a, Fixed b) { return a.raw >= b.raw; }
+
+inline Fixed abs(Fixed v) { return v.raw < 0 ? -v : v; }
+
+inline std::int32_t floorToInt(Fixed v) {
+    return static_cast<std::int32_t>(v.raw >> 32);
+}
+
+// Bit-by-bit integer square root of raw * 2^32, which is the Q32.32 square root
+inline Fixed sqrt(Fixed v)
+{
+    if (v.raw <= 0)
+        return Fixed();
+    unsigned __int128 n = static_cast<unsigned __int128>(v.raw) << 32;
+    unsigned __int128 root = 0;
+    unsigned __int128 bit = static_cast<unsigned __int128>(1) << 126;
+    while (bit > n)
+        bit >>= 2;
+    while (bit != 0) {
+        if (n >= root + bit) {
+            n -= root + bit;
+            root = (root >> 1) + bit;
+        } else {
+            root >>= 1;
+        }
+        bit >>= 2;
+    }
+    return Fixed::fromRaw(static_cast<std::int64_t>(root));
+}
+
+// Sine and cosine: reduce to [-pi/4, pi/4] by quarter turns, then a Taylor series
+// accurate to about 1e-9 on that range
+inline void sinCos(Fixed x, Fixed &s, Fixed &c)
+{
+    const Fixed halfPi = Fixed::fromRaw(6746518852LL); // pi/2 in Q32.32
+    std::int64_t quarter = floorToInt(x / halfPi + Fixed(0.5f));
+    Fixed r = x - Fixed(static_cast<int>(quarter)) * halfPi;
+    Fixed r2 = r * r;
+    Fixed one(1);
+    Fixed sr = r * (one - r2 / Fixed(6) * (one - r2 / Fixed(20) * (one - r2 / Fixed(42) * (one - r2 / Fixed(72)))));
+    Fixed cr = one - r2 / Fixed(2) * (one - r2 / Fixed(12) * (one - r2 / Fixed(30) * (one - r2 / Fixed(56) * (one - r2 / Fixed(90)))));
+    switch (quarter & 3) {
+    case 0: s = sr;  c = cr;  break;
+    case 1: s = cr;  c = -sr; break;
+    case 2: s = -sr; c = -cr; break;
+    default: s = -cr; c = sr; break;
+    }
+}
+
+inline Fixed sin(Fixed x)
+{
+    Fixed s, c;
+    sinCos(x, s, c);
+    return s;
+}
+
+inline Fixed cos(Fixed x)
+{
+    Fixed s, c;
+    sinCos(x, s, c);
+    return c;
+}
+
+//------------------------------------------------------------
+// Draw a dotted line between two points
+//------------------------------------------------------------
+void drawDottedLine(sf::RenderTarget &window,
+                    const sf::Vector2f &start,
+                    const sf::Vector2f &end,
+                    float dotSpacing = 10.f,
+                    float dotRadius = 2.f)
+{
+    sf::Vector2f dir = end - start;
+    float dist = length(dir);
+    if (dist == 0.f)
+        return;
+
+    dir = normalize(dir);
+    for (float d = 0.f; d < dist; d += dotSpacing) {
+        sf::CircleShape dot(dotRadius);
+        dot.setFillColor(sf::Color::White);
+        dot.setPosition(start + dir * d - sf::Vector2f(dotRadius, dotRadius));
+        window.draw(dot);
+    }
+}
+
+//------------------------------------------------------------
+// Ball state, stored as parallel arrays so the solver can stream over them.
+// Balls are solid discs of unit mass, so the moment of inertia is r^2 / 2. T is the scalar
+// type: float for the interactive app, double for long runs, Fixed for deterministic replays.
+// P is the type of positions only; Balls<float, double> is the mixed-precision layout, which
+// keeps absolute positions in double while velocities and all contact math stay in float.
+//------------------------------------------------------------
+template <typename T, typename P = T>
+struct Balls {
+    std::vector<sf::Vector2<P>> position;
+    std::vector<sf::Vector2<T>> velocity;
+    std::vector<T> angle;            // radians, only used to draw the spin marker
+    std::vector<T> angularVelocity;  // radians per second, positive = clockwise on screen
+    std::vector<T> sleepTime;        // seconds spent below the sleep velocity thresholds
+    std::vector<T> outsideTime;      // seconds spent wholly outside the polygon
+    std::vector<T> age;              // seconds since added, only advanced while Simulation::maxAge is set
+    std::vector<std::uint8_t> awake; // sleeping balls are skipped by integration and the solver
+
+    std::size_t size() const { return position.size(); }
+
+    void add(const sf::Vector2<P> &pos, const sf::Vector2<T> &vel = sf::Vector2<T>(T(0), T(0)))
+    {
+        position.push_back(pos);
+        velocity.push_back(vel);
+        angle.push_back(T(0));
+        angularVelocity.push_back(T(0));
+        sleepTime.push_back(T(0));
+        outsideTime.push_back(T(0));
+        age.push_back(T(0));
+        awake.push_back(1);
+    }
+
+    void wake(std::size_t i)
+    {
+        awake[i] = 1;
+        sleepTime[i] = T(0);
+    }
+
+    // Remove ball i by moving the last ball into its place
+    void swapRemove(std::size_t i)
+    {
+        std::size_t last = size() - 1;
+        position[i] = position[last];
+        velocity[i] = velocity[last];
+        angle[i] = angle[last];
+        angularVelocity[i] = angularVelocity[last];
+        sleepTime[i] = sleepTime[last];
+        outsideTime[i] = outsideTime[last];
+        age[i] = age[last];
+        awake[i] = awake[last];
+        position.pop_back();
+        velocity.pop_back();
+        angle.pop_back();
+        angularVelocity.pop_back();
+        sleepTime.pop_back();
+        outsideTime.pop_back();
+        age.pop_back();
+        awake.pop_back();
+    }
+
+    void clear()
+    {
+        position.clear();
+        velocity.clear();
+        angle.clear();
+        angularVelocity.clear();
+        sleepTime.clear();
+        outsideTime.clear();
+        age.clear();
+        awake.clear();
+    }
+};
+
+//------------------------------------------------------------
+// Bump allocator for data that only lives for one simulation step (neighbor candidates,
+// sort scratch). Allocation bumps an offset and reset() at the end of the step frees
+// everything at once. A step that outgrows the block spills into overflow blocks; the next
+// reset() replaces them with a single block sized for the largest step seen, so a steady
+// state never reaches the heap.
+//------------------------------------------------------------
+struct StepArena {
+    static const std::size_t ALIGNMENT = alignof(std::max_align_t);
+
+    std::vector<unsigned char> block;
+    std::vector<std::vector<unsigned char>> overflow;
+    std::size_t used = 0;           // bytes of 'block' handed out this step
+    std::size_t stepBytes = 0;      // bytes handed out this step, overflow included
+    std::size_t stepAllocations = 0;
+    std::size_t peakBytes = 0;      // largest step so far
+    std::size_t overflowBlocks = 0; // heap blocks taken because a step outgrew the arena
+
+    template <typename T>
+    T *allocate(std::size_t n)
+    {
+        std::size_t bytes = n * sizeof(T);
+        std::size_t offset = (used + ALIGNMENT - 1) & ~(ALIGNMENT - 1);
+        stepBytes += bytes;
+        stepAllocations++;
+        if (offset + bytes <= block.size()) {
+            used = offset + bytes;
+            return reinterpret_cast<T *>(block.data() + offset);
+        }
+        overflow.emplace_back(bytes);
+        overflowBlocks++;
+        return reinterpret_cast<T *>(overflow.back().data());
+    }
+
+    void reset()
+    {
+        peakBytes = std::max(peakBytes, stepBytes);
+        if (!overflow.empty()) {
+            overflow.clear();
+            block.resize(2 * peakBytes);
+        }
+        used = 0;
+        stepBytes = 0;
+        stepAllocations = 0;
+    }
+};
+
+// std::vector storage from a StepArena; deallocation is a no-op until the arena resets
+template <typename T>
+struct ArenaAllocator {
+    using value_type = T;
+    StepArena *arena;
+
+    explicit ArenaAllocator(StepArena &stepArena) : arena(&stepArena) {}
+    template <typename U>
+    ArenaAllocator(const ArenaAllocator<U> &other) : arena(other.arena) {}
+
+    T *allocate(std::size_t n) { return arena->allocate<T>(n); }
+    void deallocate(T *, std::size_t) {}
+
+    template <typename U>
+    bool operator==(const ArenaAllocator<U> &other) const { return arena == other.arena; }
+    template <typename U>
+    bool operator!=(const ArenaAllocator<U> &other) const { return arena != other.arena; }
+};
+
+template <typename T>
+using ArenaVector = std::vector<T, ArenaAllocator<T>>;
+
+//------------------------------------------------------------
+// Reorder one of a batch's parallel arrays: element k becomes the old element order[k].
+//------------------------------------------------------------
+template <typename T>
+void permute(std::vector<T> &values, const ArenaVector<std::size_t> &order, StepArena &arena)
+{
+    ArenaVector<T> sorted(order.size(), T(), ArenaAllocator<T>(arena));
+    for (std::size_t k = 0; k < order.size(); k++)
+        sorted[k] = values[order[k]];
+    std::copy(sorted.begin(), sorted.end(), values.begin());
+}
+
+//------------------------------------------------------------
+// A batch of ball-vs-edge contacts gathered for one step, also stored as parallel arrays.
+// The wall velocity is the velocity of the rotating edge at the contact point. The
+// accumulated impulses persist across steps so the solver can be warm started.
+//------------------------------------------------------------
+template <typename T>
+struct WallContacts {
+    std::vector<int> ball;
+    std::vector<int> edge;
+    std::vector<sf::Vector2<T>> normal; // inward edge normal (points toward the ball)
+    std::vector<sf::Vector2<T>> wallVelocity;
+    std::vector<T> penetration;
+    std::vector<T> velocityBias;        // target separating speed (restitution / position correction)
+    std::vector<T> normalImpulse;       // accumulated over the solver iterations
+    std::vector<T> tangentImpulse;
+
+    std::size_t size() const { return ball.size(); }
+
+    // Contacts are matched across steps by (ball, edge); collection emits them in key order.
+    std::uint64_t key(std::size_t c) const
+    {
+        return (static_cast<std::uint64_t>(ball[c]) << 32) | static_cast<std::uint32_t>(edge[c]);
+    }
+
+    void clear()
+    {
+        ball.clear();
+        edge.clear();
+        normal.clear();
+        wallVelocity.clear();
+        penetration.clear();
+        velocityBias.clear();
+        normalImpulse.clear();
+        tangentImpulse.clear();
+    }
+
+    void reserve(std::size_t n)
+    {
+        ball.reserve(n);
+        edge.reserve(n);
+        normal.reserve(n);
+        wallVelocity.reserve(n);
+        penetration.reserve(n);
+        velocityBias.reserve(n);
+        normalImpulse.reserve(n);
+        tangentImpulse.reserve(n);
+    }
+
+    void append(const WallContacts &other)
+    {
+        ball.insert(ball.end(), other.ball.begin(), other.ball.end());
+        edge.insert(edge.end(), other.edge.begin(), other.edge.end());
+        normal.insert(normal.end(), other.normal.begin(), other.normal.end());
+        wallVelocity.insert(wallVelocity.end(), other.wallVelocity.begin(), other.wallVelocity.end());
+        penetration.insert(penetration.end(), other.penetration.begin(), other.penetration.end());
+        velocityBias.insert(velocityBias.end(), other.velocityBias.begin(), other.velocityBias.end());
+        normalImpulse.insert(normalImpulse.end(), other.normalImpulse.begin(), other.normalImpulse.end());
+        tangentImpulse.insert(tangentImpulse.end(), other.tangentImpulse.begin(), other.tangentImpulse.end());
+    }
+
+    bool sortedByKey() const
+    {
+        for (std::size_t c = 1; c < size(); c++)
+            if (key(c - 1) > key(c))
+                return false;
+        return true;
+    }
+
+    void sortByKey(StepArena &arena)
+    {
+        ArenaVector<std::size_t> order(size(), 0, ArenaAllocator<std::size_t>(arena));
+        for (std::size_t c = 0; c < order.size(); c++)
+            order[c] = c;
+        std::sort(order.begin(), order.end(), [&](std::size_t l, std::size_t r) { return key(l) < key(r); });
+        permute(ball, order, arena);
+        permute(edge, order, arena);
+        permute(normal, order, arena);
+        permute(wallVelocity, order, arena);
+        permute(penetration, order, arena);
+        permute(velocityBias, order, arena);
+        permute(normalImpulse, order, arena);
+        permute(tangentImpulse, order, arena);
+    }
+
+    // Follow balls that moved during compaction (newIndex[old] is the new index, or -1 if
+    // the ball was removed) so warm starting still finds these contacts next step
+    void remap(const ArenaVector<int> &newIndex, StepArena &arena)
+    {
+        std::size_t kept = 0;
+        for (std::size_t c = 0; c < size(); c++) {
+            if (newIndex[ball[c]] < 0)
+                continue;
+            ball[kept] = newIndex[ball[c]];
+            edge[kept] = edge[c];
+            normal[kept] = normal[c];
+            wallVelocity[kept] = wallVelocity[c];
+            penetration[kept] = penetration[c];
+            velocityBias[kept] = velocityBias[c];
+            normalImpulse[kept] = normalImpulse[c];
+            tangentImpulse[kept] = tangentImpulse[c];
+            kept++;
+        }
+        ball.resize(kept);
+        edge.resize(kept);
+        normal.resize(kept);
+        wallVelocity.resize(kept);
+        penetration.resize(kept);
+        velocityBias.resize(kept);
+        normalImpulse.resize(kept);
+        tangentImpulse.resize(kept);
+        if (!sortedByKey())
+            sortByKey(arena);
+    }
+};
+
+//------------------------------------------------------------
+// A batch of ball-vs-ball contacts. 'a' < 'b' and the normal points from a to b.
+//------------------------------------------------------------
+template <typename T>
+struct BallContacts {
+    std::vector<int> a;
+    std::vector<int> b;
+    std::vector<sf::Vector2<T>> normal;
+    std::vector<T> penetration;
+    std::vector<T> velocityBias;
+    std::vector<T> normalImpulse;
+    std::vector<T> tangentImpulse;
+
+    std::size_t size() const { return a.size(); }
+
+    std::uint64_t key(std::size_t c) const
+    {
+        return (static_cast<std::uint64_t>(a[c]) << 32) | static_cast<std::uint32_t>(b[c]);
+    }
+
+    void clear()
+    {
+        a.clear();
+        b.clear();
+        normal.clear();
+        penetration.clear();
+        velocityBias.clear();
+        normalImpulse.clear();
+        tangentImpulse.clear();
+    }
+
+    void append(const BallContacts &other)
+    {
+        a.insert(a.end(), other.a.begin(), other.a.end());
+        b.insert(b.end(), other.b.begin(), other.b.end());
+        normal.insert(normal.end(), other.normal.begin(), other.normal.end());
+        penetration.insert(penetration.end(), other.penetration.begin(), other.penetration.end());
+        velocityBias.insert(velocityBias.end(), other.velocityBias.begin(), other.velocityBias.end());
+        normalImpulse.insert(normalImpulse.end(), other.normalImpulse.begin(), other.normalImpulse.end());
+        tangentImpulse.insert(tangentImpulse.end(), other.tangentImpulse.begin(), other.tangentImpulse.end());
+    }
+
+    bool sortedByKey() const
+    {
+        for (std::size_t c = 1; c < size(); c++)
+            if (key(c - 1) > key(c))
+                return false;
+        return true;
+    }
+
+    void sortByKey(StepArena &arena)
+    {
+        ArenaVector<std::size_t> order(size(), 0, ArenaAllocator<std::size_t>(arena));
+        for (std::size_t c = 0; c < order.size(); c++)
+            order[c] = c;
+        std::sort(order.begin(), order.end(), [&](std::size_t l, std::size_t r) { return key(l) < key(r); });
+        permute(a, order, arena);
+        permute(b, order, arena);
+        permute(normal, order, arena);
+        permute(penetration, order, arena);
+        permute(velocityBias, order, arena);
+        permute(normalImpulse, order, arena);
+        permute(tangentImpulse, order, arena);
+    }
+
+    // Follow balls that moved during compaction, keeping a < b (see WallContacts::remap)
+    void remap(const ArenaVector<int> &newIndex, StepArena &arena)
+    {
+        std::size_t kept = 0;
+        for (std::size_t c = 0; c < size(); c++) {
+            int na = newIndex[a[c]], nb = newIndex[b[c]];
+            if (na < 0 || nb < 0)
+                continue;
+            bool flip = na > nb;
+            a[kept] = flip ? nb : na;
+            b[kept] = flip ? na : nb;
+            normal[kept] = flip ? -normal[c] : normal[c];
+            penetration[kept] = penetration[c];
+            velocityBias[kept] = velocityBias[c];
+            normalImpulse[kept] = normalImpulse[c];
+            tangentImpulse[kept] = tangentImpulse[c]; // the tangent flips with the normal
+            kept++;
+        }
+        a.resize(kept);
+        b.resize(kept);
+        normal.resize(kept);
+        penetration.resize(kept);
+        velocityBias.resize(kept);
+        normalImpulse.resize(kept);
+        tangentImpulse.resize(kept);
+        if (!sortedByKey())
+            sortByKey(arena);
+    }
+};
+
+//------------------------------------------------------------
+// Check collision of a ball with the edge starting at point a with inward unit normal
+// 'normal'. A contact is recorded when the ball overlaps the edge; the response is applied
+// later by the solver.
+// 'pivot' and 'angularSpeed' (radians per second) describe how the edge is rotating.
+// Geometry is evaluated in the position type P; the contact itself is stored in T.
+//------------------------------------------------------------
+template <typename T, typename P>
+void checkCollisionWithEdge(const sf::Vector2<P> &a, const sf::Vector2<P> &normal, int edgeIndex,
+                            int ballIndex, const sf::Vector2<P> &ballPos, T ballRadius,
+                            const sf::Vector2<P> &pivot, P angularSpeed,
+                            WallContacts<T> &contacts)
+{
+    // Signed distance from ball center to the line
+    P dist = dot(ballPos - a, normal);
+    if (dist < P(ballRadius)) {
+        // Velocity of the edge at the contact point: omega x r for a rigid rotation about the pivot
+        sf::Vector2<P> r = ballPos - P(ballRadius) * normal - pivot;
+        contacts.ball.push_back(ballIndex);
+        contacts.edge.push_back(edgeIndex);
+        contacts.normal.push_back(sf::Vector2<T>(normal));
+        contacts.wallVelocity.push_back(sf::Vector2<T>(sf::Vector2<P>(-r.y, r.x) * angularSpeed));
+        contacts.penetration.push_back(T(P(ballRadius) - dist));
+        contacts.velocityBias.push_back(T(0));
+        contacts.normalImpulse.push_back(T(0));
+        contacts.tangentImpulse.push_back(T(0));
+    }
+}
+
+//------------------------------------------------------------
+// Local-space tables of a regular polygon laid out like createPolygon (centered at the
+// origin, first vertex at the top): vertices and inward unit edge normals. Shared by the
+// renderer (PolygonShape) and the physics (Boundary::setFromGeometry).
+//------------------------------------------------------------
+struct PolygonGeometry {
+    int sides = 0;
+    float radius = 0.f;
+    std::vector<sf::Vector2f> vertices;
+    std::vector<sf::Vector2f> normals; // inward unit normal of vertices[i] -> vertices[i + 1]
+
+    PolygonGeometry(int sideCount, float polygonRadius) : sides(sideCount), radius(polygonRadius)
+    {
+        vertices.resize(sides);
+        normals.resize(sides);
+        for (int i = 0; i < sides; i++) {
+            float angle = 2 * PI * i / sides - PI / 2; // start at the top
+            vertices[i] = sf::Vector2f(radius * std::cos(angle), radius * std::sin(angle));
+        }
+        for (int i = 0; i < sides; i++) {
+            sf::Vector2f edge = vertices[(i + 1) % sides] - vertices[i];
+            normals[i] = normalize(sf::Vector2f(-edge.y, edge.x));
+        }
+    }
+};
+
+//------------------------------------------------------------
+// Geometry cache keyed by (sides, radius). Entries are built on first use and never move,
+// so switching back to a shape seen before costs a lookup and no trig or allocation.
+//------------------------------------------------------------
+struct GeometryCache {
+    std::map<std::pair<int, float>, PolygonGeometry> entries;
+
+    const PolygonGeometry &get(int sides, float radius)
+    {
+        auto it = entries.find(std::make_pair(sides, radius));
+        if (it == entries.end())
+            it = entries.emplace(std::make_pair(sides, radius), PolygonGeometry(sides, radius)).first;
+        return it->second;
+    }
+};
+
+//------------------------------------------------------------
+// The polygon as the physics sees it: world-space vertices in counterclockwise order, the
+// inward unit normal of each edge (points[i] -> points[i + 1]), the pivot it rotates about
+// and its angular speed in radians per second.
+//------------------------------------------------------------
+template <typename T>
+struct Boundary {
+    std::vector<sf::Vector2<T>> points;
+    std::vector<sf::Vector2<T>> normals;
+    sf::Vector2<T> pivot;
+    T angularSpeed = T(0);
+
+    // The boundary of a drawn polygon (accounting for rotation & position)
+    void setFromShape(const sf::ConvexShape &polygon, T speed)
+    {
+        sf::Transform transform = polygon.getTransform();
+        points.resize(polygon.getPointCount());
+        for (std::size_t i = 0; i < points.size(); i++)
+            points[i] = sf::Vector2<T>(transform.transformPoint(polygon.getPoint(i)));
+        pivot = sf::Vector2<T>(polygon.getPosition());
+        angularSpeed = speed;
+        updateNormals();
+    }
+
+    // A cached regular polygon rotated by 'angle' radians about 'center': one sin/cos pair
+    // per call, and the normals are rotated rather than renormalized
+    void setFromGeometry(const PolygonGeometry &geometry, T angle, const sf::Vector2<T> &center, T speed)
+    {
+        using std::cos;
+        using std::sin;
+        T c = cos(angle), s = sin(angle);
+        std::size_t count = geometry.vertices.size();
+        points.resize(count);
+        normals.resize(count);
+        for (std::size_t i = 0; i < count; i++) {
+            sf::Vector2<T> v(geometry.vertices[i]), n(geometry.normals[i]);
+            points[i] = center + sf::Vector2<T>(c * v.x - s * v.y, s * v.x + c * v.y);
+            normals[i] = sf::Vector2<T>(c * n.x - s * n.y, s * n.x + c * n.y);
+        }
+        pivot = center;
+        angularSpeed = speed;
+    }
+
+    // A regular polygon, laid out like createPolygon, rotated by 'angle' radians about 'center'
+    void setRegular(int sides, T radius, T angle, const sf::Vector2<T> &center, T speed)
+    {
+        using std::cos;
+        using std::sin;
+        points.resize(sides);
+        for (int i = 0; i < sides; i++) {
+            T a = T(2) * T(PI) * T(i) / T(sides) - T(PI) / T(2) + angle; // start at the top
+            points[i] = center + sf::Vector2<T>(radius * cos(a), radius * sin(a));
+        }
+        pivot = center;
+        angularSpeed = speed;
+        updateNormals();
+    }
+
+    // False once 'p' is more than 'margin' past any edge line: one dot product per edge
+    bool contains(const sf::Vector2<T> &p, T margin) const
+    {
+        for (std::size_t i = 0; i < points.size(); i++) {
+            if (dot(p - points[i], normals[i]) < -margin)
+                return false;
+        }
+        return true;
+    }
+
+private:
+    // In a convex polygon defined in counterclockwise order, the inward normal is the left-hand normal.
+    void updateNormals()
+    {
+        std::size_t count = points.size();
+        normals.resize(count);
+        for (std::size_t i = 0; i < count; i++) {
+            sf::Vector2<T> edge = points[(i + 1) % count] - points[i];
+            normals[i] = normalize(sf::Vector2<T>(-edge.y, edge.x));
+        }
+    }
+};
+
+//------------------------------------------------------------
+// Gather contacts between the listed balls (in ascending order) and every edge of the (rotating) polygon.
+// The first form appends the contacts of indices[begin, end).
+//------------------------------------------------------------
+template <typename T, typename P>
+void collectWallContacts(const Boundary<P> &boundary, const Balls<T, P> &balls, T ballRadius,
+                         const std::vector<int> &indices, std::size_t begin, std::size_t end,
+                         WallContacts<T> &contacts)
+{
+    int count = static_cast<int>(boundary.points.size());
+    for (std::size_t k = begin; k < end; k++) {
+        int n = indices[k];
+        for (int i = 0; i < count; i++) {
+            checkCollisionWithEdge(boundary.points[i], boundary.normals[i], i, n,
+                                   balls.position[n], ballRadius,
+                                   boundary.pivot, boundary.angularSpeed, contacts);
+        }
+    }
+}
+
+template <typename T, typename P>
+void collectWallContacts(const Boundary<P> &boundary, const Balls<T, P> &balls, T ballRadius,
+                         const std::vector<int> &indices, WallContacts<T> &contacts)
+{
+    contacts.clear();
+    collectWallContacts(boundary, balls, ballRadius, indices, 0, indices.size(), contacts);
+}
+
+//------------------------------------------------------------
+// Uniform hash grid used to find overlapping ball pairs. Cells are one ball diameter wide,
+// so only the 3x3 block of cells around a ball can hold balls touching it. P is the position type.
+//------------------------------------------------------------
+template <typename P>
+struct BallGrid {
+    P cellSize = P(1);
+    std::vector<int> cellStart; // prefix sums into 'entries', one slot per hash bucket (+1)
+    std::vector<int> entries;   // ball indices sorted by bucket
+    std::vector<int> bucketOf;  // bucket of each listed ball
+    std::vector<int> fill;
+
+    static std::int32_t cellCoord(P v, P cellSize) { return floorToInt(v / cellSize); }
+
+    std::size_t bucket(std::int32_t cx, std::int32_t cy) const
+    {
+        std::uint32_t h = static_cast<std::uint32_t>(cx) * 73856093u ^ static_cast<std::uint32_t>(cy) * 19349663u;
+        return h & (cellStart.size() - 2);
+    }
+
+    // Insert the listed balls
+    template <typename T>
+    void build(const Balls<T, P> &balls, const std::vector<int> &indices, T ballRadius)
+    {
+        cellSize = P(2) * P(ballRadius);
+        std::size_t buckets = 64;
+        while (buckets < 2 * indices.size())
+            buckets *= 2;
+        cellStart.assign(buckets + 1, 0);
+        bucketOf.resize(indices.size());
+        entries.resize(indices.size());
+
+        // Counting sort of the balls into buckets
+        for (std::size_t k = 0; k < indices.size(); k++) {
+            sf::Vector2<P> p = balls.position[indices[k]];
+            bucketOf[k] = static_cast<int>(bucket(cellCoord(p.x, cellSize), cellCoord(p.y, cellSize)));
+            cellStart[bucketOf[k] + 1]++;
+        }
+        for (std::size_t k = 1; k < cellStart.size(); k++)
+            cellStart[k] += cellStart[k - 1];
+        fill.assign(cellStart.begin(), cellStart.end() - 1);
+        for (std::size_t k = 0; k < indices.size(); k++)
+            entries[fill[bucketOf[k]]++] = indices[k];
+    }
+
+    // Call f(j) for every ball in the 3x3 cells around p (possibly more than once on hash collisions)
+    template <typename F>
+    void forEachNear(const sf::Vector2<P> &p, F f) const
+    {
+        if (entries.empty())
+            return;
+        std::int32_t cx = cellCoord(p.x, cellSize);
+        std::int32_t cy = cellCoord(p.y, cellSize);
+        for (std::int32_t dy = -1; dy <= 1; dy++) {
+            for (std::int32_t dx = -1; dx <= 1; dx++) {
+                std::size_t k = bucket(cx + dx, cy + dy);
+                for (int e = cellStart[k]; e < cellStart[k + 1]; e++)
+                    f(entries[e]);
+            }
+        }
+    }
+};
+
+//------------------------------------------------------------
+// Gather contacts between overlapping balls, emitted in (a, b) key order. Every contact
+// involves at least one awake ball: awake balls are tested against each other and against
+// the sleeping balls, whose grid only changes when balls fall asleep or wake up.
+// The first form appends the contacts of awake[begin, end) against built grids.
+//------------------------------------------------------------
+template <typename T, typename P, typename Candidates>
+void collectBallContacts(const Balls<T, P> &balls, T ballRadius, const std::vector<int> &awake,
+                         std::size_t begin, std::size_t end, const BallGrid<P> &grid,
+                         const BallGrid<P> &sleepingGrid, BallContacts<T> &contacts, Candidates &candidates)
+{
+    const P minDist = P(2) * P(ballRadius);
+    for (std::size_t k = begin; k < end; k++) {
+        int i = awake[k];
+        sf::Vector2<P> p = balls.position[i];
+        auto test = [&](int j) {
+            sf::Vector2<P> d = balls.position[j] - p;
+            if (dot(d, d) < minDist * minDist)
+                candidates.push_back(j);
+        };
+
+        candidates.clear();
+        grid.forEachNear(p, [&](int j) {
+            if (j > i)
+                test(j);
+        });
+        // A ball woken since the sleeping grid was built is still listed in it, and is
+        // already tested through the awake grid
+        sleepingGrid.forEachNear(p, [&](int j) {
+            if (!balls.awake[j])
+                test(j);
+        });
+        // Hash collisions can list the same bucket twice
+        std::sort(candidates.begin(), candidates.end());
+        candidates.erase(std::unique(candidates.begin(), candidates.end()), candidates.end());
+
+        for (int j : candidates) {
+            int a = std::min(i, j), b = std::max(i, j);
+            sf::Vector2<P> d = balls.position[b] - balls.position[a];
+            P dist = length(d);
+            contacts.a.push_back(a);
+            contacts.b.push_back(b);
+            contacts.normal.push_back(dist > P(0) ? sf::Vector2<T>(d / dist) : sf::Vector2<T>(T(0), T(1)));
+            contacts.penetration.push_back(T(minDist - dist));
+            contacts.velocityBias.push_back(T(0));
+            contacts.normalImpulse.push_back(T(0));
+            contacts.tangentImpulse.push_back(T(0));
+        }
+    }
+}
+
+template <typename T, typename P>
+void collectBallContacts(const Balls<T, P> &balls, T ballRadius, const std::vector<int> &awake,
+                         BallGrid<P> &grid, const BallGrid<P> &sleepingGrid, BallContacts<T> &contacts,
+                         StepArena &arena)
+{
+    grid.build(balls, awake, ballRadius);
+    contacts.clear();
+
+    ArenaVector<int> candidates{ArenaAllocator<int>(arena)};
+    candidates.reserve(32);
+    collectBallContacts(balls, ballRadius, awake, 0, awake.size(), grid, sleepingGrid, contacts, candidates);
+    // Contacts with a sleeping ball of lower index come out of order
+    if (!contacts.sortedByKey())
+        contacts.sortByKey(arena);
+}
+
+//------------------------------------------------------------
+// Copy the accumulated impulses of contacts that persist from the previous step.
+// Both batches are sorted by key, so a single merge pass finds the matches.
+//------------------------------------------------------------
+template <typename Contacts>
+void matchPersistentContacts(const Contacts &previous, Contacts &current)
+{
+    std::size_t p = 0;
+    for (std::size_t c = 0; c < current.size(); c++) {
+        std::uint64_t key = current.key(c);
+        while (p < previous.size() && previous.key(p) < key)
+            p++;
+        if (p < previous.size() && previous.key(p) == key) {
+            current.normalImpulse[c] = previous.normalImpulse[p];
+            current.tangentImpulse[c] = previous.tangentImpulse[p];
+        }
+    }
+}
+
+//------------------------------------------------------------
+// Work-stealing job system for the parallel step. parallelFor() cuts [0, count) into chunks
+// of 'grain' items and deals each thread a contiguous run of them, so a thread streams
+// through one stretch of the ball arrays. A thread takes chunks from the front of its run;
+// once it is empty it steals from the back of another thread's run. The calling thread
+// works too, and the call returns when every chunk is done.
+//
+// Chunks depend only on 'count' and 'grain', never on the thread count. Callers that keep
+// one result per chunk and combine them in chunk order get the same answer on any number of
+// threads.
+//------------------------------------------------------------
+struct JobSystem {
+    explicit JobSystem(unsigned threadCount) : queues(std::max(1u, threadCount))
+    {
+        for (unsigned w = 1; w < queues.size(); w++)
+            workers.emplace_back([this, w] { workerLoop(w); });
+    }
+
+    ~JobSystem()
+    {
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            stopping = true;
+        }
+        wake.notify_all();
+        for (std::thread &worker : workers)
+            worker.join();
+    }
+
+    unsigned threads() const { return static_cast<unsigned>(queues.size()); }
+
+    // Chunks taken from another thread's run since construction
+    std::size_t steals() const
+    {
+        std::size_t total = 0;
+        for (const ChunkQueue &queue : queues)
+            total += queue.steals;
+        return total;
+    }
+
+    // Call f(chunk, begin, end) for every chunk of [0, count)
+    template <typename F>
+    void parallelFor(std::size_t count, std::size_t grain, const F &f)
+    {
+        grain = std::max<std::size_t>(grain, 1);
+        std::size_t chunks = (count + grain - 1) / grain;
+        if (chunks <= 1 || queues.size() == 1) {
+            for (std::size_t chunk = 0; chunk < chunks; chunk++)
+                f(chunk, chunk * grain, std::min(count, (chunk + 1) * grain));
+            return;
+        }
+        struct Context {
+            const F *f;
+            std::size_t count, grain;
+        } context{&f, count, grain};
+        run(chunks, [](const void *data, std::size_t chunk) {
+            const Context &c = *static_cast<const Context *>(data);
+            (*c.f)(chunk, chunk * c.grain, std::min(c.count, (chunk + 1) * c.grain));
+        }, &context);
+    }
+
+private:
+    // One thread's run of chunks, on its own cache line
+    struct alignas(64) ChunkQueue {
+        std::mutex lock;
+        std::size_t begin = 0, end = 0;
+        std::size_t steals = 0;
+    };
+
+    std::vector<ChunkQueue> queues;
+    std::vector<std::thread> workers;
+    std::mutex mutex;
+    std::condition_variable wake;
+    bool stopping = false;
+    std::uint64_t generation = 0;
+    void (*job)(const void *, std::size_t) = nullptr;
+    const void *jobData = nullptr;
+    std::atomic<std::size_t> remaining{0};
+    std::atomic<unsigned> active{0}; // workers inside the current job
+
+    void run(std::size_t chunks, void (*fn)(const void *, std::size_t), const void *data)
+    {
+        std::size_t threadCount = queues.size();
+        for (std::size_t w = 0; w < threadCount; w++) {
+            queues[w].begin = chunks * w / threadCount;
+            queues[w].end = chunks * (w + 1) / threadCount;
+        }
+        remaining.store(chunks, std::memory_order_relaxed);
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            job = fn;
+            jobData = data;
+            generation++;
+        }
+        wake.notify_all();
+        work(0, fn, data);
+        while (remaining.load(std::memory_order_acquire) != 0)
+            std::this_thread::yield();
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            job = nullptr; // a worker waking late must not join a finished job
+        }
+        while (active.load(std::memory_order_acquire) != 0)
+            std::this_thread::yield();
+    }
+
+    void workerLoop(unsigned w)
+    {
+        std::uint64_t seen = 0;
+        for (;;) {
+            void (*fn)(const void *, std::size_t);
+            const void *data;
+            {
+                std::unique_lock<std::mutex> lock(mutex);
+                wake.wait(lock, [&] { return stopping || (job && generation != seen); });
+                if (stopping)
+                    return;
+                seen = generation;
+                fn = job;
+                data = jobData;
+                active.fetch_add(1, std::memory_order_acq_rel);
+            }
+            work(w, fn, data);
+            active.fetch_sub(1, std::memory_order_acq_rel);
+        }
+    }
+
+    void work(std::size_t w, void (*fn)(const void *, std::size_t), const void *data)
+    {
+        std::size_t chunk;
+        while (takeOwn(w, chunk) || steal(w, chunk)) {
+            fn(data, chunk);
+            remaining.fetch_sub(1, std::memory_order_acq_rel);
+        }
+    }
+
+    bool takeOwn(std::size_t w, std::size_t &chunk)
+    {
+        ChunkQueue &queue = queues[w];
+        std::lock_guard<std::mutex> lock(queue.lock);
+        if (queue.begin == queue.end)
+            return false;
+        chunk = queue.begin++;
+        return true;
+    }
+
+    bool steal(std::size_t w, std::size_t &chunk)
+    {
+        for (std::size_t k = 1; k < queues.size(); k++) {
+            ChunkQueue &victim = queues[(w + k) % queues.size()];
+            std::lock_guard<std::mutex> lock(victim.lock);
+            if (victim.begin != victim.end) {
+                chunk = --victim.end;
+                queues[w].steals++;
+                return true;
+            }
+        }
+        return false;
+    }
+};
+
+// parallelFor on 'jobs', or the same chunks in order on this thread without one
+template <typename F>
+void forEachChunk(JobSystem *jobs, std::size_t count, std::size_t grain, const F &f)
+{
+    if (jobs) {
+        jobs->parallelFor(count, grain, f);
+        return;
+    }
+    for (std::size_t begin = 0, chunk = 0; begin < count; begin += grain, chunk++)
+        f(chunk, begin, std::min(count, begin + grain));
+}
+
+//------------------------------------------------------------
+// Sequential-impulse solver for wall and ball contacts. Each iteration applies, per contact,
+// a Coulomb-clamped friction impulse and a non-negative normal impulse that drives the
+// relative normal velocity toward the contact's velocity bias. Impulses are accumulated per
+// contact and carried over between steps (warm starting), so resting piles converge in a
+// handful of iterations. Overlap is corrected through the bias instead of moving balls directly.
+//------------------------------------------------------------
+template <typename T, typename P = T>
+struct ContactSolver {
+    static const std::size_t COLLECT_GRAIN = 1024; // awake balls per chunk in a parallel collect
+    static const std::size_t SOLVE_GRAIN = 512;    // contacts per chunk in a parallel solve
+    static const int MAX_COLORS = 64;              // contacts past this many colors are solved serially
+
+    int iterations = SOLVER_ITERATIONS;
+    bool warmStarting = true;
+    bool ballCollisions = true; // off when balls stand for independent trials (Monte Carlo batches)
+    T restitution = T(RESTITUTION);
+    T friction = T(WALL_FRICTION);
+
+    WallContacts<T> wall, previousWall;
+    BallContacts<T> pairs, previousPairs;
+    BallGrid<P> grid;         // awake balls, rebuilt every step
+    BallGrid<P> sleepingGrid; // sleeping balls, rebuilt when the sleeping set changes
+    std::size_t colorCount = 0; // colors used by the last parallel solve
+
+    // Gather the contacts of the awake balls. A sleeping ball touched by an awake one is woken
+    // and appended to 'awake', so its wall contacts are gathered in the same step.
+    // With 'jobs', chunks of the awake list are collected in parallel and concatenated in
+    // order, which gives exactly the contacts of the serial collection.
+    void collect(const Boundary<P> &boundary, Balls<T, P> &balls, T ballRadius, std::vector<int> &awake,
+                 StepArena &arena, JobSystem *jobs = nullptr)
+    {
+        std::swap(wall, previousWall);
+        std::swap(pairs, previousPairs);
+        std::size_t chunkCount = (awake.size() + COLLECT_GRAIN - 1) / COLLECT_GRAIN;
+        if (jobs && chunks.size() < chunkCount)
+            chunks.resize(chunkCount);
+        if (!ballCollisions) {
+            pairs.clear();
+        } else if (jobs) {
+            grid.build(balls, awake, ballRadius);
+            jobs->parallelFor(awake.size(), COLLECT_GRAIN, [&](std::size_t chunk, std::size_t begin, std::size_t end) {
+                chunks[chunk].pairs.clear();
+                collectBallContacts(balls, ballRadius, awake, begin, end, grid, sleepingGrid, chunks[chunk].pairs,
+                                    chunks[chunk].candidates);
+            });
+            pairs.clear();
+            for (std::size_t chunk = 0; chunk < chunkCount; chunk++)
+                pairs.append(chunks[chunk].pairs);
+            if (!pairs.sortedByKey())
+                pairs.sortByKey(arena);
+        } else {
+            collectBallContacts(balls, ballRadius, awake, grid, sleepingGrid, pairs, arena);
+        }
+
+        bool woke = false;
+        for (std::size_t c = 0; c < pairs.size(); c++) {
+            for (int i : {pairs.a[c], pairs.b[c]}) {
+                if (!balls.awake[i]) {
+                    balls.wake(i);
+                    awake.push_back(i);
+                    woke = true;
+                }
+            }
+        }
+        if (woke)
+            std::sort(awake.begin(), awake.end());
+
+        if (jobs) {
+            chunkCount = (awake.size() + COLLECT_GRAIN - 1) / COLLECT_GRAIN;
+            if (chunks.size() < chunkCount)
+                chunks.resize(chunkCount);
+            jobs->parallelFor(awake.size(), COLLECT_GRAIN, [&](std::size_t chunk, std::size_t begin, std::size_t end) {
+                chunks[chunk].wall.clear();
+                collectWallContacts(boundary, balls, ballRadius, awake, begin, end, chunks[chunk].wall);
+            });
+            wall.clear();
+            for (std::size_t chunk = 0; chunk < chunkCount; chunk++)
+                wall.append(chunks[chunk].wall);
+        } else {
+            collectWallContacts(boundary, balls, ballRadius, awake, wall);
+        }
+        if (warmStarting) {
+            matchPersistentContacts(previousWall, wall);
+            matchPersistentContacts(previousPairs, pairs);
+        }
+    }
+
+    // Without 'jobs', contacts are relaxed one after another, walls first. With 'jobs' they
+    // are relaxed color by color (see colorContacts): the contacts of one color share no
+    // ball, so they run in parallel and in any order with the same result on any number of
+    // threads. The result differs from the serial order's, as any Gauss-Seidel reordering does.
+    void solve(Balls<T, P> &balls, T ballRadius, T dt, JobSystem *jobs = nullptr)
+    {
+        Coefficients k;
+        k.radius = ballRadius;
+        k.invInertia = T(2) / (ballRadius * ballRadius);
+        k.wallNormalMass = T(1);          // unit-mass ball against an immovable edge
+        k.wallTangentMass = T(1) / T(3);  // 1 / (1/m + R^2/I)
+        k.pairNormalMass = T(1) / T(2);   // 1 / (1/ma + 1/mb)
+        k.pairTangentMass = T(1) / T(6);  // 1 / (1/ma + 1/mb + R^2/Ia + R^2/Ib)
+        k.positionBias = T(BAUMGARTE) / dt;
+        k.slop = T(PENETRATION_SLOP);
+        k.bounceThreshold = T(RESTITUTION_THRESHOLD);
+
+        if (!jobs) {
+            // Prepare: velocity bias from restitution and position correction, then warm start
+            for (std::size_t c = 0; c < wall.size(); c++)
+                prepareWall(balls, k, c);
+            for (std::size_t c = 0; c < pairs.size(); c++)
+                preparePair(balls, k, c);
+            for (int iter = 0; iter < iterations; iter++) {
+                for (std::size_t c = 0; c < wall.size(); c++)
+                    relaxWall(balls, k, c);
+                for (std::size_t c = 0; c < pairs.size(); c++)
+                    relaxPair(balls, k, c);
+            }
+            return;
+        }
+
+        colorContacts(balls.size());
+        std::size_t walls = wall.size();
+        auto eachColor = [&](auto &&f) {
+            for (int color = 0; color <= MAX_COLORS; color++) {
+                std::size_t first = colorStart[color], count = colorStart[color + 1] - first;
+                std::size_t grain = color == MAX_COLORS ? std::max<std::size_t>(count, 1) : SOLVE_GRAIN;
+                jobs->parallelFor(count, grain, [&](std::size_t, std::size_t begin, std::size_t end) {
+                    for (std::size_t n = first + begin; n < first + end; n++)
+                        f(colorOrder[n]);
+                });
+            }
+        };
+        eachColor([&](std::size_t c) { c < walls ? prepareWall(balls, k, c) : preparePair(balls, k, c - walls); });
+        for (int iter = 0; iter < iterations; iter++)
+            eachColor([&](std::size_t c) { c < walls ? relaxWall(balls, k, c) : relaxPair(balls, k, c - walls); });
+    }
+
+private:
+    struct Coefficients {
+        T radius, invInertia;
+        T wallNormalMass, wallTangentMass, pairNormalMass, pairTangentMass;
+        T positionBias, slop, bounceThreshold;
+
+        // Deep overlaps (e.g. after tunneling) are corrected over several steps rather than in one kick
+        T correction(T penetration) const
+        {
+            return positionBias * std::min(std::max(penetration - slop, T(0)), radius);
+        }
+    };
+
+    // One chunk's output in a parallel collect, on its own cache lines
+    struct alignas(64) ChunkContacts {
+        WallContacts<T> wall;
+        BallContacts<T> pairs;
+        std::vector<int> candidates;
+    };
+
+    std::vector<ChunkContacts> chunks;
+    std::vector<std::uint64_t> ballColors;  // per ball, the colors of its contacts so far
+    std::vector<std::uint8_t> contactColor;
+    std::vector<std::size_t> colorStart;    // MAX_COLORS + 2 prefix offsets into colorOrder
+    std::vector<std::uint32_t> colorOrder;  // contacts by color: wall c is c, pair c is wall.size() + c
+    std::vector<std::size_t> colorFill;
+
+    // Greedy coloring of the contact graph: each contact takes the lowest color not yet used
+    // at its balls. Discs have few neighbors, so a handful of colors is typical; a contact
+    // that finds all MAX_COLORS taken goes to an extra color that is solved serially.
+    void colorContacts(std::size_t ballCount)
+    {
+        std::size_t walls = wall.size(), total = walls + pairs.size();
+        ballColors.resize(ballCount); // all zero: entries are cleared after every use
+        contactColor.resize(total);
+        colorStart.assign(MAX_COLORS + 2, 0);
+        auto pick = [&](std::uint64_t used) {
+            return used == ~0ull ? MAX_COLORS : __builtin_ctzll(~used);
+        };
+        for (std::size_t c = 0; c < total; c++) {
+            int a = c < walls ? wall.ball[c] : pairs.a[c - walls];
+            int b = c < walls ? a : pairs.b[c - walls];
+            int color = pick(ballColors[a] | ballColors[b]);
+            if (color < MAX_COLORS) {
+                ballColors[a] |= 1ull << color;
+                ballColors[b] |= 1ull << color;
+            }
+            contactColor[c] = static_cast<std::uint8_t>(color);
+            colorStart[color + 1]++;
+        }
+        colorCount = 0;
+        for (int color = 0; color <= MAX_COLORS; color++) {
+            colorCount += colorStart[color + 1] != 0;
+            colorStart[color + 1] += colorStart[color];
+        }
+        colorOrder.resize(total);
+        colorFill.assign(colorStart.begin(), colorStart.end() - 1);
+        for (std::size_t c = 0; c < total; c++)
+            colorOrder[colorFill[contactColor[c]]++] = static_cast<std::uint32_t>(c);
+
+        for (std::size_t c = 0; c < walls; c++)
+            ballColors[wall.ball[c]] = 0;
+        for (std::size_t c = 0; c < pairs.size(); c++)
+            ballColors[pairs.a[c]] = ballColors[pairs.b[c]] = 0;
+    }
+
+    void prepareWall(Balls<T, P> &balls, const Coefficients &k, std::size_t c)
+    {
+        int i = wall.ball[c];
+        sf::Vector2<T> n = wall.normal[c];
+        T vn = dot(balls.velocity[i] - wall.wallVelocity[c], n);
+        T bounce = vn < -k.bounceThreshold ? -restitution * vn : T(0);
+        wall.velocityBias[c] = std::max(bounce, k.correction(wall.penetration[c]));
+
+        T jn = wall.normalImpulse[c], jt = wall.tangentImpulse[c];
+        balls.velocity[i] += jn * n + jt * sf::Vector2<T>(-n.y, n.x);
+        balls.angularVelocity[i] -= k.radius * jt * k.invInertia;
+    }
+
+    void preparePair(Balls<T, P> &balls, const Coefficients &k, std::size_t c)
+    {
+        int a = pairs.a[c], b = pairs.b[c];
+        sf::Vector2<T> n = pairs.normal[c];
+        T vn = dot(balls.velocity[b] - balls.velocity[a], n);
+        T bounce = vn < -k.bounceThreshold ? -restitution * vn : T(0);
+        pairs.velocityBias[c] = std::max(bounce, k.correction(pairs.penetration[c]));
+
+        sf::Vector2<T> impulse = pairs.normalImpulse[c] * n + pairs.tangentImpulse[c] * sf::Vector2<T>(-n.y, n.x);
+        balls.velocity[a] -= impulse;
+        balls.velocity[b] += impulse;
+        balls.angularVelocity[a] -= k.radius * pairs.tangentImpulse[c] * k.invInertia;
+        balls.angularVelocity[b] -= k.radius * pairs.tangentImpulse[c] * k.invInertia;
+    }
+
+    void relaxWall(Balls<T, P> &balls, const Coefficients &k, std::size_t c)
+    {
+        int i = wall.ball[c];
+        sf::Vector2<T> n = wall.normal[c];
+        sf::Vector2<T> t(-n.y, n.x);
+        sf::Vector2<T> relVel = balls.velocity[i] - wall.wallVelocity[c];
+
+        // Friction: the ball's rim moves at v.t - R*omega along the edge
+        T vt = dot(relVel, t) - k.radius * balls.angularVelocity[i];
+        T maxFriction = friction * wall.normalImpulse[c];
+        T oldT = wall.tangentImpulse[c];
+        wall.tangentImpulse[c] = std::max(-maxFriction, std::min(oldT - vt * k.wallTangentMass, maxFriction));
+        T jt = wall.tangentImpulse[c] - oldT;
+        balls.velocity[i] += jt * t;
+        balls.angularVelocity[i] -= k.radius * jt * k.invInertia;
+
+        // Normal: accumulated impulse may push but never pull
+        T vn = dot(balls.velocity[i] - wall.wallVelocity[c], n);
+        T oldN = wall.normalImpulse[c];
+        wall.normalImpulse[c] = std::max(oldN + (wall.velocityBias[c] - vn) * k.wallNormalMass, T(0));
+        balls.velocity[i] += (wall.normalImpulse[c] - oldN) * n;
+    }
+
+    void relaxPair(Balls<T, P> &balls, const Coefficients &k, std::size_t c)
+    {
+        int a = pairs.a[c], b = pairs.b[c];
+        sf::Vector2<T> n = pairs.normal[c];
+        sf::Vector2<T> t(-n.y, n.x);
+
+        T vt = dot(balls.velocity[b] - balls.velocity[a], t)
+             - k.radius * (balls.angularVelocity[a] + balls.angularVelocity[b]);
+        T maxFriction = friction * pairs.normalImpulse[c];
+        T oldT = pairs.tangentImpulse[c];
+        pairs.tangentImpulse[c] = std::max(-maxFriction, std::min(oldT - vt * k.pairTangentMass, maxFriction));
+        T jt = pairs.tangentImpulse[c] - oldT;
+        balls.velocity[a] -= jt * t;
+        balls.velocity[b] += jt * t;
+        balls.angularVelocity[a] -= k.radius * jt * k.invInertia;
+        balls.angularVelocity[b] -= k.radius * jt * k.invInertia;
+
+        T vn = dot(balls.velocity[b] - balls.velocity[a], n);
+        T oldN = pairs.normalImpulse[c];
+        pairs.normalImpulse[c] = std::max(oldN + (pairs.velocityBias[c] - vn) * k.pairNormalMass, T(0));
+        sf::Vector2<T> jn = (pairs.normalImpulse[c] - oldN) * n;
+        balls.velocity[a] -= jn;
+        balls.velocity[b] += jn;
+    }
+};
+
+//------------------------------------------------------------
+// Stable references to balls. Ball arrays stay dense (removal moves the last ball into
+// the hole), so a ball's index changes over its lifetime; a handle names a pool slot that
+// follows the ball, and its generation goes stale as soon as the ball is despawned.
+//------------------------------------------------------------
+struct BallHandle {
+    std::uint32_t slot = 0;
+    std::uint32_t generation = 0; // 0 never matches a live slot
+};
+
+struct BallPool {
+    std::vector<std::uint32_t> generation;  // per slot, bumped on release
+    std::vector<int> indexOfSlot;           // ball index, -1 while the slot is free
+    std::vector<std::uint32_t> slotOfIndex; // per ball index
+    std::vector<std::uint32_t> freeSlots;
+
+    // Give a slot to every ball appended since the last call, so balls added straight
+    // through Balls::add() get handles too
+    void track(std::size_t ballCount)
+    {
+        while (slotOfIndex.size() < ballCount) {
+            std::uint32_t slot;
+            if (freeSlots.empty()) {
+                slot = static_cast<std::uint32_t>(generation.size());
+                generation.push_back(1);
+                indexOfSlot.push_back(-1);
+            } else {
+                slot = freeSlots.back();
+                freeSlots.pop_back();
+            }
+            indexOfSlot[slot] = static_cast<int>(slotOfIndex.size());
+            slotOfIndex.push_back(slot);
+        }
+    }
+
+    BallHandle handleAt(int index) const
+    {
+        std::uint32_t slot = slotOfIndex[index];
+        return BallHandle{slot, generation[slot]};
+    }
+
+    // Current index of the ball, or -1 if the handle is stale
+    int indexOf(BallHandle handle) const
+    {
+        if (handle.slot >= generation.size() || generation[handle.slot] != handle.generation)
+            return -1;
+        return indexOfSlot[handle.slot];
+    }
+
+    void release(BallHandle handle)
+    {
+        generation[handle.slot]++;
+        indexOfSlot[handle.slot] = -1;
+        freeSlots.push_back(handle.slot);
+    }
+
+    // The ball at index 'from' now lives at 'to'
+    void moved(int from, int to)
+    {
+        std::uint32_t slot = slotOfIndex[from];
+        slotOfIndex[to] = slot;
+        indexOfSlot[slot] = to;
+    }
+
+    void popIndex() { slotOfIndex.pop_back(); }
+};
+
+//------------------------------------------------------------
+// Running totals of the balls a simulation has culled
+//------------------------------------------------------------
+struct CullStats {
+    std::size_t escaped = 0; // ended a step wholly outside the polygon
+    std::size_t expired = 0; // outlived Simulation::maxAge
+};
+
+//------------------------------------------------------------
+// Totals of the last step, summed per chunk of the awake list and combined in chunk order,
+// so they come out bit for bit the same on any number of threads
+//------------------------------------------------------------
+struct StepMetrics {
+    double kineticEnergy = 0.0; // linear plus rotational, of the awake balls
+    double maxSpeed = 0.0;
+    std::size_t wallContacts = 0, ballContacts = 0;
+    std::size_t colors = 0;     // contact colors of a parallel solve, 0 for a serial one
+};
+
+//------------------------------------------------------------
+// The simulation: a set of equal-sized balls inside a rotating polygon.
+// A step integrates forces, solves contacts on velocities, then moves the balls.
+//
+// Balls whose whole contact island (balls connected through ball-ball contacts) has stayed
+// below the sleep thresholds for TIME_TO_SLEEP are put to sleep and skipped entirely. They
+// wake when an awake ball touches them or when a moving polygon edge reaches them.
+//
+// A ball that tunnels through an edge can end up stuck outside the polygon and simulated
+// forever. Fast balls overshoot an edge by more than their size for a step or two before the
+// solver pulls them back, so a ball counts as escaped only once it has stayed wholly outside
+// for TIME_TO_ESCAPE. Escaped balls and balls older than maxAge are despawned at the end of
+// the step; their handles go stale like any other despawn.
+//------------------------------------------------------------
+template <typename T, typename P = T>
+struct Simulation {
+    Balls<T, P> balls;
+    T ballRadius = T(10);
+    sf::Vector2<T> gravity = sf::Vector2<T>(T(0), T(GRAVITY));
+    bool allowSleep = true;
+    ContactSolver<T, P> solver;
+    StepArena arena; // transient buffers of the current step
+    BallPool pool;
+    std::vector<int> pendingRemoval; // indices despawned since the last compaction
+    bool cullEscaped = true;
+    T maxAge = T(0); // seconds; 0 keeps balls forever
+    CullStats culled;
+    JobSystem *jobs = nullptr; // when set, step() runs on it (see ContactSolver::solve for the difference)
+    StepMetrics metrics;
+
+    std::vector<int> awakeList;    // ascending indices of awake balls
+    std::vector<int> sleepingList; // ascending indices of sleeping balls
+    std::vector<int> islandParent; // union-find over ball-ball contacts
+    std::vector<T> islandSleepTime;
+    bool listsDirty = true;
+
+    void wake(int i)
+    {
+        balls.wake(i);
+        listsDirty = true;
+    }
+
+    void wakeAll()
+    {
+        for (std::size_t i = 0; i < balls.size(); i++)
+            balls.wake(i);
+        listsDirty = true;
+    }
+
+    std::size_t awakeCount() const { return awakeList.size(); }
+
+    BallHandle spawn(const sf::Vector2<P> &position, const sf::Vector2<T> &velocity = sf::Vector2<T>(T(0), T(0)))
+    {
+        balls.add(position, velocity);
+        listsDirty = true;
+        return handleOf(static_cast<int>(balls.size()) - 1);
+    }
+
+    BallHandle handleOf(int i)
+    {
+        pool.track(balls.size());
+        return pool.handleAt(i);
+    }
+
+    int indexOf(BallHandle handle) const { return pool.indexOf(handle); }
+
+    // The handle goes stale at once; the ball is removed by the next compact()
+    bool despawn(BallHandle handle)
+    {
+        pool.track(balls.size());
+        int i = pool.indexOf(handle);
+        if (i < 0)
+            return false;
+        pool.release(handle);
+        pendingRemoval.push_back(i);
+        return true;
+    }
+
+    // Remove despawned balls, filling each hole with the last ball. Runs at the start of
+    // step(), batched over everything despawned since the previous step, and again at the end
+    // if the step culled any. Live handles and the warm-starting contacts follow the moved balls.
+    void compact()
+    {
+        pool.track(balls.size());
+        std::size_t count = balls.size();
+        ArenaVector<int> origin(count, 0, ArenaAllocator<int>(arena)); // old index of the ball now at k
+        ArenaVector<int> newIndex(count, -1, ArenaAllocator<int>(arena));
+        for (std::size_t k = 0; k < count; k++)
+            origin[k] = static_cast<int>(k);
+
+        // Highest index first, so the ball moved into a hole is never itself pending
+        std::sort(pendingRemoval.begin(), pendingRemoval.end(), std::greater<int>());
+        for (int i : pendingRemoval) {
+            int last = static_cast<int>(balls.size()) - 1;
+            if (i != last) {
+                pool.moved(last, i);
+                origin[i] = origin[last];
+            }
+            balls.swapRemove(i);
+            pool.popIndex();
+        }
+        pendingRemoval.clear();
+
+        for (std::size_t k = 0; k < balls.size(); k++)
+            newIndex[origin[k]] = static_cast<int>(k);
+        solver.wall.remap(newIndex, arena);
+        solver.pairs.remap(newIndex, arena);
+        listsDirty = true;
+    }
+
+    void step(const Boundary<P> &boundary, T dt)
+    {
+        if (dt <= T(0))
+            return;
+        if (!pendingRemoval.empty())
+            compact();
+        if (listsDirty || awakeList.size() + sleepingList.size() != balls.size())
+            rebuildLists();
+
+        forEachChunk(jobs, awakeList.size(), STEP_GRAIN, [&](std::size_t, std::size_t begin, std::size_t end) {
+            for (std::size_t k = begin; k < end; k++) {
+                int i = awakeList[k];
+                // Apply gravity (downward acceleration)
+                balls.velocity[i] += gravity * dt;
+                // Apply friction/damping to gradually slow down the ball
+                balls.velocity[i] *= (T(1) - T(FRICTION_COEFFICIENT) * dt);
+                balls.angularVelocity[i] *= (T(1) - T(FRICTION_COEFFICIENT) * dt);
+            }
+        });
+
+        if (boundary.angularSpeed != P(0) && !sleepingList.empty())
+            wakeBallsTouchingEdges(boundary);
+
+        // Check collision with each edge of the polygon and between balls, then resolve all contacts together.
+        std::size_t awakeBefore = awakeList.size();
+        solver.collect(boundary, balls, ballRadius, awakeList, arena, jobs);
+        if (awakeList.size() != awakeBefore)
+            listsDirty = true;
+        solver.solve(balls, ballRadius, dt, jobs);
+
+        // Update ball positions using the solved velocities
+        std::size_t chunkCount = (awakeList.size() + STEP_GRAIN - 1) / STEP_GRAIN;
+        if (chunkMetrics.size() < chunkCount)
+            chunkMetrics.resize(chunkCount);
+        forEachChunk(jobs, awakeList.size(), STEP_GRAIN, [&](std::size_t chunk, std::size_t begin, std::size_t end) {
+            double energy = 0.0, maxSpeedSquared = 0.0;
+            for (std::size_t k = begin; k < end; k++) {
+                int i = awakeList[k];
+                balls.position[i] += sf::Vector2<P>(balls.velocity[i] * dt);
+                balls.angle[i] += balls.angularVelocity[i] * dt;
+                double speedSquared = static_cast<double>(dot(balls.velocity[i], balls.velocity[i]));
+                double spin = static_cast<double>(balls.angularVelocity[i] * ballRadius);
+                energy += 0.5 * speedSquared + 0.25 * spin * spin; // I = m r^2 / 2
+                maxSpeedSquared = std::max(maxSpeedSquared, speedSquared);
+            }
+            chunkMetrics[chunk].energy = energy;
+            chunkMetrics[chunk].maxSpeedSquared = maxSpeedSquared;
+        });
+        metrics = StepMetrics();
+        for (std::size_t chunk = 0; chunk < chunkCount; chunk++) {
+            metrics.kineticEnergy += chunkMetrics[chunk].energy;
+            metrics.maxSpeed = std::max(metrics.maxSpeed, chunkMetrics[chunk].maxSpeedSquared);
+        }
+        metrics.maxSpeed = std::sqrt(metrics.maxSpeed);
+        metrics.wallContacts = solver.wall.size();
+        metrics.ballContacts = solver.pairs.size();
+        metrics.colors = jobs ? solver.colorCount : 0;
+
+        if (allowSleep)
+            updateSleep(dt);
+        if (cullEscaped || maxAge > T(0))
+            cullBalls(boundary, dt);
+        // Culled balls leave at once, so they are never drawn after the step that lost them
+        if (!pendingRemoval.empty())
+            compact();
+        arena.reset();
+    }
+
+private:
+    static const std::size_t STEP_GRAIN = 4096; // awake balls per chunk of integration
+
+    // One chunk's share of the metrics, on its own cache line
+    struct alignas(64) ChunkMetrics {
+        double energy = 0.0;
+        double maxSpeedSquared = 0.0;
+    };
+    std::vector<ChunkMetrics> chunkMetrics;
+
+    void rebuildLists()
+    {
+        awakeList.clear();
+        sleepingList.clear();
+        for (std::size_t i = 0; i < balls.size(); i++)
+            (balls.awake[i] ? awakeList : sleepingList).push_back(static_cast<int>(i));
+        solver.sleepingGrid.build(balls, sleepingList, ballRadius);
+        listsDirty = false;
+    }
+
+    // A sleeping ball resting against a rotating edge is dragged along, so wake it. Only the
+    // sleeping grid cells along each edge are visited: samples one cell apart cover, through
+    // their 3x3 blocks, every ball within a ball radius (plus slop) of the edge.
+    void wakeBallsTouchingEdges(const Boundary<P> &boundary)
+    {
+        const BallGrid<P> &grid = solver.sleepingGrid;
+        const P reach = P(ballRadius + T(PENETRATION_SLOP));
+        std::size_t count = boundary.points.size();
+        for (std::size_t e = 0; e < count; e++) {
+            sf::Vector2<P> a = boundary.points[e], d = boundary.points[(e + 1) % count] - a;
+            int samples = floorToInt(length(d) / grid.cellSize) + 1;
+            for (int k = 0; k <= samples; k++) {
+                grid.forEachNear(a + d * (P(k) / P(samples)), [&](int i) {
+                    if (balls.awake[i] || dot(balls.position[i] - a, boundary.normals[e]) >= reach)
+                        return;
+                    balls.wake(i);
+                    awakeList.insert(std::lower_bound(awakeList.begin(), awakeList.end(), i), i);
+                    listsDirty = true;
+                });
+            }
+        }
+    }
+
+    // Only awake balls can have moved out of the polygon (a moving edge wakes the sleeping
+    // balls it reaches), but every ball ages. Balls that fell asleep in this step are still in
+    // awakeList; one that came to rest outside will never be checked again, so it goes at once.
+    void cullBalls(const Boundary<P> &boundary, T dt)
+    {
+        if (cullEscaped) {
+            for (int i : awakeList) {
+                if (boundary.contains(balls.position[i], P(ballRadius))) {
+                    balls.outsideTime[i] = T(0);
+                    continue;
+                }
+                balls.outsideTime[i] += dt;
+                if ((balls.outsideTime[i] >= T(TIME_TO_ESCAPE) || !balls.awake[i]) && despawn(handleOf(i)))
+                    culled.escaped++;
+            }
+        }
+        if (maxAge > T(0)) {
+            for (std::size_t i = 0; i < balls.size(); i++) {
+                balls.age[i] += dt;
+                if (balls.age[i] > maxAge && despawn(handleOf(static_cast<int>(i))))
+                    culled.expired++;
+            }
+        }
+    }
+
+    int findIsland(int i)
+    {
+        while (islandParent[i] != i) {
+            islandParent[i] = islandParent[islandParent[i]];
+            i = islandParent[i];
+        }
+        return i;
+    }
+
+    // Advance the per-ball sleep timers, then put to sleep every island whose slowest-to-settle
+    // ball has been slow for long enough. Wall contacts do not join islands: the polygon is
+    // kinematic, and a ball dragged by a moving edge never gets slow enough to sleep anyway.
+    void updateSleep(T dt)
+    {
+        islandParent.resize(balls.size());
+        islandSleepTime.resize(balls.size());
+        for (int i : awakeList) {
+            using std::abs;
+            bool slow = dot(balls.velocity[i], balls.velocity[i]) < T(SLEEP_LINEAR_VELOCITY * SLEEP_LINEAR_VELOCITY)
+                     && abs(balls.angularVelocity[i]) < T(SLEEP_ANGULAR_VELOCITY);
+            balls.sleepTime[i] = slow ? balls.sleepTime[i] + dt : T(0);
+            islandParent[i] = i;
+            islandSleepTime[i] = balls.sleepTime[i];
+        }
+
+        const BallContacts<T> &pairs = solver.pairs;
+        for (std::size_t c = 0; c < pairs.size(); c++) {
+            int ra = findIsland(pairs.a[c]), rb = findIsland(pairs.b[c]);
+            if (ra != rb) {
+                islandParent[rb] = ra;
+                islandSleepTime[ra] = std::min(islandSleepTime[ra], islandSleepTime[rb]);
+            }
+        }
+
+        for (int i : awakeList) {
+            if (islandSleepTime[findIsland(i)] >= T(TIME_TO_SLEEP)) {
+                balls.awake[i] = 0;
+                balls.velocity[i] = sf::Vector2<T>(T(0), T(0));
+                balls.angularVelocity[i] = T(0);
+                listsDirty = true;
+            }
+        }
+    }
+};
+
+//------------------------------------------------------------
+// Ball emitter: spawns balls into a simulation at a steady rate. A point source launches
+// every ball from 'origin'; an arc source spawns on the circle of 'radius' around 'origin'
+// and launches outward; a line source spawns anywhere on origin-end. Launch angles are
+// uniform in direction +- spread (for an arc this is also the span of the arc) and speeds
+// uniform in [speedMin, speedMax]. With a lifetime, each ball is despawned that many
+// seconds after launch; balls retire in launch order, so a ring of handles suffices.
+//------------------------------------------------------------
+template <typename T, typename P = T>
+struct Emitter {
+    enum Shape { POINT, ARC, LINE };
+
+    Shape shape = POINT;
+    sf::Vector2<P> origin;
+    sf::Vector2<P> end;        // line sources only
+    T radius = T(0);           // arc sources only
+    T direction = T(0);        // radians
+    T spread = T(0);           // radians either side of 'direction'
+    T rate = T(10);            // balls per second
+    T speedMin = T(300), speedMax = T(300);
+    T lifetime = T(0);         // seconds; 0 keeps balls forever
+    bool enabled = true;
+    std::uint32_t seed = 0x9e3779b9u;
+
+    std::size_t spawned = 0;
+    std::size_t expired = 0;
+
+    void update(Simulation<T, P> &sim, T dt)
+    {
+        time += dt;
+        while (liveCount > 0 && live[liveHead].expires <= time) {
+            expired += sim.despawn(live[liveHead].handle);
+            liveHead = (liveHead + 1) % live.size();
+            liveCount--;
+        }
+        if (!enabled)
+            return;
+        accumulator += rate * dt;
+        while (accumulator >= T(1)) {
+            accumulator -= T(1);
+            spawnOne(sim);
+        }
+    }
+
+    // Launch one ball now, regardless of the rate
+    void spawnOne(Simulation<T, P> &sim)
+    {
+        using std::cos;
+        using std::sin;
+        T angle = direction + spread * (T(2) * uniform() - T(1));
+        sf::Vector2<T> dir(cos(angle), sin(angle));
+        sf::Vector2<P> position = origin;
+        if (shape == ARC)
+            position = origin + sf::Vector2<P>(dir * radius);
+        else if (shape == LINE)
+            position = origin + (end - origin) * P(uniform());
+        T speed = speedMin + (speedMax - speedMin) * uniform();
+        BallHandle handle = sim.spawn(position, dir * speed);
+        spawned++;
+
+        if (lifetime > T(0)) {
+            if (liveCount == live.size()) {
+                // Grow the ring, unrolling it so the oldest entry is first again
+                std::vector<Launched> grown(std::max<std::size_t>(16, 2 * live.size()));
+                for (std::size_t k = 0; k < liveCount; k++)
+                    grown[k] = live[(liveHead + k) % live.size()];
+                live.swap(grown);
+                liveHead = 0;
+            }
+            live[(liveHead + liveCount) % live.size()] = Launched{handle, time + lifetime};
+            liveCount++;
+        }
+    }
+
+private:
+    struct Launched {
+        BallHandle handle;
+        T expires;
+    };
+
+    T time = T(0);
+    T accumulator = T(0);
+    std::vector<Launched> live; // ring buffer, oldest at liveHead
+    std::size_t liveHead = 0, liveCount = 0;
+
+    // xorshift32, so a seeded emitter launches the same balls on every platform
+    T uniform()
+    {
+        seed ^= seed << 13;
+        seed ^= seed >> 17;
+        seed ^= seed << 5;
+        return T(static_cast<float>(seed >> 8) / 16777216.f);
+    }
+};
+
+//------------------------------------------------------------
+// Create a regular polygon (ConvexShape) with the given number of sides and radius.
+// The polygon is created with its center at (0,0).
+//------------------------------------------------------------
+sf::ConvexShape createPolygon(int sides, float radius)
+{
+    sf::ConvexShape polygon;
+    polygon.setPointCount(sides);
+    for (int i = 0; i < sides; i++) {
+        float angle = 2 * PI * i / sides - PI / 2; // start at the top
+        float x = radius * std::cos(angle);
+        float y = radius * std::sin(angle);
+        polygon.setPoint(i, sf::Vector2f(x, y));
+    }
+    polygon.setFillColor(sf::Color::Transparent);
+    polygon.setOutlineColor(sf::Color::White);
+    polygon.setOutlineThickness(2.f);
+    return polygon;
+}
+
+//------------------------------------------------------------
+// A polygon drawn like createPolygon's, reading its points from cached geometry. Every
+// sf::ConvexShape::setPoint rebuilds the whole shape, so refilling one costs O(n^2); this
+// shape is rebuilt once per switch and never allocates for the points.
+//------------------------------------------------------------
+class PolygonShape : public sf::Shape {
+public:
+    explicit PolygonShape(const PolygonGeometry &shapeGeometry)
+    {
+        setFillColor(sf::Color::Transparent);
+        setOutlineColor(sf::Color::White);
+        setOutlineThickness(2.f);
+        setGeometry(shapeGeometry);
+    }
+
+    // The geometry must outlive the shape (GeometryCache entries never move)
+    void setGeometry(const PolygonGeometry &shapeGeometry)
+    {
+        geometry = &shapeGeometry;
+        update();
+    }
+
+    std::size_t getPointCount() const override { return geometry->vertices.size(); }
+    sf::Vector2f getPoint(std::size_t index) const override { return geometry->vertices[index]; }
+
+private:
+    const PolygonGeometry *geometry = nullptr;
+};
+
+//------------------------------------------------------------
+// Draw every ball with its spin marker (a short line from the center to the rim)
+//------------------------------------------------------------
+void drawBalls(sf::RenderTarget &target, sf::CircleShape &ball, const Balls<float> &balls, float ballRadius)
+{
+    sf::VertexArray spinMarkers(sf::Lines, 2 * balls.size());
+    for (std::size_t i = 0; i < balls.size(); i++) {
+        ball.setPosition(balls.position[i] - sf::Vector2f(ballRadius, ballRadius));
+        target.draw(ball);
+        spinMarkers[2 * i].position = balls.position[i];
+        spinMarkers[2 * i + 1].position = balls.position[i] + ballRadius * sf::Vector2f(std::cos(balls.angle[i]), std::sin(balls.angle[i]));
+        spinMarkers[2 * i].color = spinMarkers[2 * i + 1].color = sf::Color::White;
+    }
+    target.draw(spinMarkers);
+}
+
+//------------------------------------------------------------
+// CPU rasterizer for batch jobs without OpenGL. It draws what the SFML path draws (polygon
+// outline, balls, spin markers and dotted lines) into an RGBA buffer, top row first.
+// Primitives are queued, binned into 64x64 tiles and rasterized tile-by-tile on a job
+// system that lives as long as the rasterizer. Each pixel is tested at the 8 sample positions of standard 8x MSAA, eight
+// samples at a time using compiler vector extensions, and interior spans are filled solid.
+//------------------------------------------------------------
+typedef float SampleVector __attribute__((vector_size(32)));
+typedef int SampleMask __attribute__((vector_size(32)));
+
+// Standard 8x MSAA sample offsets from the pixel center, in 1/16 pixel
+const SampleVector MSAA_X = {1 / 16.f, -1 / 16.f, 5 / 16.f, -3 / 16.f, -5 / 16.f, -7 / 16.f, 3 / 16.f, 7 / 16.f};
+const SampleVector MSAA_Y = {-3 / 16.f, 3 / 16.f, 1 / 16.f, -5 / 16.f, 5 / 16.f, -1 / 16.f, 7 / 16.f, -7 / 16.f};
+
+inline int coveredSamples(const SampleMask &inside)
+{
+    int count = 0;
+    for (int k = 0; k < 8; k++)
+        count -= inside[k]; // lanes are -1 where the test passed
+    return count;
+}
+
+struct SoftwareRasterizer {
+    static const int TILE = 64;
+
+    struct Primitive {
+        enum Kind { CONVEX, CIRCLE } kind;
+        sf::Color color;
+        sf::Vector2f points[4]; // convex: up to 4 vertices; circle: points[0] is the center
+        int count = 0;
+        float radius = 0.f;
+        int left, top, right, bottom; // pixel bounds, inclusive-exclusive
+    };
+
+    unsigned width, height;
+    JobSystem jobs;
+    sf::Uint8 *pixels = nullptr; // target of the current render()
+    sf::Color background = sf::Color::Black;
+    std::vector<Primitive> primitives;
+    std::vector<std::vector<int>> bins; // primitive indices per tile, in draw order
+
+    SoftwareRasterizer(unsigned w, unsigned h, unsigned threadCount)
+        : width(w), height(h), jobs(threadCount) {}
+
+    void clear(const sf::Color &color)
+    {
+        background = color;
+        primitives.clear();
+    }
+
+    // Convex polygon with 3 or 4 vertices, in either winding
+    void fillConvex(const sf::Vector2f *pts, int count, const sf::Color &color)
+    {
+        Primitive p;
+        p.kind = Primitive::CONVEX;
+        p.color = color;
+        p.count = count;
+        float area = 0.f;
+        for (int i = 0; i < count; i++) {
+            p.points[i] = pts[i];
+            const sf::Vector2f &a = pts[i], &b = pts[(i + 1) % count];
+            area += a.x * b.y - a.y * b.x;
+        }
+        if (area == 0.f)
+            return;
+        if (area < 0.f) // keep one winding so every edge function is positive inside
+            std::reverse(p.points, p.points + count);
+        float l = pts[0].x, t = pts[0].y, r = pts[0].x, b = pts[0].y;
+        for (int i = 1; i < count; i++) {
+            l = std::min(l, pts[i].x);
+            t = std::min(t, pts[i].y);
+            r = std::max(r, pts[i].x);
+            b = std::max(b, pts[i].y);
+        }
+        push(p, l, t, r, b);
+    }
+
+    void fillCircle(const sf::Vector2f &center, float radius, const sf::Color &color)
+    {
+        Primitive p;
+        p.kind = Primitive::CIRCLE;
+        p.color = color;
+        p.points[0] = center;
+        p.radius = radius;
+        push(p, center.x - radius, center.y - radius, center.x + radius, center.y + radius);
+    }
+
+    // A line like sf::Lines: one pixel wide, centered on the segment
+    void line(const sf::Vector2f &a, const sf::Vector2f &b, const sf::Color &color)
+    {
+        sf::Vector2f side = normalize(sf::Vector2f(a.y - b.y, b.x - a.x)) * 0.5f;
+        sf::Vector2f quad[4] = {a + side, b + side, b - side, a - side};
+        fillConvex(quad, 4, color);
+    }
+
+    // Outline of a convex polygon, extruded outward with mitered corners like sf::Shape
+    void outline(const std::vector<sf::Vector2f> &pts, float thickness, const sf::Color &color)
+    {
+        std::size_t count = pts.size();
+        float area = 0.f;
+        for (std::size_t i = 0; i < count; i++)
+            area += pts[i].x * pts[(i + 1) % count].y - pts[i].y * pts[(i + 1) % count].x;
+        float side = area > 0.f ? 1.f : -1.f;
+
+        std::vector<sf::Vector2f> outer(count);
+        for (std::size_t i = 0; i < count; i++) {
+            const sf::Vector2f &prev = pts[(i + count - 1) % count], &p = pts[i], &next = pts[(i + 1) % count];
+            sf::Vector2f n1 = normalize(sf::Vector2f(p.y - prev.y, prev.x - p.x)) * side;
+            sf::Vector2f n2 = normalize(sf::Vector2f(next.y - p.y, p.x - next.x)) * side;
+            outer[i] = p + (n1 + n2) / (1.f + dot(n1, n2)) * thickness;
+        }
+        for (std::size_t i = 0; i < count; i++) {
+            std::size_t j = (i + 1) % count;
+            sf::Vector2f quad[4] = {pts[i], pts[j], outer[j], outer[i]};
+            fillConvex(quad, 4, color);
+        }
+    }
+
+    // Rasterize every queued primitive into 'target' (width * height RGBA pixels)
+    void render(sf::Uint8 *target)
+    {
+        pixels = target;
+        unsigned tilesX = (width + TILE - 1) / TILE, tilesY = (height + TILE - 1) / TILE;
+        bins.resize(tilesX * tilesY);
+        for (std::vector<int> &bin : bins)
+            bin.clear();
+        for (std::size_t k = 0; k < primitives.size(); k++) {
+            const Primitive &p = primitives[k];
+            for (int ty = p.top / TILE; ty <= (p.bottom - 1) / TILE; ty++)
+                for (int tx = p.left / TILE; tx <= (p.right - 1) / TILE; tx++)
+                    bins[ty * tilesX + tx].push_back(static_cast<int>(k));
+        }
+
+        jobs.parallelFor(bins.size(), 1, [&](std::size_t, std::size_t begin, std::size_t end) {
+            for (std::size_t tile = begin; tile < end; tile++)
+                renderTile(static_cast<int>(tile % tilesX) * TILE, static_cast<int>(tile / tilesX) * TILE, bins[tile]);
+        });
+    }
+
+private:
+    void push(Primitive &p, float l, float t, float r, float b)
+    {
+        p.left = std::max(0, static_cast<int>(std::floor(l)));
+        p.top = std::max(0, static_cast<int>(std::floor(t)));
+        p.right = std::min(static_cast<int>(width), static_cast<int>(std::ceil(r)) + 1);
+        p.bottom = std::min(static_cast<int>(height), static_cast<int>(std::ceil(b)) + 1);
+        if (p.left < p.right && p.top < p.bottom)
+            primitives.push_back(p);
+    }
+
+    static void blend(sf::Uint8 *dst, const sf::Color &c, int samples)
+    {
+        int alpha = c.a * samples / 8;
+        dst[0] = static_cast<sf::Uint8>((c.r * alpha + dst[0] * (255 - alpha)) / 255);
+        dst[1] = static_cast<sf::Uint8>((c.g * alpha + dst[1] * (255 - alpha)) / 255);
+        dst[2] = static_cast<sf::Uint8>((c.b * alpha + dst[2] * (255 - alpha)) / 255);
+        dst[3] = 255;
+    }
+
+    void renderTile(int x0, int y0, const std::vector<int> &bin)
+    {
+        int x1 = std::min(x0 + TILE, static_cast<int>(width)), y1 = std::min(y0 + TILE, static_cast<int>(height));
+        for (int y = y0; y < y1; y++) {
+            sf::Uint8 *row = &pixels[(static_cast<std::size_t>(y) * width + x0) * 4];
+            for (int x = x0; x < x1; x++, row += 4) {
+                row[0] = background.r;
+                row[1] = background.g;
+                row[2] = background.b;
+                row[3] = 255;
+            }
+        }
+        for (int k : bin) {
+            const Primitive &p = primitives[k];
+            int l = std::max(p.left, x0), r = std::min(p.right, x1);
+            int t = std::max(p.top, y0), b = std::min(p.bottom, y1);
+            if (l >= r || t >= b)
+                continue;
+            if (p.kind == Primitive::CIRCLE)
+                rasterizeCircle(p, l, t, r, b);
+            else
+                rasterizeConvex(p, l, t, r, b);
+        }
+    }
+
+    // Per row, pixels whose whole square lies inside the circle are filled solid; only the
+    // pixels along the rim are sampled
+    void rasterizeCircle(const Primitive &p, int l, int t, int r, int b)
+    {
+        const float cx = p.points[0].x, cy = p.points[0].y, r2 = p.radius * p.radius;
+        for (int y = t; y < b; y++) {
+            float dyFar = std::max(std::fabs(y - cy), std::fabs(y + 1 - cy));
+            float half = dyFar * dyFar < r2 ? std::sqrt(r2 - dyFar * dyFar) : -1.f;
+            int solidL = half < 0.f ? r : std::max(l, static_cast<int>(std::ceil(cx - half)));
+            int solidR = half < 0.f ? r : std::min(r, static_cast<int>(std::floor(cx + half)));
+            sf::Uint8 *row = &pixels[(static_cast<std::size_t>(y) * width) * 4];
+            SampleVector dy = MSAA_Y + (y + 0.5f - cy);
+            SampleVector dy2 = dy * dy;
+            for (int x = l; x < r; x++) {
+                if (x >= solidL && x < solidR && p.color.a == 255) {
+                    for (; x < solidR; x++)
+                        std::memcpy(row + 4 * x, &p.color, 4);
+                    x--;
+                    continue;
+                }
+                SampleVector dx = MSAA_X + (x + 0.5f - cx);
+                int samples = coveredSamples(dx * dx + dy2 < r2);
+                if (samples)
+                    blend(row + 4 * x, p.color, samples);
+            }
+        }
+    }
+
+    // Edge functions are evaluated for all eight samples at once; rows are clipped to the
+    // polygon's extent on that row before any sampling
+    void rasterizeConvex(const Primitive &p, int l, int t, int r, int b)
+    {
+        float ea[4], eb[4], ec[4];
+        SampleVector offset[4];
+        for (int i = 0; i < p.count; i++) {
+            const sf::Vector2f &a = p.points[i], &c = p.points[(i + 1) % p.count];
+            ea[i] = a.y - c.y;
+            eb[i] = c.x - a.x;
+            ec[i] = a.x * c.y - a.y * c.x;
+            offset[i] = ea[i] * MSAA_X + eb[i] * MSAA_Y;
+        }
+        for (int y = t; y < b; y++) {
+            // The left boundary of a convex polygon is the furthest-right left edge at each
+            // height, and it bulges outward only at vertices, so the row's extent comes from
+            // its top and bottom lines plus any vertex inside it
+            float left[2], right[2];
+            bool solid = true;
+            for (int k = 0; k < 2; k++) {
+                float sy = static_cast<float>(y + k);
+                left[k] = -1e30f;
+                right[k] = 1e30f;
+                for (int i = 0; i < p.count; i++) {
+                    if (ea[i] == 0.f)
+                        solid = solid && eb[i] * sy + ec[i] >= 0.f;
+                    else if (ea[i] > 0.f)
+                        left[k] = std::max(left[k], -(eb[i] * sy + ec[i]) / ea[i]);
+                    else
+                        right[k] = std::min(right[k], -(eb[i] * sy + ec[i]) / ea[i]);
+                }
+            }
+            float outerL = std::min(left[0], left[1]), outerR = std::max(right[0], right[1]);
+            for (int i = 0; i < p.count; i++)
+                if (p.points[i].y >= y && p.points[i].y <= y + 1) {
+                    outerL = std::min(outerL, p.points[i].x);
+                    outerR = std::max(outerR, p.points[i].x);
+                }
+            float innerL = solid ? std::max(left[0], left[1]) : 1e30f, innerR = std::min(right[0], right[1]);
+            int rowL = std::max(l, static_cast<int>(std::floor(std::max(outerL, -1e9f))));
+            int rowR = std::min(r, static_cast<int>(std::ceil(std::min(outerR, 1e9f))) + 1);
+            int solidL = static_cast<int>(std::ceil(innerL)), solidR = static_cast<int>(std::floor(innerR));
+            sf::Uint8 *row = &pixels[(static_cast<std::size_t>(y) * width) * 4];
+            for (int x = rowL; x < rowR; x++) {
+                if (x >= solidL && x + 1 <= solidR && p.color.a == 255) {
+                    std::memcpy(row + 4 * x, &p.color, 4);
+                    continue;
+                }
+                SampleMask inside = SampleMask{} == 0;
+                for (int i = 0; i < p.count; i++)
+                    inside &= offset[i] + (ea[i] * (x + 0.5f) + eb[i] * (y + 0.5f) + ec[i]) >= 0.f;
+                int samples = coveredSamples(inside);
+                if (samples)
+                    blend(row + 4 * x, p.color, samples);
+            }
+        }
+    }
+};
+
+//------------------------------------------------------------
+// Draw a dotted line between two points with the software rasterizer
+//------------------------------------------------------------
+void drawDottedLine(SoftwareRasterizer &canvas,
+                    const sf::Vector2f &start,
+                    const sf::Vector2f &end,
+                    float dotSpacing = 10.f,
+                    float dotRadius = 2.f)
+{
+    sf::Vector2f dir = end - start;
+    float dist = length(dir);
+    if (dist == 0.f)
+        return;
+
+    dir = normalize(dir);
+    for (float d = 0.f; d < dist; d += dotSpacing)
+        canvas.fillCircle(start + dir * d, dotRadius, sf::Color::White);
+}
+
+//------------------------------------------------------------
+// Software equivalents of window.draw(polygon) and drawBalls()
+//------------------------------------------------------------
+void drawPolygon(SoftwareRasterizer &canvas, const sf::ConvexShape &polygon)
+{
+    std::vector<sf::Vector2f> points(polygon.getPointCount());
+    sf::Transform transform = polygon.getTransform();
+    for (std::size_t i = 0; i < points.size(); i++)
+        points[i] = transform.transformPoint(polygon.getPoint(i));
+    if (polygon.getFillColor().a > 0)
+        for (std::size_t i = 1; i + 1 < points.size(); i++) {
+            sf::Vector2f triangle[3] = {points[0], points[i], points[i + 1]};
+            canvas.fillConvex(triangle, 3, polygon.getFillColor());
+        }
+    canvas.outline(points, polygon.getOutlineThickness(), polygon.getOutlineColor());
+}
+
+void drawBalls(SoftwareRasterizer &canvas, const sf::CircleShape &ball, const Balls<float> &balls, float ballRadius)
+{
+    for (std::size_t i = 0; i < balls.size(); i++)
+        canvas.fillCircle(balls.position[i], ballRadius, ball.getFillColor());
+    for (std::size_t i = 0; i < balls.size(); i++)
+        canvas.line(balls.position[i], balls.position[i] + ballRadius * sf::Vector2f(std::cos(balls.angle[i]), std::sin(balls.angle[i])),
+                    sf::Color::White);
+}
+
+//------------------------------------------------------------
+// Background frame writer for offscreen rendering. Frames go into a fixed ring of
+// preallocated RGBA buffers; a pool of encoder threads writes filled slots to disk and
+// hands them back. The render loop only waits when every slot is still being encoded,
+// so throughput is bounded by rasterization rather than by disk.
+//------------------------------------------------------------
+struct FrameWriter {
+    enum Format { PNG, PPM, RAW };
+
+    unsigned width, height;
+    std::string directory;
+    Format format;
+
+    std::vector<std::vector<sf::Uint8>> slots;
+    std::vector<int> freeSlots;
+    std::deque<std::pair<int, int>> pending; // (slot, frame number)
+    std::mutex mutex;
+    std::condition_variable slotFreed, frameQueued;
+    std::vector<std::thread> workers;
+    bool stopping = false;
+    std::size_t stalls = 0;  // times the render loop had to wait for a free slot
+    std::size_t written = 0;
+
+    FrameWriter(unsigned w, unsigned h, std::size_t slotCount, unsigned threadCount,
+                const std::string &dir, Format fmt)
+        : width(w), height(h), directory(dir), format(fmt)
+    {
+        slots.resize(slotCount);
+        for (std::size_t k = 0; k < slotCount; k++) {
+            slots[k].resize(static_cast<std::size_t>(w) * h * 4);
+            freeSlots.push_back(static_cast<int>(k));
+        }
+        for (unsigned t = 0; t < threadCount; t++)
+            workers.emplace_back([this] { encodeLoop(); });
+    }
+
+    ~FrameWriter()
+    {
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            stopping = true;
+        }
+        frameQueued.notify_all();
+        for (std::thread &worker : workers)
+            worker.join();
+    }
+
+    // Take a free slot to render into (blocks only when the encoders are behind)
+    int acquire()
+    {
+        std::unique_lock<std::mutex> lock(mutex);
+        if (freeSlots.empty())
+            stalls++;
+        slotFreed.wait(lock, [this] { return !freeSlots.empty(); });
+        int slot = freeSlots.back();
+        freeSlots.pop_back();
+        return slot;
+    }
+
+    sf::Uint8 *pixels(int slot) { return slots[slot].data(); }
+
+    void submit(int slot, int frame)
+    {
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            pending.emplace_back(slot, frame);
+        }
+        frameQueued.notify_one();
+    }
+
+private:
+    void encodeLoop()
+    {
+        for (;;) {
+            std::pair<int, int> job;
+            {
+                std::unique_lock<std::mutex> lock(mutex);
+                frameQueued.wait(lock, [this] { return stopping || !pending.empty(); });
+                if (pending.empty())
+                    return; // stopping, and every frame has been written
+                job = pending.front();
+                pending.pop_front();
+            }
+
+            write(job.second, slots[job.first].data());
+
+            {
+                std::lock_guard<std::mutex> lock(mutex);
+                freeSlots.push_back(job.first);
+                written++;
+            }
+            slotFreed.notify_one();
+        }
+    }
+
+    void write(int frame, const sf::Uint8 *data)
+    {
+        static const char *extensions[] = {"png", "ppm", "rgba"};
+        char name[32];
+        std::snprintf(name, sizeof(name), "/frame_%06d.%s", frame, extensions[format]);
+        std::string path = directory + name;
+
+        if (format == PNG) {
+            sf::Image image;
+            image.create(width, height, data);
+            if (!image.saveToFile(path))
+                std::cerr << "Error: Could not write " << path << "\n";
+            return;
+        }
+
+        std::ofstream out(path, std::ios::binary);
+        if (format == PPM) {
+            out << "P6\n" << width << " " << height << "\n255\n";
+            std::vector<char> rgb(static_cast<std::size_t>(width) * height * 3);
+            for (std::size_t p = 0; p < static_cast<std::size_t>(width) * height; p++) {
+                rgb[3 * p] = data[4 * p];
+                rgb[3 * p + 1] = data[4 * p + 1];
+                rgb[3 * p + 2] = data[4 * p + 2];
+            }
+            out.write(rgb.data(), rgb.size());
+        } else {
+            out.write(reinterpret_cast<const char *>(data), static_cast<std::streamsize>(width) * height * 4);
+        }
+        if (!out)
+            std::cerr << "Error: Could not write " << path << "\n";
+    }
+};
+
+//------------------------------------------------------------
+// Minimal io_uring, driven through the raw system calls: submit a batch of writes and wait
+// for all of them. init() fails where the kernel lacks io_uring or forbids it, and the
+// caller falls back to pwritev.
+//------------------------------------------------------------
+struct IoRing {
+#ifdef __linux__
+    int fd = -1;
+    unsigned entries = 0;
+    unsigned *sqHead = nullptr, *sqTail = nullptr, *sqMask = nullptr, *sqArray = nullptr;
+    unsigned *cqHead = nullptr, *cqTail = nullptr, *cqMask = nullptr;
+    io_uring_sqe *sqes = nullptr;
+    io_uring_cqe *cqes = nullptr;
+    void *sqRing = MAP_FAILED, *cqRing = MAP_FAILED;
+    std::size_t sqRingBytes = 0, cqRingBytes = 0, sqeBytes = 0;
+
+    ~IoRing()
+    {
+        if (sqes)
+            munmap(sqes, sqeBytes);
+        if (cqRing != MAP_FAILED)
+            munmap(cqRing, cqRingBytes);
+        if (sqRing != MAP_FAILED)
+            munmap(sqRing, sqRingBytes);
+        if (fd >= 0)
+            ::close(fd);
+    }
+
+    bool init(unsigned depth)
+    {
+        io_uring_params params;
+        std::memset(&params, 0, sizeof(params));
+        fd = static_cast<int>(syscall(__NR_io_uring_setup, depth, &params));
+        if (fd < 0)
+            return false;
+        entries = params.sq_entries;
+        sqRingBytes = params.sq_off.array + params.sq_entries * sizeof(unsigned);
+        cqRingBytes = params.cq_off.cqes + params.cq_entries * sizeof(io_uring_cqe);
+        sqeBytes = params.sq_entries * sizeof(io_uring_sqe);
+        sqRing = mmap(nullptr, sqRingBytes, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, fd, IORING_OFF_SQ_RING);
+        cqRing = mmap(nullptr, cqRingBytes, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, fd, IORING_OFF_CQ_RING);
+        void *sqeMap = mmap(nullptr, sqeBytes, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, fd, IORING_OFF_SQES);
+        if (sqRing == MAP_FAILED || cqRing == MAP_FAILED || sqeMap == MAP_FAILED)
+            return false;
+        char *sq = static_cast<char *>(sqRing), *cq = static_cast<char *>(cqRing);
+        sqHead = reinterpret_cast<unsigned *>(sq + params.sq_off.head);
+        sqTail = reinterpret_cast<unsigned *>(sq + params.sq_off.tail);
+        sqMask = reinterpret_cast<unsigned *>(sq + params.sq_off.ring_mask);
+        sqArray = reinterpret_cast<unsigned *>(sq + params.sq_off.array);
+        cqHead = reinterpret_cast<unsigned *>(cq + params.cq_off.head);
+        cqTail = reinterpret_cast<unsigned *>(cq + params.cq_off.tail);
+        cqMask = reinterpret_cast<unsigned *>(cq + params.cq_off.ring_mask);
+        cqes = reinterpret_cast<io_uring_cqe *>(cq + params.cq_off.cqes);
+        sqes = static_cast<io_uring_sqe *>(sqeMap);
+        return true;
+    }
+
+    // Write buffers[k] (lengths[k] bytes) at offsets[k] for k < count (at most 'entries'),
+    // storing each result (bytes written or -errno) in results[k]. Writes the kernel would
+    // not take are withdrawn and keep results[k] 0. Returns only once every write it did
+    // take has completed, so the buffers are free again either way; false means the ring
+    // failed and should not be used again.
+    bool writeBatch(int file, char *const *buffers, const std::size_t *lengths, const std::uint64_t *offsets,
+                    std::size_t count, long long *results)
+    {
+        unsigned tail = *sqTail;
+        for (std::size_t k = 0; k < count; k++, tail++) {
+            unsigned index = tail & *sqMask;
+            io_uring_sqe &sqe = sqes[index];
+            std::memset(&sqe, 0, sizeof(sqe));
+            sqe.opcode = IORING_OP_WRITE;
+            sqe.fd = file;
+            sqe.addr = reinterpret_cast<std::uint64_t>(buffers[k]);
+            sqe.len = static_cast<std::uint32_t>(lengths[k]);
+            sqe.off = offsets[k];
+            sqe.user_data = k;
+            sqArray[index] = index;
+        }
+        __atomic_store_n(sqTail, tail, __ATOMIC_RELEASE);
+
+        // io_uring_enter may take only part of the batch, or be interrupted before taking any
+        bool ok = true;
+        std::size_t submitted = 0;
+        while (submitted < count) {
+            long taken = syscall(__NR_io_uring_enter, fd, static_cast<unsigned>(count - submitted), 0, 0, nullptr, 0);
+            if (taken < 0 && errno == EINTR)
+                continue;
+            if (taken <= 0) {
+                ok = false;
+                break;
+            }
+            submitted += static_cast<std::size_t>(taken);
+        }
+        if (submitted < count) // without SQPOLL the kernel reads the ring only inside io_uring_enter
+            __atomic_store_n(sqTail, __atomic_load_n(sqHead, __ATOMIC_ACQUIRE), __ATOMIC_RELEASE);
+
+        // Reap everything submitted before the caller reuses or rewrites the buffers. The
+        // writes complete whether or not we wait in the kernel, so if waiting fails, poll.
+        bool canWait = true;
+        unsigned head = *cqHead;
+        for (std::size_t done = 0; done < submitted;) {
+            if (head == __atomic_load_n(cqTail, __ATOMIC_ACQUIRE)) {
+                if (canWait && syscall(__NR_io_uring_enter, fd, 0, 1, IORING_ENTER_GETEVENTS, nullptr, 0) < 0
+                    && errno != EINTR && errno != EAGAIN && errno != EBUSY) {
+                    canWait = ok = false;
+                }
+                if (!canWait)
+                    std::this_thread::yield();
+                continue;
+            }
+            const io_uring_cqe &cqe = cqes[head & *cqMask];
+            if (cqe.user_data < count)
+                results[cqe.user_data] = cqe.res;
+            head++;
+            done++;
+            __atomic_store_n(cqHead, head, __ATOMIC_RELEASE);
+        }
+        return ok;
+    }
+#else
+    bool init(unsigned) { return false; }
+    bool writeBatch(int, char *const *, const std::size_t *, const std::uint64_t *, std::size_t, long long *)
+    {
+        return false;
+    }
+#endif
+};
+
+//------------------------------------------------------------
+// Streams bytes to a file without blocking the thread that produces them. The producer
+// copies into fixed-size, page-aligned blocks; a full block goes to the writer thread
+// through a lock-free single-producer ring and comes back through another once it is on
+// disk. The writer submits up to BATCH blocks per system call, through io_uring where the
+// kernel allows it and pwritev otherwise. Every block but the last is a whole number of
+// pages at a page-aligned offset.
+//
+// The blocks are the buffer budget. append() waits only when all of them are queued for the
+// disk, and those waits are counted as stalls. Either side that runs out of work sleeps on a
+// condition variable, which the other signals after each push. One thread appends; close()
+// flushes the partial block and waits for the writer.
+//------------------------------------------------------------
+struct AsyncFileWriter {
+    static constexpr std::size_t ALIGNMENT = 4096; // constexpr: std::max takes it by reference
+    static const std::size_t BATCH = 16;
+
+    struct Stats {
+        std::uint64_t bytes = 0;     // appended
+        std::uint64_t blocks = 0;    // written to disk
+        std::uint64_t batches = 0;   // system calls that submitted blocks
+        std::uint64_t stalls = 0;    // appends that waited for a free block
+        double stallMs = 0.0;        // time spent in those waits
+        std::size_t peakQueued = 0;  // most blocks waiting for the disk at once
+    };
+
+    AsyncFileWriter(const std::string &path, std::size_t blockBytes, std::size_t blockCount)
+        : blockSize((std::max<std::size_t>(blockBytes, ALIGNMENT) + ALIGNMENT - 1) / ALIGNMENT * ALIGNMENT),
+          count(std::max<std::size_t>(blockCount, 2)), queuedBlocks(count), freeBlocks(count)
+    {
+        fd = open(path.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0644);
+        if (fd < 0)
+            return;
+        memory = static_cast<char *>(::operator new(blockSize * count, std::align_val_t(ALIGNMENT)));
+        std::memset(memory, 0, blockSize * count); // fault the budget in now rather than during append()
+        length.resize(count);
+        offset.resize(count);
+        for (std::size_t b = 0; b < count; b++)
+            freeBlocks.push(static_cast<std::uint32_t>(b));
+        uring = ring.init(BATCH);
+        writer = std::thread([this] { writeLoop(); });
+    }
+
+    ~AsyncFileWriter()
+    {
+        close();
+        if (memory)
+            ::operator delete(memory, std::align_val_t(ALIGNMENT));
+    }
+
+    bool ok() const { return fd >= 0 && !failed.load(); }
+    const char *backend() const { return uring.load() ? "io_uring" : "pwritev"; }
+    std::size_t budget() const { return blockSize * count; }
+
+    void append(const void *data, std::size_t bytes)
+    {
+        const char *p = static_cast<const char *>(data);
+        appendStats.bytes += bytes;
+        while (bytes > 0 && fd >= 0) {
+            if (current < 0)
+                takeBlock();
+            std::size_t n = std::min(bytes, blockSize - used);
+            std::memcpy(memory + current * blockSize + used, p, n);
+            used += n;
+            p += n;
+            bytes -= n;
+            if (used == blockSize)
+                submitBlock();
+        }
+    }
+
+    // Flush, wait for the writer and close the file; false if any write failed
+    bool close()
+    {
+        if (fd < 0)
+            return false;
+        if (current >= 0 && used > 0)
+            submitBlock();
+        closing.store(true, std::memory_order_release);
+        wake(blockQueued);
+        writer.join();
+        ::close(fd);
+        fd = -1;
+        return !failed.load();
+    }
+
+    Stats stats() const
+    {
+        Stats s = appendStats;
+        s.blocks = blocksWritten.load();
+        s.batches = batches.load();
+        s.peakQueued = peakQueued.load();
+        return s;
+    }
+
+private:
+    // Lock-free ring of block numbers with one producer and one consumer
+    struct BlockRing {
+        std::vector<std::uint32_t> slots;
+        alignas(64) std::atomic<std::size_t> head{0}; // next to pop
+        alignas(64) std::atomic<std::size_t> tail{0}; // next to push
+
+        explicit BlockRing(std::size_t capacity) : slots(capacity) {}
+
+        bool push(std::uint32_t block)
+        {
+            std::size_t t = tail.load(std::memory_order_relaxed);
+            if (t - head.load(std::memory_order_acquire) == slots.size())
+                return false;
+            slots[t % slots.size()] = block;
+            tail.store(t + 1, std::memory_order_release);
+            return true;
+        }
+
+        bool pop(std::uint32_t &block)
+        {
+            std::size_t h = head.load(std::memory_order_relaxed);
+            if (h == tail.load(std::memory_order_acquire))
+                return false;
+            block = slots[h % slots.size()];
+            head.store(h + 1, std::memory_order_release);
+            return true;
+        }
+
+        std::size_t size() const { return tail.load(std::memory_order_acquire) - head.load(std::memory_order_acquire); }
+    };
+
+    std::size_t blockSize, count;
+    int fd = -1;
+    char *memory = nullptr;
+    std::vector<std::size_t> length;   // bytes in each queued block
+    std::vector<std::uint64_t> offset; // file offset of each queued block
+    BlockRing queuedBlocks, freeBlocks; // producer -> writer, writer -> producer
+    IoRing ring;
+    std::thread writer;
+    std::atomic<bool> uring{false}, closing{false}, failed{false};
+    std::mutex sleepMutex; // only for the waits below; the rings need no lock
+    std::condition_variable blockQueued, blockFreed;
+    std::atomic<std::uint64_t> blocksWritten{0}, batches{0};
+    std::atomic<std::size_t> peakQueued{0};
+
+    // Producer side only
+    Stats appendStats;
+    long current = -1;
+    std::size_t used = 0;
+    std::uint64_t fileOffset = 0;
+
+    void takeBlock()
+    {
+        std::uint32_t block;
+        if (!freeBlocks.pop(block)) {
+            appendStats.stalls++;
+            sf::Clock clock;
+            while (!freeBlocks.pop(block)) {
+                std::unique_lock<std::mutex> lock(sleepMutex);
+                blockFreed.wait(lock, [this] { return freeBlocks.size() > 0; });
+            }
+            appendStats.stallMs += clock.getElapsedTime().asSeconds() * 1000.0;
+        }
+        current = block;
+        used = 0;
+    }
+
+    void submitBlock()
+    {
+        length[current] = used;
+        offset[current] = fileOffset;
+        fileOffset += used;
+        queuedBlocks.push(static_cast<std::uint32_t>(current)); // never full: it holds at most every block
+        wake(blockQueued);
+        current = -1;
+    }
+
+    // Taking the lock orders the wake-up after a sleeper's check of its condition, so no
+    // wake-up is lost between the check and the wait
+    void wake(std::condition_variable &condition)
+    {
+        { std::lock_guard<std::mutex> lock(sleepMutex); }
+        condition.notify_one();
+    }
+
+    void writeLoop()
+    {
+        std::uint32_t batch[BATCH];
+        for (;;) {
+            std::size_t queued = queuedBlocks.size();
+            if (queued > peakQueued.load(std::memory_order_relaxed))
+                peakQueued.store(queued, std::memory_order_relaxed);
+            std::size_t n = 0;
+            while (n < BATCH && queuedBlocks.pop(batch[n]))
+                n++;
+            if (n == 0) {
+                if (closing.load(std::memory_order_acquire) && queuedBlocks.size() == 0)
+                    return;
+                std::unique_lock<std::mutex> lock(sleepMutex);
+                blockQueued.wait(lock, [this] {
+                    return queuedBlocks.size() > 0 || closing.load(std::memory_order_acquire);
+                });
+                continue;
+            }
+            if (!writeBlocks(batch, n))
+                failed.store(true);
+            batches++;
+            blocksWritten += n;
+            for (std::size_t k = 0; k < n; k++)
+                freeBlocks.push(batch[k]);
+            wake(blockFreed);
+        }
+    }
+
+    bool writeBlocks(const std::uint32_t *blocks, std::size_t n)
+    {
+        if (n == 0)
+            return true;
+        char *buffers[BATCH];
+        std::size_t lengths[BATCH];
+        std::uint64_t offsets[BATCH];
+        long long results[BATCH];
+        for (std::size_t k = 0; k < n; k++) {
+            buffers[k] = memory + blocks[k] * blockSize;
+            lengths[k] = length[blocks[k]];
+            offsets[k] = offset[blocks[k]];
+            results[k] = 0;
+        }
+        // If the ring breaks, whatever it left unwritten is finished below and later
+        // batches go through pwritev
+        const bool viaRing = uring.load();
+        if (viaRing && !ring.writeBatch(fd, buffers, lengths, offsets, n, results))
+            uring.store(false);
+        if (!viaRing) {
+            // The blocks of one batch are consecutive in the file
+            iovec vectors[BATCH];
+            for (std::size_t k = 0; k < n; k++)
+                vectors[k] = iovec{buffers[k], lengths[k]};
+            ssize_t written = pwritev(fd, vectors, static_cast<int>(n), static_cast<off_t>(offsets[0]));
+            for (std::size_t k = 0; k < n; k++) {
+                long long part = std::min<long long>(std::max<long long>(written, 0), static_cast<long long>(lengths[k]));
+                results[k] = written < 0 ? -errno : part;
+                written -= part;
+            }
+        }
+        // Finish short or failed writes synchronously
+        bool ok = true;
+        for (std::size_t k = 0; k < n; k++) {
+            std::size_t done = results[k] > 0 ? static_cast<std::size_t>(results[k]) : 0;
+            while (done < lengths[k]) {
+                ssize_t w = pwrite(fd, buffers[k] + done, lengths[k] - done, static_cast<off_t>(offsets[k] + done));
+                if (w < 0 && errno == EINTR)
+                    continue;
+                if (w <= 0) {
+                    ok = false;
+                    break;
+                }
+                done += static_cast<std::size_t>(w);
+            }
+        }
+        return ok;
+    }
+};
+
+//------------------------------------------------------------
+// Small LZ77 block codec in the style of LZ4: a token byte holds the literal count and the
+// match length (minus 4) in its two nibbles, either of which continues in 255-valued bytes
+// when it reaches 15. The literals follow, then a 2-byte little-endian match offset. The
+// final sequence carries literals only. Matches are found through a hash of the next four
+// bytes, keeping one candidate per bucket.
+//------------------------------------------------------------
+inline void lzPutLength(std::vector<unsigned char> &out, std::size_t extra)
+{
+    for (; extra >= 255; extra -= 255)
+        out.push_back(255);
+    out.push_back(static_cast<unsigned char>(extra));
+}
+
+inline void lzEmit(std::vector<unsigned char> &out, const unsigned char *literals, std::size_t literalCount,
+                   std::size_t offset, std::size_t matchLength)
+{
+    std::size_t matchCode = matchLength ? matchLength - 4 : 0;
+    out.push_back(static_cast<unsigned char>((std::min<std::size_t>(literalCount, 15) << 4)
+                                             | std::min<std::size_t>(matchCode, 15)));
+    if (literalCount >= 15)
+        lzPutLength(out, literalCount - 15);
+    out.insert(out.end(), literals, literals + literalCount);
+    if (matchLength == 0)
+        return;
+    out.push_back(static_cast<unsigned char>(offset & 0xff));
+    out.push_back(static_cast<unsigned char>(offset >> 8));
+    if (matchCode >= 15)
+        lzPutLength(out, matchCode - 15);
+}
+
+void lzCompress(const unsigned char *in, std::size_t n, std::vector<unsigned char> &out,
+                std::vector<std::uint32_t> &table)
+{
+    const int HASH_BITS = 14;
+    const std::uint32_t NONE = 0xffffffffu;
+    table.assign(std::size_t(1) << HASH_BITS, NONE);
+    out.clear();
+    auto load = [&](std::size_t i) {
+        std::uint32_t v;
+        std::memcpy(&v, in + i, 4);
+        return v;
+    };
+    std::size_t anchor = 0, i = 0;
+    while (i + 4 <= n) {
+        std::uint32_t sequence = load(i);
+        std::uint32_t &slot = table[(sequence * 2654435761u) >> (32 - HASH_BITS)];
+        std::size_t candidate = slot;
+        slot = static_cast<std::uint32_t>(i);
+        if (candidate != NONE && i - candidate <= 65535 && load(candidate) == sequence) {
+            std::size_t length = 4;
+            while (i + length < n && in[candidate + length] == in[i + length])
+                length++;
+            lzEmit(out, in + anchor, i - anchor, i - candidate, length);
+            i += length;
+            anchor = i;
+        } else {
+            i++;
+        }
+    }
+    lzEmit(out, in + anchor, n - anchor, 0, 0);
+}
+
+// False on malformed input or a size mismatch
+bool lzDecompress(const unsigned char *in, std::size_t n, unsigned char *out, std::size_t outBytes)
+{
+    const unsigned char *ip = in, *end = in + n;
+    unsigned char *op = out, *outEnd = out + outBytes;
+    auto readLength = [&](std::size_t length, bool &ok) {
+        if (length != 15)
+            return length;
+        for (;;) {
+            if (ip == end) {
+                ok = false;
+                return length;
+            }
+            unsigned char more = *ip++;
+            length += more;
+            if (more != 255)
+                return length;
+        }
+    };
+    while (ip < end) {
+        bool ok = true;
+        unsigned char token = *ip++;
+        std::size_t literals = readLength(token >> 4, ok);
+        if (!ok || literals > static_cast<std::size_t>(end - ip) || literals > static_cast<std::size_t>(outEnd - op))
+            return false;
+        std::memcpy(op, ip, literals);
+        op += literals;
+        ip += literals;
+        if (ip == end)
+            break; // the final, literal-only sequence
+        if (end - ip < 2)
+            return false;
+        std::size_t offset = ip[0] | (static_cast<std::size_t>(ip[1]) << 8);
+        ip += 2;
+        std::size_t length = readLength(token & 15, ok) + 4;
+        if (!ok || offset == 0 || offset > static_cast<std::size_t>(op - out)
+            || length > static_cast<std::size_t>(outEnd - op))
+            return false;
+        const unsigned char *match = op - offset;
+        for (std::size_t k = 0; k < length; k++) // byte by byte: the match may overlap its copy
+            op[k] = match[k];
+        op += length;
+        if (ip == end)
+            return false; // the final sequence is missing
+    }
+    return op == outEnd;
+}
+
+//------------------------------------------------------------
+// Compressed trajectory file: ball positions and the polygon's state per step, in blocks of
+// 'blockSteps' steps.
+//
+// Positions are quantized to integers, 'scale' steps per pixel, relative to the polygon
+// center. The scale comes from polygonRadius and the bit budget: twice the radius fills the
+// signed range. Each block stores, per step, the ball count and a TrajectoryFrame, then the
+// x column and the y column. Each value is the residual against a prediction from the same
+// ball in the block's earlier steps:
+//   - nothing at a block's first step, or for a ball that did not exist before
+//   - the previous position at the second step
+//   - constant velocity (2 * previous - the one before) after that
+// Residuals are zigzag coded and bit-packed in groups of 128 behind a one-byte width. The
+// block is then run through the LZ codec and stored that way when it comes out smaller.
+//
+// Blocks depend on nothing before them, so a reader seeks to any step by decoding at most
+// one block. The index of blocks and a footer close the file:
+//   TrajectoryHeader | block ... | TrajectoryBlockEntry x blockCount | TrajectoryFooter
+// Values are stored in the host's byte order.
+//------------------------------------------------------------
+const char TRAJECTORY_MAGIC[8] = {'B', 'B', 'T', 'R', 'A', 'J', '2', '\0'};
+
+struct TrajectoryHeader {
+    char magic[8];
+    std::uint32_t bits;       // quantization bits per coordinate
+    std::uint32_t blockSteps;
+    float polygonRadius;
+    float centerX, centerY;
+    float scale;              // quantization steps per pixel
+    float ballRadius;
+};
+
+// The polygon at one step, and when the step ended
+struct TrajectoryFrame {
+    float time = 0.f;         // seconds since the recording started
+    float angle = 0.f;        // polygon rotation in radians
+    std::uint32_t sides = 0;
+};
+
+struct TrajectoryBlockEntry {
+    std::uint32_t firstStep, stepCount;
+    std::uint64_t offset;     // from the start of the file
+    std::uint32_t rawBytes;   // decoded size
+    std::uint32_t storedBytes;
+    std::uint32_t compressed; // 1 if stored through the LZ codec
+    float firstTime;          // TrajectoryFrame::time of the first step
+};
+
+struct TrajectoryFooter {
+    std::uint64_t indexOffset;
+    std::uint32_t blockCount;
+    std::uint32_t steps;
+    char magic[8];
+};
+
+// Residual stream: zigzag values bit-packed in groups of 128, each led by its bit width
+inline void packResiduals(const std::int32_t *residuals, std::size_t count, std::vector<unsigned char> &out)
+{
+    const std::size_t GROUP = 128;
+    for (std::size_t first = 0; first < count; first += GROUP) {
+        std::size_t n = std::min(GROUP, count - first);
+        std::uint32_t zigzag[GROUP], all = 0;
+        for (std::size_t k = 0; k < n; k++) {
+            std::int32_t r = residuals[first + k];
+            zigzag[k] = (static_cast<std::uint32_t>(r) << 1) ^ static_cast<std::uint32_t>(r >> 31);
+            all |= zigzag[k];
+        }
+        int width = all ? 32 - __builtin_clz(all) : 0;
+        out.push_back(static_cast<unsigned char>(width));
+        std::uint64_t bits = 0;
+        int pending = 0;
+        for (std::size_t k = 0; k < n && width > 0; k++) {
+            bits |= static_cast<std::uint64_t>(zigzag[k]) << pending;
+            pending += width;
+            for (; pending >= 8; pending -= 8, bits >>= 8)
+                out.push_back(static_cast<unsigned char>(bits));
+        }
+        if (pending > 0)
+            out.push_back(static_cast<unsigned char>(bits));
+    }
+}
+
+inline bool unpackResiduals(const unsigned char *&p, const unsigned char *end, std::size_t count,
+                            std::int32_t *residuals)
+{
+    const std::size_t GROUP = 128;
+    for (std::size_t first = 0; first < count; first += GROUP) {
+        std::size_t n = std::min(GROUP, count - first);
+        if (p == end || *p > 32)
+            return false;
+        int width = *p++;
+        std::size_t bytes = (n * width + 7) / 8;
+        if (bytes > static_cast<std::size_t>(end - p))
+            return false;
+        std::uint64_t bits = 0, mask = (std::uint64_t(1) << width) - 1;
+        int available = 0;
+        for (std::size_t k = 0; k < n; k++) {
+            for (; available < width; available += 8)
+                bits |= static_cast<std::uint64_t>(*p++) << available;
+            std::uint32_t z = static_cast<std::uint32_t>(bits & mask);
+            bits >>= width;
+            available -= width;
+            residuals[first + k] = static_cast<std::int32_t>(z >> 1) ^ -static_cast<std::int32_t>(z & 1);
+        }
+    }
+    return true;
+}
+
+// Prediction of ball i at the current step from its two previous quantized values in the block
+inline std::int32_t predictTrajectory(const std::vector<std::int32_t> &previous, const std::vector<std::int32_t> &before,
+                                      std::size_t i)
+{
+    if (i >= previous.size())
+        return 0;
+    if (i >= before.size())
+        return previous[i];
+    return 2 * previous[i] - before[i];
+}
+
+struct TrajectoryWriter {
+    struct Stats {
+        std::uint32_t steps = 0, blocks = 0;
+        std::uint64_t rawBytes = 0;    // the positions as float pairs
+        std::uint64_t storedBytes = 0; // the whole file
+    };
+
+    TrajectoryWriter(const std::string &path, float polygonRadius, const sf::Vector2f &center, float ballRadius,
+                     int bits = 16, int blockSteps = 32, std::size_t budgetBytes = 16 << 20)
+        : out(path, 1 << 20, std::max<std::size_t>(2, budgetBytes >> 20))
+    {
+        std::memcpy(header.magic, TRAJECTORY_MAGIC, sizeof(header.magic));
+        header.bits = static_cast<std::uint32_t>(std::max(8, std::min(bits, 28))); // residuals stay within int32
+        header.blockSteps = static_cast<std::uint32_t>(std::max(1, blockSteps));
+        header.polygonRadius = polygonRadius;
+        header.centerX = center.x;
+        header.centerY = center.y;
+        header.scale = static_cast<float>(1 << (header.bits - 1)) / (2.f * polygonRadius);
+        header.ballRadius = ballRadius;
+        limit = (1 << (header.bits - 1)) - 1;
+        write(&header, sizeof(header));
+    }
+
+    ~TrajectoryWriter() { close(); }
+
+    bool ok() const { return out.ok(); }
+    const Stats &stats() const { return totals; }
+    float scale() const { return header.scale; }
+
+    void add(const std::vector<sf::Vector2f> &positions, const TrajectoryFrame &frame)
+    {
+        if (blockStepCount == 0)
+            blockFirstTime = frame.time;
+        std::size_t count = positions.size();
+        x.resize(count);
+        y.resize(count);
+        for (std::size_t i = 0; i < count; i++) {
+            x[i] = quantize(positions[i].x - header.centerX);
+            y[i] = quantize(positions[i].y - header.centerY);
+        }
+        std::uint32_t count32 = static_cast<std::uint32_t>(count);
+        const unsigned char *countBytes = reinterpret_cast<const unsigned char *>(&count32);
+        const unsigned char *frameBytes = reinterpret_cast<const unsigned char *>(&frame);
+        raw.insert(raw.end(), countBytes, countBytes + sizeof(count32));
+        raw.insert(raw.end(), frameBytes, frameBytes + sizeof(frame));
+        for (int axis = 0; axis < 2; axis++) {
+            std::vector<std::int32_t> &now = axis ? y : x, &previous = axis ? previousY : previousX,
+                                      &before = axis ? beforeY : beforeX;
+            residuals.resize(count);
+            for (std::size_t i = 0; i < count; i++)
+                residuals[i] = now[i] - predictTrajectory(previous, before, i);
+            packResiduals(residuals.data(), count, raw);
+            before.swap(previous);
+            previous = now;
+        }
+        totals.rawBytes += 2 * sizeof(float) * count;
+        if (++blockStepCount == header.blockSteps)
+            flushBlock();
+    }
+
+    // Write the last block, the index and the footer; false if any write failed
+    bool close()
+    {
+        if (closed)
+            return !failed;
+        closed = true;
+        flushBlock();
+        TrajectoryFooter footer;
+        footer.indexOffset = offset;
+        footer.blockCount = static_cast<std::uint32_t>(index.size());
+        footer.steps = totals.steps;
+        std::memcpy(footer.magic, TRAJECTORY_MAGIC, sizeof(footer.magic));
+        write(index.data(), index.size() * sizeof(TrajectoryBlockEntry));
+        write(&footer, sizeof(footer));
+        totals.storedBytes = offset;
+        failed = !out.close() || failed;
+        return !failed;
+    }
+
+private:
+    AsyncFileWriter out;
+    TrajectoryHeader header;
+    std::int32_t limit = 0;
+    std::vector<std::int32_t> x, y, previousX, previousY, beforeX, beforeY, residuals;
+    std::vector<unsigned char> raw, packed;
+    std::vector<std::uint32_t> hashTable;
+    std::vector<TrajectoryBlockEntry> index;
+    std::uint32_t blockStepCount = 0;
+    float blockFirstTime = 0.f;
+    std::uint64_t offset = 0;
+    Stats totals;
+    bool closed = false, failed = false;
+
+    std::int32_t quantize(float v) const
+    {
+        std::int32_t q = floorToInt(v * header.scale + 0.5f);
+        return std::max(-limit, std::min(q, limit));
+    }
+
+    void write(const void *data, std::size_t bytes)
+    {
+        out.append(data, bytes);
+        offset += bytes;
+    }
+
+    void flushBlock()
+    {
+        if (blockStepCount == 0)
+            return;
+        lzCompress(raw.data(), raw.size(), packed, hashTable);
+        bool compressed = packed.size() < raw.size();
+        const std::vector<unsigned char> &stored = compressed ? packed : raw;
+        TrajectoryBlockEntry entry;
+        entry.firstStep = totals.steps;
+        entry.stepCount = blockStepCount;
+        entry.offset = offset;
+        entry.rawBytes = static_cast<std::uint32_t>(raw.size());
+        entry.storedBytes = static_cast<std::uint32_t>(stored.size());
+        entry.compressed = compressed;
+        entry.firstTime = blockFirstTime;
+        index.push_back(entry);
+        write(stored.data(), stored.size());
+
+        totals.steps += blockStepCount;
+        totals.blocks++;
+        blockStepCount = 0;
+        raw.clear();
+        previousX.clear();
+        previousY.clear();
+        beforeX.clear();
+        beforeY.clear();
+    }
+};
+
+//------------------------------------------------------------
+// Reads a trajectory file through a read-only mapping. read() decodes the block holding the
+// step and keeps it, so stepping through a block decodes it only once.
+//------------------------------------------------------------
+struct TrajectoryReader {
+    TrajectoryHeader header;
+
+    ~TrajectoryReader()
+    {
+        if (data)
+            munmap(const_cast<unsigned char *>(data), bytes);
+    }
+
+    bool open(const std::string &path)
+    {
+        int fd = ::open(path.c_str(), O_RDONLY);
+        if (fd < 0)
+            return false;
+        struct stat info;
+        bool sized = fstat(fd, &info) == 0
+                  && info.st_size >= static_cast<off_t>(sizeof(TrajectoryHeader) + sizeof(TrajectoryFooter));
+        void *mapped = sized ? mmap(nullptr, info.st_size, PROT_READ, MAP_SHARED, fd, 0) : MAP_FAILED;
+        ::close(fd);
+        if (mapped == MAP_FAILED)
+            return false;
+        data = static_cast<const unsigned char *>(mapped);
+        bytes = static_cast<std::size_t>(info.st_size);
+
+        std::memcpy(&header, data, sizeof(header));
+        std::memcpy(&footer, data + bytes - sizeof(footer), sizeof(footer));
+        if (std::memcmp(header.magic, TRAJECTORY_MAGIC, sizeof(TRAJECTORY_MAGIC)) != 0
+            || std::memcmp(footer.magic, TRAJECTORY_MAGIC, sizeof(TRAJECTORY_MAGIC)) != 0
+            || footer.indexOffset > bytes
+            || footer.indexOffset + footer.blockCount * sizeof(TrajectoryBlockEntry) + sizeof(footer) != bytes)
+            return false;
+        index.resize(footer.blockCount);
+        std::memcpy(index.data(), data + footer.indexOffset, index.size() * sizeof(TrajectoryBlockEntry));
+        // Blocks must tile the steps in order, so blockOf() and blockAt() can binary-search
+        // them, and lie between the header and the index. A compressed block cannot expand
+        // by more than the 255 bytes of output one length byte can add.
+        std::uint64_t nextStep = 0;
+        float previousTime = -INFINITY;
+        for (const TrajectoryBlockEntry &entry : index) {
+            if (entry.firstStep != nextStep || entry.stepCount == 0 || !(entry.firstTime >= previousTime)
+                || entry.offset < sizeof(TrajectoryHeader) || entry.offset > footer.indexOffset
+                || entry.storedBytes > footer.indexOffset - entry.offset
+                || (entry.compressed && entry.rawBytes / 256 > entry.storedBytes))
+                return false;
+            nextStep += entry.stepCount;
+            previousTime = entry.firstTime;
+        }
+        if (nextStep != footer.steps)
+            return false;
+        DecodedBlock last;
+        if (!index.empty()) {
+            if (!decode(index.size() - 1, last))
+                return false;
+            lastTime = last.frames.back().time;
+        }
+        return true;
+    }
+
+    std::uint32_t steps() const { return footer.steps; }
+    std::size_t blockCount() const { return index.size(); }
+    const TrajectoryBlockEntry &block(std::size_t b) const { return index[b]; }
+
+    // Block holding 'step' (which must be < steps())
+    std::size_t blockOf(std::uint32_t step) const
+    {
+        auto it = std::upper_bound(index.begin(), index.end(), step,
+                                   [](std::uint32_t s, const TrajectoryBlockEntry &e) { return s < e.firstStep; });
+        return it == index.begin() ? 0 : static_cast<std::size_t>(it - index.begin()) - 1;
+    }
+
+    // Block holding the last step that ended at or before 'time' (the first block if none did)
+    std::size_t blockAt(float time) const
+    {
+        auto it = std::upper_bound(index.begin(), index.end(), time,
+                                   [](float t, const TrajectoryBlockEntry &e) { return t < e.firstTime; });
+        return it == index.begin() ? 0 : static_cast<std::size_t>(it - index.begin()) - 1;
+    }
+
+    // Time of the last step
+    float duration() const { return lastTime; }
+
+    // Ask the kernel to start reading block 'b' from disk
+    void willNeed(std::size_t b) const
+    {
+        const std::size_t page = 4096;
+        std::size_t begin = index[b].offset / page * page, end = index[b].offset + index[b].storedBytes;
+        madvise(const_cast<unsigned char *>(data) + begin, end - begin, MADV_WILLNEED);
+    }
+
+    bool read(std::uint32_t step, std::vector<sf::Vector2f> &positions, TrajectoryFrame *frame = nullptr)
+    {
+        if (step >= footer.steps)
+            return false;
+        std::size_t b = blockOf(step);
+        if (b != decodedBlock && !decode(b, decoded))
+            return false;
+        decodedBlock = b;
+        if (frame)
+            *frame = decoded.frames[step - index[b].firstStep];
+        return decoded.positions(header, step - index[b].firstStep, positions);
+    }
+
+    // A decoded block: the quantized columns of every step, back to back
+    struct DecodedBlock {
+        std::vector<std::int32_t> x, y;
+        std::vector<std::size_t> stepStart; // stepCount + 1 offsets into x and y
+        std::vector<TrajectoryFrame> frames;
+
+        // Last step of the block that ended at or before 'time' (the first step if none did)
+        std::uint32_t stepAt(float time) const
+        {
+            auto it = std::upper_bound(frames.begin(), frames.end(), time,
+                                       [](float t, const TrajectoryFrame &f) { return t < f.time; });
+            return it == frames.begin() ? 0 : static_cast<std::uint32_t>(it - frames.begin()) - 1;
+        }
+
+        bool positions(const TrajectoryHeader &h, std::uint32_t step, std::vector<sf::Vector2f> &out) const
+        {
+            if (step + 1 >= stepStart.size())
+                return false;
+            std::size_t first = stepStart[step], count = stepStart[step + 1] - first;
+            out.resize(count);
+            float inverse = 1.f / h.scale;
+            for (std::size_t i = 0; i < count; i++)
+                out[i] = sf::Vector2f(h.centerX + x[first + i] * inverse, h.centerY + y[first + i] * inverse);
+            return true;
+        }
+    };
+
+    // Decode block 'b' into 'out'; safe to call from several threads with different outputs
+    bool decode(std::size_t b, DecodedBlock &out) const
+    {
+        const TrajectoryBlockEntry &entry = index[b];
+        const unsigned char *stored = data + entry.offset;
+        std::vector<unsigned char> raw;
+        if (entry.compressed) {
+            raw.resize(entry.rawBytes);
+            if (!lzDecompress(stored, entry.storedBytes, raw.data(), raw.size()))
+                return false;
+            stored = raw.data();
+        } else if (entry.storedBytes != entry.rawBytes) {
+            return false;
+        }
+        const unsigned char *p = stored, *end = stored + entry.rawBytes;
+        out.x.clear();
+        out.y.clear();
+        out.stepStart.assign(1, 0);
+        out.frames.resize(entry.stepCount);
+        std::vector<std::int32_t> previousX, previousY, beforeX, beforeY, residuals;
+        for (std::uint32_t s = 0; s < entry.stepCount; s++) {
+            std::uint32_t count;
+            if (end - p < static_cast<std::ptrdiff_t>(sizeof(count) + sizeof(TrajectoryFrame)))
+                return false;
+            std::memcpy(&count, p, sizeof(count));
+            std::memcpy(&out.frames[s], p + sizeof(count), sizeof(TrajectoryFrame));
+            p += sizeof(count) + sizeof(TrajectoryFrame);
+            // Each axis stores at least one width byte per group of 128, so a count the
+            // remaining bytes cannot hold is corrupt; reject it before allocating for it
+            if ((static_cast<std::uint64_t>(count) + 127) / 128 * 2 > static_cast<std::uint64_t>(end - p))
+                return false;
+            residuals.resize(count);
+            for (int axis = 0; axis < 2; axis++) {
+                std::vector<std::int32_t> &column = axis ? out.y : out.x, &previous = axis ? previousY : previousX,
+                                          &before = axis ? beforeY : beforeX;
+                if (!unpackResiduals(p, end, count, residuals.data()))
+                    return false;
+                std::size_t first = column.size();
+                for (std::size_t i = 0; i < count; i++)
+                    column.push_back(residuals[i] + predictTrajectory(previous, before, i));
+                before.swap(previous);
+                previous.assign(column.begin() + first, column.end());
+            }
+            out.stepStart.push_back(out.x.size());
+        }
+        return p == end;
+    }
+
+private:
+    const unsigned char *data = nullptr;
+    std::size_t bytes = 0;
+    TrajectoryFooter footer;
+    std::vector<TrajectoryBlockEntry> index;
+    DecodedBlock decoded;
+    std::size_t decodedBlock = static_cast<std::size_t>(-1);
+    float lastTime = 0.f;
+};
+
+//------------------------------------------------------------
+// Playback of a trajectory file: a cache of decoded blocks in front of a TrajectoryReader,
+// filled ahead of the playhead by a prefetch thread. prefetch() names the times the next
+// few frames will show; their blocks are paged in (madvise) and decoded in the background,
+// so a frame normally finds its block decoded even when 100x playback skips several blocks
+// per frame. A frame whose block is not ready decodes it on the spot, and is counted as a miss.
+//------------------------------------------------------------
+struct TrajectoryPlayback {
+    typedef TrajectoryReader::DecodedBlock Block;
+
+    std::size_t hits = 0, misses = 0;
+
+    TrajectoryPlayback(const TrajectoryReader &trajectory, std::size_t cacheBlocks = 8, bool background = true)
+        : reader(trajectory), capacity(std::max<std::size_t>(cacheBlocks, 2))
+    {
+        if (background)
+            worker = std::thread([this] { prefetchLoop(); });
+    }
+
+    ~TrajectoryPlayback()
+    {
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            stopping = true;
+        }
+        wanted.notify_all();
+        if (worker.joinable())
+            worker.join();
+    }
+
+    // The last step that ended at or before 'time': its positions and polygon state
+    bool frameAt(float time, std::vector<sf::Vector2f> &positions, TrajectoryFrame &frame, std::uint32_t &step)
+    {
+        if (reader.steps() == 0)
+            return false;
+        std::size_t b = reader.blockAt(time);
+        std::shared_ptr<const Block> block = find(b);
+        if (block) {
+            hits++;
+        } else {
+            misses++;
+            std::shared_ptr<Block> decoded = std::make_shared<Block>();
+            if (!reader.decode(b, *decoded))
+                return false;
+            insert(b, decoded);
+            block = decoded;
+        }
+        std::uint32_t local = block->stepAt(time);
+        step = reader.block(b).firstStep + local;
+        frame = block->frames[local];
+        return block->positions(reader.header, local, positions);
+    }
+
+    // Queue the blocks holding these times, nearest first
+    void prefetch(const std::vector<float> &times)
+    {
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            queue.clear();
+            for (float t : times) {
+                std::size_t b = reader.blockAt(std::max(0.f, std::min(t, reader.duration())));
+                if (std::find(queue.begin(), queue.end(), b) == queue.end() && !cachedLocked(b))
+                    queue.push_back(b);
+            }
+        }
+        wanted.notify_one();
+    }
+
+private:
+    struct Entry {
+        std::size_t block;
+        std::uint64_t lastUse;
+        std::shared_ptr<const Block> decoded;
+    };
+
+    const TrajectoryReader &reader;
+    std::size_t capacity;
+    std::vector<Entry> cache;
+    std::deque<std::size_t> queue;
+    std::uint64_t clock = 0;
+    std::mutex mutex;
+    std::condition_variable wanted;
+    std::thread worker;
+    bool stopping = false;
+
+    bool cachedLocked(std::size_t b) const
+    {
+        for (const Entry &entry : cache)
+            if (entry.block == b)
+                return true;
+        return false;
+    }
+
+    std::shared_ptr<const Block> find(std::size_t b)
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        for (Entry &entry : cache) {
+            if (entry.block == b) {
+                entry.lastUse = ++clock;
+                return entry.decoded;
+            }
+        }
+        return nullptr;
+    }
+
+    // Keep 'decoded' in place of the least recently used block
+    void insert(std::size_t b, const std::shared_ptr<const Block> &decoded)
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        if (cachedLocked(b))
+            return;
+        if (cache.size() < capacity) {
+            cache.push_back(Entry{b, ++clock, decoded});
+            return;
+        }
+        Entry *oldest = &cache[0];
+        for (Entry &entry : cache)
+            if (entry.lastUse < oldest->lastUse)
+                oldest = &entry;
+        *oldest = Entry{b, ++clock, decoded};
+    }
+
+    void prefetchLoop()
+    {
+        for (;;) {
+            std::size_t b;
+            {
+                std::unique_lock<std::mutex> lock(mutex);
+                wanted.wait(lock, [this] { return stopping || !queue.empty(); });
+                if (stopping)
+                    return;
+                b = queue.front();
+                queue.pop_front();
+                if (cachedLocked(b))
+                    continue;
+            }
+            reader.willNeed(b);
+            std::shared_ptr<Block> decoded = std::make_shared<Block>();
+            if (reader.decode(b, *decoded))
+                insert(b, decoded);
+        }
+    }
+};
+
+//------------------------------------------------------------
+// Occupancy heatmap: how many step-ends each cell has seen a ball center in, kept twice.
+// The world grid covers a fixed rectangle of the screen; the local grid is a square of side
+// 2 * localRadius in the polygon's own frame (rotated back by the polygon's angle about its
+// pivot), so it shows coverage relative to the walls. Balls are binned eight at a time with
+// the rasterizer's vector types; only the increments themselves are scalar.
+//------------------------------------------------------------
+struct OccupancyHeatmap {
+    int worldWidth = 0, worldHeight = 0;
+    sf::Vector2f worldOrigin; // top-left corner of the world grid
+    float worldCell = 1.f;
+    int localSize = 0;
+    float localRadius = 1.f;
+    std::vector<std::uint32_t> world, local;
+    std::uint64_t samples = 0; // step-ends accumulated
+
+    OccupancyHeatmap(const sf::FloatRect &worldBounds, float cell, float radius, int localCells)
+        : worldWidth(static_cast<int>(std::ceil(worldBounds.width / cell))),
+          worldHeight(static_cast<int>(std::ceil(worldBounds.height / cell))),
+          worldOrigin(worldBounds.left, worldBounds.top), worldCell(cell),
+          localSize(localCells), localRadius(radius),
+          world(static_cast<std::size_t>(worldWidth) * worldHeight, 0),
+          local(static_cast<std::size_t>(localSize) * localSize, 0)
+    {
+    }
+
+    void clear()
+    {
+        std::fill(world.begin(), world.end(), 0);
+        std::fill(local.begin(), local.end(), 0);
+        samples = 0;
+    }
+
+    // Bin every position; 'angle' (radians) is the polygon's rotation about 'pivot'
+    void add(const std::vector<sf::Vector2f> &positions, const sf::Vector2f &pivot, float angle)
+    {
+        const float toWorld = 1.f / worldCell, toLocal = localSize / (2.f * localRadius);
+        const float c = std::cos(angle), s = std::sin(angle);
+        const std::size_t count = positions.size();
+        std::size_t i = 0;
+        for (; i + 8 <= count; i += 8) {
+            SampleVector x, y;
+            for (int k = 0; k < 8; k++) {
+                x[k] = positions[i + k].x;
+                y[k] = positions[i + k].y;
+            }
+            SampleVector wx = (x - worldOrigin.x) * toWorld, wy = (y - worldOrigin.y) * toWorld;
+            SampleVector dx = x - pivot.x, dy = y - pivot.y;
+            SampleVector lx = (c * dx + s * dy + localRadius) * toLocal;
+            SampleVector ly = (-s * dx + c * dy + localRadius) * toLocal;
+            // Range tests in float (false for NaN). The conversion to int runs on every lane and
+            // is undefined for values that do not fit, so lanes outside the grid are zeroed
+            // first: and-ing a float's bits with a false (0) lane gives 0.f.
+            SampleMask inWorld = (wx >= 0.f) & (wx < static_cast<float>(worldWidth)) & (wy >= 0.f) & (wy < static_cast<float>(worldHeight));
+            SampleMask inLocal = (lx >= 0.f) & (lx < static_cast<float>(localSize)) & (ly >= 0.f) & (ly < static_cast<float>(localSize));
+            wx = (SampleVector)((SampleMask)wx & inWorld);
+            wy = (SampleVector)((SampleMask)wy & inWorld);
+            lx = (SampleVector)((SampleMask)lx & inLocal);
+            ly = (SampleVector)((SampleMask)ly & inLocal);
+            SampleMask worldIndex = __builtin_convertvector(wy, SampleMask) * worldWidth + __builtin_convertvector(wx, SampleMask);
+            SampleMask localIndex = __builtin_convertvector(ly, SampleMask) * localSize + __builtin_convertvector(lx, SampleMask);
+            for (int k = 0; k < 8; k++) {
+                if (inWorld[k])
+                    world[worldIndex[k]]++;
+                if (inLocal[k])
+                    local[localIndex[k]]++;
+            }
+        }
+        for (; i < count; i++) {
+            sf::Vector2f w = (positions[i] - worldOrigin) * toWorld, d = positions[i] - pivot;
+            sf::Vector2f l((c * d.x + s * d.y + localRadius) * toLocal, (-s * d.x + c * d.y + localRadius) * toLocal);
+            if (w.x >= 0.f && w.x < worldWidth && w.y >= 0.f && w.y < worldHeight)
+                world[static_cast<int>(w.y) * worldWidth + static_cast<int>(w.x)]++;
+            if (l.x >= 0.f && l.x < localSize && l.y >= 0.f && l.y < localSize)
+                local[static_cast<int>(l.y) * localSize + static_cast<int>(l.x)]++;
+        }
+        samples++;
+    }
+
+    // Write both grids as 16-bit binary PGMs (prefix_world.pgm, prefix_local.pgm), each
+    // scaled so its busiest cell is 65535. Rewritten in place on every flush.
+    bool flush(const std::string &prefix) const
+    {
+        return writePgm(prefix + "_world.pgm", world, worldWidth, worldHeight)
+            && writePgm(prefix + "_local.pgm", local, localSize, localSize);
+    }
+
+    // Fill 'pixels' (RGBA, one pixel per cell) with a translucent heat ramp of one grid, for
+    // drawing as an overlay. Square-root scaling keeps rarely visited cells visible.
+    static void toOverlay(const std::vector<std::uint32_t> &cells, std::vector<sf::Uint8> &pixels)
+    {
+        std::uint32_t peak = std::max<std::uint32_t>(1, *std::max_element(cells.begin(), cells.end()));
+        float scale = 1.f / std::sqrt(static_cast<float>(peak));
+        pixels.resize(cells.size() * 4);
+        for (std::size_t k = 0; k < cells.size(); k++) {
+            float heat = std::sqrt(static_cast<float>(cells[k])) * scale;
+            pixels[4 * k] = static_cast<sf::Uint8>(255.f * std::min(1.f, 2.f * heat));
+            pixels[4 * k + 1] = static_cast<sf::Uint8>(255.f * std::max(0.f, 2.f * heat - 1.f));
+            pixels[4 * k + 2] = static_cast<sf::Uint8>(255.f * (1.f - heat) * (cells[k] > 0));
+            pixels[4 * k + 3] = static_cast<sf::Uint8>(cells[k] > 0 ? 64.f + 128.f * heat : 0.f);
+        }
+    }
+
+private:
+    static bool writePgm(const std::string &path, const std::vector<std::uint32_t> &cells, int width, int height)
+    {
+        std::uint32_t peak = std::max<std::uint32_t>(1, *std::max_element(cells.begin(), cells.end()));
+        std::vector<char> data(cells.size() * 2);
+        for (std::size_t k = 0; k < cells.size(); k++) {
+            std::uint32_t v = static_cast<std::uint32_t>(static_cast<std::uint64_t>(cells[k]) * 65535 / peak);
+            data[2 * k] = static_cast<char>(v >> 8); // PGM samples are big-endian
+            data[2 * k + 1] = static_cast<char>(v & 0xff);
+        }
+        std::ofstream out(path, std::ios::binary);
+        out << "P5\n" << width << " " << height << "\n65535\n";
+        out.write(data.data(), data.size());
+        if (!out)
+            std::cerr << "Error: Could not write " << path << "\n";
+        return static_cast<bool>(out);
+    }
+};
+
+//------------------------------------------------------------
+// Glyph atlas: the printable ASCII glyphs of one font, at every character size the UI uses,
+// packed into a single texture so all text can be drawn with one texture bound.
+//------------------------------------------------------------
+struct GlyphAtlas {
+    static const char FIRST = ' ', LAST = '~';
+
+    struct Glyph {
+        sf::FloatRect bounds;   // quad relative to the pen position on the baseline
+        sf::FloatRect texCoords;
+        float advance = 0.f;
+    };
+
+    const sf::Font *font = nullptr;
+    sf::Texture texture;
+    std::vector<unsigned> sizes;
+    std::vector<std::vector<Glyph>> glyphs; // per size, indexed by character - FIRST
+
+    bool bake(const sf::Font &source, const std::vector<unsigned> &characterSizes)
+    {
+        const unsigned atlasWidth = 512, padding = 1;
+        font = &source;
+        sizes = characterSizes;
+        glyphs.assign(sizes.size(), std::vector<Glyph>(LAST - FIRST + 1));
+
+        // Rasterize every glyph first (this may grow the font's pages), then copy the
+        // pages once and shelf-pack the glyph rectangles into the atlas
+        std::vector<sf::Image> pages(sizes.size());
+        for (std::size_t s = 0; s < sizes.size(); s++) {
+            for (char c = FIRST; c <= LAST; c++)
+                source.getGlyph(static_cast<sf::Uint32>(c), sizes[s], false);
+            pages[s] = source.getTexture(sizes[s]).copyToImage();
+        }
+
+        std::vector<sf::IntRect> placement;
+        unsigned x = 0, y = 0, shelfHeight = 0;
+        for (std::size_t s = 0; s < sizes.size(); s++)
+            for (char c = FIRST; c <= LAST; c++) {
+                sf::IntRect rect = source.getGlyph(static_cast<sf::Uint32>(c), sizes[s], false).textureRect;
+                if (x + rect.width + padding > atlasWidth) {
+                    x = 0;
+                    y += shelfHeight + padding;
+                    shelfHeight = 0;
+                }
+                placement.emplace_back(x, y, rect.width, rect.height);
+                x += rect.width + padding;
+                shelfHeight = std::max(shelfHeight, static_cast<unsigned>(rect.height));
+            }
+
+        sf::Image atlas;
+        atlas.create(atlasWidth, std::max(1u, y + shelfHeight), sf::Color::Transparent);
+        std::size_t k = 0;
+        for (std::size_t s = 0; s < sizes.size(); s++)
+            for (char c = FIRST; c <= LAST; c++, k++) {
+                const sf::Glyph &fontGlyph = source.getGlyph(static_cast<sf::Uint32>(c), sizes[s], false);
+                atlas.copy(pages[s], placement[k].left, placement[k].top, fontGlyph.textureRect);
+                Glyph &glyph = glyphs[s][c - FIRST];
+                glyph.bounds = fontGlyph.bounds;
+                glyph.texCoords = sf::FloatRect(placement[k]);
+                glyph.advance = fontGlyph.advance;
+            }
+        return texture.loadFromImage(atlas);
+    }
+
+    int sizeIndex(unsigned characterSize) const
+    {
+        for (std::size_t s = 0; s < sizes.size(); s++)
+            if (sizes[s] == characterSize)
+                return static_cast<int>(s);
+        return -1;
+    }
+};
+
+//------------------------------------------------------------
+// Text batching on top of the atlas. A layout is a string turned into glyph quads once;
+// static strings keep their layout, dynamic ones (the HUD) re-lay into the same storage.
+// Every layout placed during a frame is appended to one vertex array and drawn in a
+// single call.
+//------------------------------------------------------------
+struct TextLayout {
+    std::vector<sf::Vertex> vertices; // two triangles per visible glyph, pen starts at (0, 0)
+    sf::FloatRect bounds;
+
+    // Place the layout so the center of its bounds lands on 'position', like the
+    // setOrigin(center) idiom used with sf::Text
+    sf::Vector2f centeredAt(const sf::Vector2f &position) const
+    {
+        return position - sf::Vector2f(bounds.left + bounds.width / 2.f, bounds.top + bounds.height / 2.f);
+    }
+};
+
+struct TextBatch {
+    const GlyphAtlas &atlas;
+    std::vector<sf::Vertex> vertices;
+
+    explicit TextBatch(const GlyphAtlas &glyphAtlas) : atlas(glyphAtlas) {}
+
+    // Lay out 'text' at 'characterSize' (which must have been baked); the pen starts on the
+    // first baseline like sf::Text, so bounds match sf::Text::getLocalBounds()
+    void layout(TextLayout &out, const std::string &text, unsigned characterSize) const
+    {
+        out.vertices.clear();
+        int s = atlas.sizeIndex(characterSize);
+        if (s < 0)
+            return;
+        float lineSpacing = atlas.font->getLineSpacing(characterSize);
+        float x = 0.f, y = static_cast<float>(characterSize);
+        float minX = 1e30f, minY = 1e30f, maxX = -1e30f, maxY = -1e30f;
+        char previous = 0;
+        for (char c : text) {
+            if (c == '\n') {
+                x = 0.f;
+                y += lineSpacing;
+                previous = 0;
+                continue;
+            }
+            if (c < GlyphAtlas::FIRST || c > GlyphAtlas::LAST)
+                c = '?';
+            if (previous)
+                x += atlas.font->getKerning(static_cast<sf::Uint32>(previous), static_cast<sf::Uint32>(c), characterSize);
+            previous = c;
+
+            const GlyphAtlas::Glyph &glyph = atlas.glyphs[s][c - GlyphAtlas::FIRST];
+            if (glyph.bounds.width > 0.f && glyph.bounds.height > 0.f) {
+                float l = x + glyph.bounds.left, t = y + glyph.bounds.top;
+                float r = l + glyph.bounds.width, b = t + glyph.bounds.height;
+                const sf::FloatRect &uv = glyph.texCoords;
+                sf::Vertex quad[4] = {
+                    sf::Vertex(sf::Vector2f(l, t), sf::Vector2f(uv.left, uv.top)),
+                    sf::Vertex(sf::Vector2f(r, t), sf::Vector2f(uv.left + uv.width, uv.top)),
+                    sf::Vertex(sf::Vector2f(l, b), sf::Vector2f(uv.left, uv.top + uv.height)),
+                    sf::Vertex(sf::Vector2f(r, b), sf::Vector2f(uv.left + uv.width, uv.top + uv.height))};
+                for (int v : {0, 1, 2, 2, 1, 3})
+                    out.vertices.push_back(quad[v]);
+                minX = std::min(minX, l);
+                minY = std::min(minY, t);
+                maxX = std::max(maxX, r);
+                maxY = std::max(maxY, b);
+            }
+            x += glyph.advance;
+        }
+        out.bounds = out.vertices.empty() ? sf::FloatRect() : sf::FloatRect(minX, minY, maxX - minX, maxY - minY);
+    }
+
+    void add(const TextLayout &text, const sf::Vector2f &position, const sf::Color &color)
+    {
+        for (sf::Vertex vertex : text.vertices) {
+            vertex.position += position;
+            vertex.color = color;
+            vertices.push_back(vertex);
+        }
+    }
+
+    // Draw everything added since the last call in one draw call
+    void draw(sf::RenderTarget &target, sf::RenderStates states = sf::RenderStates::Default)
+    {
+        if (vertices.empty())
+            return;
+        states.texture = &atlas.texture;
+        target.draw(vertices.data(), vertices.size(), sf::Triangles, states);
+        vertices.clear();
+    }
+};
+
+//------------------------------------------------------------
+// Struct representing a UI tab for shape selection
+//------------------------------------------------------------
+const sf::Color TAB_COLOR(100, 100, 100);
+const sf::Color TAB_SELECTED_COLOR(150, 150, 150);
+
+struct Tab {
+    sf::RectangleShape rect;
+    TextLayout label;
+    sf::Vector2f labelPosition;
+    int sides; // Number of sides for this shape
+};
+
+//------------------------------------------------------------
+// Cached layer for UI that rarely changes (instructions and tabs). The layer is rendered
+// into a texture once and composited with a single sprite draw per frame; afterwards only
+// invalidated rectangles are redrawn, clipped to the rectangle through the view's viewport.
+// The texture holds premultiplied alpha so antialiased text keeps its edges when composited.
+//------------------------------------------------------------
+struct UiLayer {
+    sf::RenderTexture texture;
+    std::vector<sf::FloatRect> dirty;
+    std::size_t redraws = 0; // dirty rectangles redrawn so far
+
+    bool create(unsigned width, unsigned height)
+    {
+        if (!texture.create(width, height))
+            return false;
+        invalidate(sf::FloatRect(0.f, 0.f, static_cast<float>(width), static_cast<float>(height)));
+        return true;
+    }
+
+    // Mark a region for redraw, merging it with any dirty rectangle it overlaps
+    void invalidate(sf::FloatRect rect)
+    {
+        for (std::size_t k = 0; k < dirty.size();) {
+            if (!dirty[k].intersects(rect)) {
+                k++;
+                continue;
+            }
+            float right = std::max(rect.left + rect.width, dirty[k].left + dirty[k].width);
+            float bottom = std::max(rect.top + rect.height, dirty[k].top + dirty[k].height);
+            rect.left = std::min(rect.left, dirty[k].left);
+            rect.top = std::min(rect.top, dirty[k].top);
+            rect.width = right - rect.left;
+            rect.height = bottom - rect.top;
+            dirty.erase(dirty.begin() + k);
+            k = 0;
+        }
+        dirty.push_back(rect);
+    }
+
+    // Redraw the dirty rectangles; 'draw(target, states)' draws the whole layer and is
+    // clipped to each rectangle in turn
+    template <typename DrawFn>
+    void update(DrawFn draw)
+    {
+        if (dirty.empty())
+            return;
+        sf::Vector2f size(texture.getSize());
+        sf::RenderStates states(sf::BlendMode(sf::BlendMode::SrcAlpha, sf::BlendMode::OneMinusSrcAlpha, sf::BlendMode::Add,
+                                              sf::BlendMode::One, sf::BlendMode::OneMinusSrcAlpha, sf::BlendMode::Add));
+        for (const sf::FloatRect &rect : dirty) {
+            sf::View clip(rect);
+            clip.setViewport(sf::FloatRect(rect.left / size.x, rect.top / size.y, rect.width / size.x, rect.height / size.y));
+            texture.setView(clip);
+
+            sf::RectangleShape clear(sf::Vector2f(rect.width, rect.height));
+            clear.setPosition(rect.left, rect.top);
+            clear.setFillColor(sf::Color::Transparent);
+            texture.draw(clear, sf::BlendNone);
+            draw(texture, states);
+            redraws++;
+        }
+        dirty.clear();
+        texture.setView(texture.getDefaultView());
+        texture.display();
+    }
+
+    void draw(sf::RenderTarget &target) const
+    {
+        sf::Sprite sprite(texture.getTexture());
+        target.draw(sprite, sf::BlendMode(sf::BlendMode::One, sf::BlendMode::OneMinusSrcAlpha));
+    }
+};
+
+//------------------------------------------------------------
+// Pointer routing for UI widgets. Widget rectangles are bucketed into a uniform grid over
+// the window (counting sort, like BallGrid), so a click only tests the widgets in its own
+// cell no matter how many buttons exist. The topmost (last added) enabled widget under
+// the pointer receives the click and nothing else does.
+//------------------------------------------------------------
+struct UiInput {
+    float cellSize = 64.f;
+    int columns = 0, rows = 0;
+    std::vector<sf::FloatRect> bounds;
+    std::vector<std::function<void()>> onClick;
+    std::vector<std::uint8_t> enabled;
+    std::vector<int> cellStart; // prefix sums into 'entries', one slot per cell (+1)
+    std::vector<int> entries;   // widget ids sorted by cell
+
+    int add(const sf::FloatRect &rect, std::function<void()> callback)
+    {
+        bounds.push_back(rect);
+        onClick.push_back(std::move(callback));
+        enabled.push_back(1);
+        return static_cast<int>(bounds.size()) - 1;
+    }
+
+    // Index every widget; call again after adding widgets or moving them
+    void build(unsigned width, unsigned height)
+    {
+        columns = std::max(1, static_cast<int>(std::ceil(width / cellSize)));
+        rows = std::max(1, static_cast<int>(std::ceil(height / cellSize)));
+        cellStart.assign(columns * rows + 1, 0);
+        for (int pass = 0; pass < 2; pass++) {
+            std::vector<int> fill(cellStart.begin(), cellStart.end() - 1);
+            for (std::size_t id = 0; id < bounds.size(); id++) {
+                int x0, y0, x1, y1;
+                cellRange(bounds[id], x0, y0, x1, y1);
+                for (int cy = y0; cy <= y1; cy++)
+                    for (int cx = x0; cx <= x1; cx++) {
+                        if (pass == 0)
+                            cellStart[cy * columns + cx + 1]++;
+                        else
+                            entries[fill[cy * columns + cx]++] = static_cast<int>(id);
+                    }
+            }
+            if (pass == 0) {
+                for (std::size_t k = 1; k < cellStart.size(); k++)
+                    cellStart[k] += cellStart[k - 1];
+                entries.resize(cellStart.back());
+            }
+        }
+    }
+
+    // Topmost enabled widget containing p, or -1
+    int hit(const sf::Vector2f &p) const
+    {
+        int cx = static_cast<int>(std::floor(p.x / cellSize)), cy = static_cast<int>(std::floor(p.y / cellSize));
+        if (cx < 0 || cy < 0 || cx >= columns || cy >= rows)
+            return -1;
+        int cell = cy * columns + cx;
+        for (int e = cellStart[cell + 1] - 1; e >= cellStart[cell]; e--) {
+            int id = entries[e];
+            if (enabled[id] && bounds[id].contains(p))
+                return id;
+        }
+        return -1;
+    }
+
+    // Route a click; returns whether a widget consumed it
+    bool click(const sf::Vector2f &p)
+    {
+        int id = hit(p);
+        if (id < 0)
+            return false;
+        if (onClick[id])
+            onClick[id]();
+        return true;
+    }
+
+private:
+    void cellRange(const sf::FloatRect &rect, int &x0, int &y0, int &x1, int &y1) const
+    {
+        x0 = std::clamp(static_cast<int>(std::floor(rect.left / cellSize)), 0, columns - 1);
+        y0 = std::clamp(static_cast<int>(std::floor(rect.top / cellSize)), 0, rows - 1);
+        x1 = std::clamp(static_cast<int>(std::floor((rect.left + rect.width) / cellSize)), 0, columns - 1);
+        y1 = std::clamp(static_cast<int>(std::floor((rect.top + rect.height) / cellSize)), 0, rows - 1);
+    }
+};
+
+//------------------------------------------------------------
+// Tab bar state: which tab is selected, and keeping the cached UI layer in sync with it
+//------------------------------------------------------------
+struct TabBar {
+    std::vector<Tab> tabs;
+    int selected = -1;
+
+    void select(int index, UiLayer &layer)
+    {
+        if (index == selected)
+            return;
+        if (selected >= 0) {
+            tabs[selected].rect.setFillColor(TAB_COLOR);
+            layer.invalidate(tabs[selected].rect.getGlobalBounds());
+        }
+        selected = index;
+        tabs[selected].rect.setFillColor(TAB_SELECTED_COLOR);
+        layer.invalidate(tabs[selected].rect.getGlobalBounds());
+    }
+};
+
+//------------------------------------------------------------
+// Benchmark: throughput of the wall contact solver with every ball touching an edge.
+// Run with: ./bouncing_ball --bench-contacts
+//------------------------------------------------------------
+int runContactBenchmark()
+{
+    const int ballCount = 100000;
+    const int steps = 100;
+    const float ballRadius = 10.f;
+    const float polygonRadius = 250.f;
+    const float angularSpeed = ROTATION_SPEED * PI / 180.f;
+
+    sf::ConvexShape polygon = createPolygon(4, polygonRadius);
+    polygon.setPosition(400.f, 320.f);
+    polygon.setRotation(17.f);
+
+    // Place every ball slightly overlapping one of the edges, moving outward
+    Balls<float> start;
+    sf::Transform transform = polygon.getTransform();
+    int count = polygon.getPointCount();
+    for (int n = 0; n < ballCount; n++) {
+        int i = n % count;
+        sf::Vector2f a = transform.transformPoint(polygon.getPoint(i));
+        sf::Vector2f b = transform.transformPoint(polygon.getPoint((i + 1) % count));
+        sf::Vector2f edge = b - a;
+        sf::Vector2f normal = normalize(sf::Vector2f(-edge.y, edge.x));
+        float along = 0.2f + 0.6f * (n % 997) / 997.f;
+        start.add(a + edge * along + normal * (ballRadius * 0.5f), -normal * 300.f);
+    }
+
+    // Only wall contacts are measured here; the balls overlap each other far too much for a pile
+    Boundary<float> boundary;
+    boundary.setFromShape(polygon, angularSpeed);
+    Balls<float> balls;
+    ContactSolver<float> solver;
+    solver.wall.reserve(ballCount * 2);
+    std::vector<int> all(ballCount);
+    for (int n = 0; n < ballCount; n++)
+        all[n] = n;
+    sf::Time elapsed;
+    std::size_t solved = 0;
+    for (int step = 0; step < steps; step++) {
+        balls = start;
+        sf::Clock clock;
+        collectWallContacts(boundary, balls, ballRadius, all, solver.wall);
+        solver.solve(balls, ballRadius, 1.f / 60.f);
+        elapsed += clock.getElapsedTime();
+        solved += solver.wall.size();
+    }
+
+    float seconds = elapsed.asSeconds();
+    std::cout << "solver iterations: " << solver.iterations << "\n"
+              << "contacts per step: " << solved / steps << "\n"
+              << "time per step:     " << seconds * 1000.f / steps << " ms\n"
+              << "throughput:        " << solved / seconds / 1e6f << " M contacts/s\n";
+    return 0;
+}
+
+//------------------------------------------------------------
+// Benchmark: settle a pile of balls under gravity in the rotating polygon and report how
+// well the contact solver converges for several iteration counts, with and without warm starting.
+// Run with: ./bouncing_ball --bench-pile
+//------------------------------------------------------------
+int runPileBenchmark()
+{
+    const int ballCount = 250;
+    const int steps = 600;
+    const float dt = 1.f / 60.f;
+    const float polygonRadius = 250.f;
+    const float angularSpeed = ROTATION_SPEED * PI / 180.f;
+    const sf::Vector2f center(400.f, 320.f);
+
+    std::cout << "iterations  warm  mean overlap (px)  max overlap (px)  mean speed (px/s)  ms/step\n"
+              << std::fixed << std::setprecision(3);
+    for (int warm = 0; warm < 2; warm++) {
+        for (int iterations : {1, 2, 4, 8, 16}) {
+            Simulation<float> sim;
+            sim.gravity = sf::Vector2f(0.f, 500.f);
+            sim.solver.iterations = iterations;
+            sim.solver.warmStarting = warm != 0;
+            sim.solver.restitution = 0.f; // a pile should come to rest rather than keep bouncing
+            sim.allowSleep = false;
+            sim.cullEscaped = false; // a badly converged pile leaks balls; keep them in the overlap stats
+
+            // Start from a loose square lattice filling a disc inside the polygon
+            float spacing = 2.f * sim.ballRadius + 1.f;
+            for (int row = -9; row <= 9; row++) {
+                for (int col = -9; col <= 9; col++) {
+                    sf::Vector2f offset(col * spacing, row * spacing);
+                    if (length(offset) < 190.f && static_cast<int>(sim.balls.size()) < ballCount)
+                        sim.balls.add(center + offset);
+                }
+            }
+
+            sf::ConvexShape polygon = createPolygon(6, polygonRadius);
+            polygon.setPosition(center);
+            Boundary<float> boundary;
+            sf::Clock clock;
+            for (int step = 0; step < steps; step++) {
+                polygon.rotate(ROTATION_SPEED * dt);
+                boundary.setFromShape(polygon, angularSpeed);
+                sim.step(boundary, dt);
+            }
+            float ms = clock.getElapsedTime().asSeconds() * 1000.f / steps;
+
+            // Measure the final state with a fresh contact pass
+            ContactSolver<float> probe;
+            std::vector<int> all(sim.balls.size());
+            for (std::size_t n = 0; n < all.size(); n++)
+                all[n] = static_cast<int>(n);
+            probe.collect(boundary, sim.balls, sim.ballRadius, all, sim.arena);
+            float overlapSum = 0.f, overlapMax = 0.f, speedSum = 0.f;
+            for (float p : probe.pairs.penetration) {
+                overlapSum += p;
+                overlapMax = std::max(overlapMax, p);
+            }
+            for (float p : probe.wall.penetration) {
+                overlapSum += p;
+                overlapMax = std::max(overlapMax, p);
+            }
+            for (const sf::Vector2f &v : sim.balls.velocity)
+                speedSum += length(v);
+            std::size_t contactCount = probe.pairs.size() + probe.wall.size();
+
+            std::cout << std::setw(10) << iterations << "  " << std::setw(4) << (warm ? "on" : "off")
+                      << std::setw(19) << (contactCount ? overlapSum / contactCount : 0.f)
+                      << std::setw(18) << overlapMax
+                      << std::setw(19) << speedSum / ballCount
+                      << "  " << std::setw(7) << ms << "\n";
+        }
+    }
+    return 0;
+}
+
+//------------------------------------------------------------
+// Benchmark: cost per step of a settled pile in a still polygon, with and without sleeping.
+// Run with: ./bouncing_ball --bench-sleep
+//------------------------------------------------------------
+int runSleepBenchmark()
+{
+    const float dt = 1.f / 60.f;
+    const float polygonRadius = 800.f;
+    const sf::Vector2f center(0.f, 0.f);
+
+    std::cout << "sleep  balls  awake  ms/step (settling)  ms/step (settled)\n" << std::fixed << std::setprecision(3);
+    for (int sleep = 0; sleep < 2; sleep++) {
+        Simulation<float> sim;
+        sim.gravity = sf::Vector2f(0.f, 500.f);
+        sim.solver.restitution = 0.f;
+        sim.allowSleep = sleep != 0;
+        float spacing = 2.f * sim.ballRadius + 1.f;
+        for (int row = -30; row <= 30; row++)
+            for (int col = -30; col <= 30; col++)
+                if (length(sf::Vector2f(col * spacing, row * spacing)) < 600.f)
+                    sim.balls.add(center + sf::Vector2f(col * spacing, row * spacing));
+
+        sf::ConvexShape polygon = createPolygon(6, polygonRadius);
+        polygon.setPosition(center);
+        Boundary<float> boundary;
+        boundary.setFromShape(polygon, 0.f);
+        sf::Clock clock;
+        for (int step = 0; step < 1200; step++)
+            sim.step(boundary, dt);
+        float settlingMs = clock.restart().asSeconds() * 1000.f / 1200;
+        for (int step = 0; step < 300; step++)
+            sim.step(boundary, dt);
+        float settledMs = clock.restart().asSeconds() * 1000.f / 300;
+
+        std::cout << std::setw(5) << (sleep ? "on" : "off") << std::setw(7) << sim.balls.size()
+                  << std::setw(7) << sim.awakeCount() << std::setw(20) << settlingMs
+                  << std::setw(19) << settledMs << "\n";
+    }
+    return 0;
+}
+
+//------------------------------------------------------------
+// Fingerprint of the ball state: FNV-1a over the bits of positions and velocities, taken
+// least significant byte first so the value does not depend on the machine's byte order.
+// Two runs of the deterministic mode must produce the same value on every machine.
+//------------------------------------------------------------
+inline std::uint32_t valueBits(float v)
+{
+    std::uint32_t bits;
+    std::memcpy(&bits, &v, sizeof(bits));
+    return bits;
+}
+
+inline std::uint64_t valueBits(double v)
+{
+    std::uint64_t bits;
+    std::memcpy(&bits, &v, sizeof(bits));
+    return bits;
+}
+
+inline std::uint64_t valueBits(Fixed v) { return static_cast<std::uint64_t>(v.raw); }
+
+template <typename T, typename P>
+std::uint64_t stateHash(const Balls<T, P> &balls)
+{
+    std::uint64_t hash = 1469598103934665603ull;
+    auto mix = [&](auto bits) {
+        for (std::size_t k = 0; k < sizeof(bits); k++)
+            hash = (hash ^ ((bits >> (8 * k)) & 0xff)) * 1099511628211ull;
+    };
+    for (std::size_t i = 0; i < balls.size(); i++) {
+        mix(valueBits(balls.position[i].x));
+        mix(valueBits(balls.position[i].y));
+        mix(valueBits(balls.velocity[i].x));
+        mix(valueBits(balls.velocity[i].y));
+    }
+    return hash;
+}
+
+//------------------------------------------------------------
+// Replay scenario shared by the precision benchmarks: a lattice of balls dropped into the
+// rotating hexagon under gravity. The polygon rotation is part of the simulated state.
+// 'afterStep(boundary)' is called after every step and left out of msPerStep.
+//------------------------------------------------------------
+template <typename T, typename P, typename F>
+void runReplayScenario(Simulation<T, P> &sim, int steps, float &msPerStep, F afterStep)
+{
+    const T dt = T(1) / T(60);
+    const P angularSpeed = P(ROTATION_SPEED * PI / 180.f);
+    const sf::Vector2<P> center(P(400), P(320));
+
+    sim.gravity = sf::Vector2<T>(T(0), T(500));
+    sim.solver.restitution = T(0.3f);
+    P spacing = P(2) * P(sim.ballRadius) + P(1);
+    for (int row = -9; row <= 9; row++) {
+        for (int col = -9; col <= 9; col++) {
+            sf::Vector2<P> offset(P(col) * spacing, P(row) * spacing);
+            if (length(offset) < P(190))
+                sim.balls.add(center + offset);
+        }
+    }
+
+    Boundary<P> boundary;
+    P angle = P(0);
+    sf::Clock clock;
+    sf::Time stepTime;
+    for (int step = 0; step < steps; step++) {
+        clock.restart();
+        angle += angularSpeed * P(dt);
+        boundary.setRegular(6, P(250), angle, center, angularSpeed);
+        sim.step(boundary, dt);
+        stepTime += clock.getElapsedTime();
+        afterStep(boundary);
+    }
+    msPerStep = stepTime.asSeconds() * 1000.f / steps;
+}
+
+//------------------------------------------------------------
+// Benchmark: cost of the deterministic fixed-point mode against the float path. Compare the
+// printed hash across machines.
+// Run with: ./bouncing_ball --bench-fixed
+//------------------------------------------------------------
+int runFixedPointBenchmark()
+{
+    const int steps = 1200;
+    float floatMs = 0.f, fixedMs = 0.f;
+
+    auto noCheck = [](const auto &) {};
+    Simulation<float> floatSim;
+    runReplayScenario(floatSim, steps, floatMs, noCheck);
+    Simulation<Fixed> fixedSim;
+    runReplayScenario(fixedSim, steps, fixedMs, noCheck);
+
+    std::cout << "balls: " << floatSim.balls.size() << ", steps: " << steps << "\n"
+              << std::fixed << std::setprecision(3)
+              << "float  " << std::setw(8) << floatMs << " ms/step  state " << std::hex << stateHash(floatSim.balls) << "\n"
+              << "fixed  " << std::setw(8) << std::dec << fixedMs << " ms/step  state " << std::hex
+              << stateHash(fixedSim.balls) << std::dec << "\n";
+    return 0;
+}
+
+//------------------------------------------------------------
+// Process-wide heap allocation counter, read by --bench-allocs and --bench-pool. Counting
+// replaces the global operator new and delete for the whole process, SFML included, so it is
+// only compiled in with -DCOUNT_ALLOCATIONS; otherwise the count stays at zero.
+//------------------------------------------------------------
+#ifdef COUNT_ALLOCATIONS
+const bool COUNTING_ALLOCATIONS = true;
+std::atomic<std::size_t> heapAllocations(0);
+
+void *countedAllocation(std::size_t size, std::size_t alignment) noexcept
+{
+    heapAllocations.fetch_add(1, std::memory_order_relaxed);
+    void *p = nullptr;
+    if (alignment <= alignof(std::max_align_t))
+        return std::malloc(size ? size : 1);
+    return posix_memalign(&p, alignment, size ? size : 1) == 0 ? p : nullptr;
+}
+
+void *countedAllocationOrThrow(std::size_t size, std::size_t alignment)
+{
+    if (void *p = countedAllocation(size, alignment))
+        return p;
+    throw std::bad_alloc();
+}
+
+// Kept out of line so GCC does not pair an inlined free() with the malloc() behind new
+__attribute__((noinline)) void *operator new(std::size_t size) { return countedAllocationOrThrow(size, 0); }
+__attribute__((noinline)) void *operator new[](std::size_t size) { return countedAllocationOrThrow(size, 0); }
+__attribute__((noinline)) void *operator new(std::size_t size, std::align_val_t alignment)
+{
+    return countedAllocationOrThrow(size, static_cast<std::size_t>(alignment));
+}
+__attribute__((noinline)) void *operator new[](std::size_t size, std::align_val_t alignment)
+{
+    return countedAllocationOrThrow(size, static_cast<std::size_t>(alignment));
+}
+__attribute__((noinline)) void *operator new(std::size_t size, const std::nothrow_t &) noexcept
+{
+    return countedAllocation(size, 0);
+}
+__attribute__((noinline)) void *operator new[](std::size_t size, const std::nothrow_t &) noexcept
+{
+    return countedAllocation(size, 0);
+}
+__attribute__((noinline)) void *operator new(std::size_t size, std::align_val_t alignment, const std::nothrow_t &) noexcept
+{
+    return countedAllocation(size, static_cast<std::size_t>(alignment));
+}
+__attribute__((noinline)) void *operator new[](std::size_t size, std::align_val_t alignment, const std::nothrow_t &) noexcept
+{
+    return countedAllocation(size, static_cast<std::size_t>(alignment));
+}
+
+__attribute__((noinline)) void operator delete(void *p) noexcept { std::free(p); }
+__attribute__((noinline)) void operator delete[](void *p) noexcept { std::free(p); }
+__attribute__((noinline)) void operator delete(void *p, std::size_t) noexcept { std::free(p); }
+__attribute__((noinline)) void operator delete[](void *p, std::size_t) noexcept { std::free(p); }
+__attribute__((noinline)) void operator delete(void *p, std::align_val_t) noexcept { std::free(p); }
+__attribute__((noinline)) void operator delete[](void *p, std::align_val_t) noexcept { std::free(p); }
+__attribute__((noinline)) void operator delete(void *p, std::size_t, std::align_val_t) noexcept { std::free(p); }
+__attribute__((noinline)) void operator delete[](void *p, std::size_t, std::align_val_t) noexcept { std::free(p); }
+__attribute__((noinline)) void operator delete(void *p, const std::nothrow_t &) noexcept { std::free(p); }
+__attribute__((noinline)) void operator delete[](void *p, const std::nothrow_t &) noexcept { std::free(p); }
+__attribute__((noinline)) void operator delete(void *p, std::align_val_t, const std::nothrow_t &) noexcept { std::free(p); }
+__attribute__((noinline)) void operator delete[](void *p, std::align_val_t, const std::nothrow_t &) noexcept { std::free(p); }
+#else
+const bool COUNTING_ALLOCATIONS = false;
+const std::size_t heapAllocations = 0;
+#endif
+
+//------------------------------------------------------------
+// Benchmark: heap allocations in the steady-state step loop. Runs the replay scenario and
+// counts allocations during and after a warm-up.
+// Run with: ./bouncing_ball --bench-allocs
+//------------------------------------------------------------
+int runAllocationBenchmark()
+{
+    if (!COUNTING_ALLOCATIONS) {
+        std::cerr << "Error: --bench-allocs needs a build with -DCOUNT_ALLOCATIONS\n";
+        return 1;
+    }
+    const int steps = 1200, warmup = 300;
+    Simulation<float> sim;
+    float msPerStep = 0.f;
+    int step = 0;
+    std::size_t warmupAllocations = 0, steadyAllocations = 0, stepsWithAllocations = 0, arenaAllocations = 0;
+    std::size_t before = heapAllocations;
+    runReplayScenario(sim, steps, msPerStep, [&](const Boundary<float> &) {
+        std::size_t now = heapAllocations;
+        if (step++ < warmup) {
+            warmupAllocations += now - before;
+        } else {
+            steadyAllocations += now - before;
+            stepsWithAllocations += now != before;
+        }
+        before = heapAllocations;
+    });
+    // Count the arena traffic of one more step (reset() clears the per-step counters)
+    Boundary<float> boundary;
+    boundary.setRegular(6, 250.f, 0.f, sf::Vector2f(400.f, 320.f), 0.f);
+    std::size_t overflowBefore = sim.arena.overflowBlocks;
+    sim.arena.reset();
+    sim.solver.collect(boundary, sim.balls, sim.ballRadius, sim.awakeList, sim.arena);
+    arenaAllocations = sim.arena.stepAllocations;
+    sim.arena.reset();
+
+    std::cout << "balls: " << sim.balls.size() << ", steps: " << steps << " (" << warmup << " warm-up), "
+              << std::fixed << std::setprecision(3) << msPerStep << " ms/step\n"
+              << "heap allocations during warm-up:  " << warmupAllocations << "\n"
+              << "heap allocations after warm-up:   " << steadyAllocations << " (in " << stepsWithAllocations << " steps)\n"
+              << "arena: " << sim.arena.peakBytes << " bytes peak per step, " << arenaAllocations
+              << " allocations per step, " << overflowBefore << " overflow blocks in total\n";
+    return 0;
+}
+
+//------------------------------------------------------------
+// Benchmark: ball pool churn. Keeps a steady population while despawning and spawning
+// balls every step, and counts heap allocations once the pool has warmed up.
+// Run with: ./bouncing_ball --bench-pool
+//------------------------------------------------------------
+int runPoolBenchmark()
+{
+    const int steps = 2000, warmup = 200, population = 200, churn = 8;
+    const float dt = 1.f / 60.f;
+    const sf::Vector2f center(400.f, 320.f);
+    std::mt19937 rng(1234);
+    std::uniform_real_distribution<float> unit(0.f, 1.f);
+    Simulation<float> sim;
+    // A random point inside the polygon, away from existing balls when one can be found
+    auto randomInside = [&] {
+        sf::Vector2f p;
+        for (int attempt = 0; attempt < 32; attempt++) {
+            float a = unit(rng) * 2.f * PI, r = 180.f * std::sqrt(unit(rng));
+            p = center + r * sf::Vector2f(std::cos(a), std::sin(a));
+            bool clear = true;
+            for (std::size_t i = 0; i < sim.balls.size() && clear; i++)
+                clear = length(sim.balls.position[i] - p) >= 2.f * sim.ballRadius;
+            if (clear)
+                break;
+        }
+        return p;
+    };
+
+    Boundary<float> boundary;
+    std::vector<BallHandle> live;
+    live.reserve(population);
+    for (int n = 0; n < population; n++)
+        live.push_back(sim.spawn(randomInside(), 200.f * sf::Vector2f(unit(rng) - 0.5f, unit(rng) - 0.5f)));
+
+    std::size_t steadyAllocations = 0;
+    sf::Clock clock;
+    for (int step = 0; step < steps; step++) {
+        std::size_t before = heapAllocations;
+
+        // Despawn a few random balls
+        for (int k = 0; k < churn; k++) {
+            std::size_t pick = static_cast<std::size_t>(unit(rng) * live.size()) % live.size();
+            sim.despawn(live[pick]);
+            live[pick] = live.back();
+            live.pop_back();
+        }
+        sim.compact();
+
+        while (static_cast<int>(live.size()) < population)
+            live.push_back(sim.spawn(randomInside(), 200.f * sf::Vector2f(unit(rng) - 0.5f, unit(rng) - 0.5f)));
+        boundary.setRegular(6, 250.f, ROTATION_SPEED * PI / 180.f * dt * step, center, ROTATION_SPEED * PI / 180.f);
+        sim.step(boundary, dt);
+
+        if (step >= warmup)
+            steadyAllocations += heapAllocations - before;
+    }
+    float seconds = clock.getElapsedTime().asSeconds();
+
+    std::cout << "population " << population << ", " << churn << " despawns + spawns per step, " << steps << " steps\n"
+              << std::fixed << std::setprecision(3) << seconds * 1000.f / steps << " ms/step, "
+              << std::setprecision(0) << steps * churn / seconds << " spawns/s\n";
+    if (COUNTING_ALLOCATIONS)
+        std::cout << "heap allocations after warm-up: " << steadyAllocations << "\n";
+    else
+        std::cout << "heap allocations not counted (build with -DCOUNT_ALLOCATIONS)\n";
+    return 0;
+}
+
+//------------------------------------------------------------
+// Load test: emitters feed a large hexagon until the population levels off at
+// rate * lifetime, then spawn throughput and step cost are measured at that steady state.
+// The hexagon is sized so the population covers about a fifth of its area.
+// Run with: ./bouncing_ball --bench-emit [population]   (e.g. 1000000)
+//------------------------------------------------------------
+int runEmitterBenchmark(int population)
+{
+    const float dt = 1.f / 60.f, lifetime = 4.f, measureSeconds = 2.f;
+    Simulation<float> sim;
+    const float ballArea = PI * sim.ballRadius * sim.ballRadius;
+    const float worldRadius = std::sqrt(population * ballArea / 0.2f / 2.598f);
+    const sf::Vector2f center(0.f, 0.f);
+
+    // A grid of sources with every shape, sharing the total rate
+    std::vector<Emitter<float>> emitters;
+    int side = std::max(1, static_cast<int>(std::sqrt(population / 2000.f)));
+    float spacing = 1.4f * worldRadius / side;
+    for (int gy = 0; gy < side; gy++) {
+        for (int gx = 0; gx < side; gx++) {
+            Emitter<float> emitter;
+            emitter.shape = static_cast<Emitter<float>::Shape>((gx + gy) % 3);
+            emitter.origin = center + sf::Vector2f((gx - (side - 1) / 2.f) * spacing, (gy - (side - 1) / 2.f) * spacing);
+            emitter.end = emitter.origin + sf::Vector2f(0.4f * spacing, 0.f);
+            emitter.radius = 0.2f * spacing;
+            emitter.direction = (gx * 7 + gy * 3) * 0.7f;
+            emitter.spread = PI;
+            emitter.rate = population / lifetime / (side * side);
+            emitter.speedMin = 150.f;
+            emitter.speedMax = 350.f;
+            emitter.lifetime = lifetime;
+            emitter.seed = 0x9e3779b9u * static_cast<std::uint32_t>(gy * side + gx + 1);
+            emitters.push_back(emitter);
+        }
+    }
+
+    Boundary<float> boundary;
+    boundary.setRegular(6, worldRadius, 0.f, center, 0.f);
+    auto run = [&](float seconds) {
+        for (int step = 0; step < static_cast<int>(seconds / dt); step++) {
+            for (Emitter<float> &emitter : emitters)
+                emitter.update(sim, dt);
+            sim.step(boundary, dt);
+        }
+    };
+
+    sf::Clock clock;
+    run(lifetime + 0.5f); // ramp up to the steady population
+    float rampSeconds = clock.restart().asSeconds();
+    std::size_t spawnedBefore = 0;
+    for (const Emitter<float> &emitter : emitters)
+        spawnedBefore += emitter.spawned;
+    std::size_t allocationsBefore = heapAllocations;
+    run(measureSeconds);
+    float seconds = clock.getElapsedTime().asSeconds();
+    std::size_t spawned = 0, expired = 0;
+    for (const Emitter<float> &emitter : emitters) {
+        spawned += emitter.spawned;
+        expired += emitter.expired;
+    }
+    spawned -= spawnedBefore;
+    int steps = static_cast<int>(measureSeconds / dt);
+
+    std::cout << emitters.size() << " emitters, world radius " << static_cast<int>(worldRadius)
+              << ", ramp-up took " << std::fixed << std::setprecision(1) << rampSeconds << " s\n"
+              << "steady population " << sim.balls.size() << " (target " << population << "), "
+              << expired << " expired so far\n"
+              << std::setprecision(3) << seconds * 1000.f / steps << " ms/step, "
+              << std::setprecision(0) << spawned / seconds << " spawned balls/s wall clock ("
+              << spawned / measureSeconds << " per simulated second)\n";
+    if (COUNTING_ALLOCATIONS)
+        std::cout << "heap allocations at steady state: " << heapAllocations - allocationsBefore << "\n";
+    return 0;
+}
+
+//------------------------------------------------------------
+// Escape culling under a stream of balls launched fast enough to tunnel: the same run with
+// no culling, with escaped balls culled, and with an age limit as well. Without culling the
+// balls that leak out keep being integrated (and would keep being drawn) for the rest of the run.
+// 'outside' counts balls wholly outside at the end, including any still being pulled back in.
+// Run with: ./bouncing_ball --bench-escape
+//------------------------------------------------------------
+int runEscapeBenchmark()
+{
+    const float dt = 1.f / 30.f, seconds = 30.f, radius = 600.f;
+    const sf::Vector2f center(0.f, 0.f);
+    const char *names[3] = {"none", "escaped", "escaped+age"};
+
+    std::cout << "culling        balls  outside  culled (escaped)  culled (expired)  ms/step\n" << std::fixed;
+    for (int mode = 0; mode < 3; mode++) {
+        Simulation<float> sim;
+        sim.cullEscaped = mode > 0;
+        sim.maxAge = mode > 1 ? 10.f : 0.f;
+        sim.solver.iterations = 2;
+
+        Emitter<float> emitter;
+        emitter.origin = center;
+        emitter.spread = PI;
+        emitter.rate = 100.f;
+        emitter.speedMin = 1000.f;
+        emitter.speedMax = 2000.f;
+
+        Boundary<float> boundary;
+        const float angularSpeed = 3.f;
+        int steps = static_cast<int>(seconds / dt);
+        sf::Clock clock;
+        for (int step = 0; step < steps; step++) {
+            emitter.update(sim, dt);
+            boundary.setRegular(6, radius, angularSpeed * dt * step, center, angularSpeed);
+            sim.step(boundary, dt);
+        }
+        float ms = clock.getElapsedTime().asSeconds() * 1000.f / steps;
+
+        std::size_t outside = 0;
+        for (std::size_t i = 0; i < sim.balls.size(); i++)
+            outside += !boundary.contains(sim.balls.position[i], sim.ballRadius);
+        std::cout << std::left << std::setw(12) << names[mode] << std::right
+                  << std::setw(8) << sim.balls.size() << std::setw(9) << outside
+                  << std::setw(18) << sim.culled.escaped << std::setw(18) << sim.culled.expired
+                  << std::setprecision(3) << std::setw(9) << ms << "\n";
+    }
+    return 0;
+}
+
+//------------------------------------------------------------
+// Statistics of single-ball trajectories: how often the ball visits each cell of a grid in
+// the polygon's own (rotating) frame, and the angle between the outgoing velocity and the
+// edge normal on every bounce. One per worker thread while running; the totals are merged
+// into a shared copy held in atomics.
+//------------------------------------------------------------
+struct BounceStatistics {
+    static const int GRID = 64;        // cells per side, spanning the polygon's circumcircle
+    static const int ANGLE_BINS = 90;  // one degree each
+
+    std::vector<std::uint64_t> occupancy = std::vector<std::uint64_t>(GRID * GRID, 0);
+    std::vector<std::uint64_t> angles = std::vector<std::uint64_t>(ANGLE_BINS, 0);
+    std::uint64_t escaped = 0;
+};
+
+struct SharedBounceStatistics {
+    std::vector<std::atomic<std::uint64_t>> occupancy =
+        std::vector<std::atomic<std::uint64_t>>(BounceStatistics::GRID * BounceStatistics::GRID);
+    std::vector<std::atomic<std::uint64_t>> angles =
+        std::vector<std::atomic<std::uint64_t>>(BounceStatistics::ANGLE_BINS);
+    std::atomic<std::uint64_t> escaped{0};
+
+    // Called once by each worker when it runs out of batches; only non-empty bins are
+    // touched, so workers finishing together rarely contend on a cache line
+    void merge(const BounceStatistics &local)
+    {
+        for (std::size_t k = 0; k < occupancy.size(); k++)
+            if (local.occupancy[k])
+                occupancy[k].fetch_add(local.occupancy[k], std::memory_order_relaxed);
+        for (std::size_t k = 0; k < angles.size(); k++)
+            if (local.angles[k])
+                angles[k].fetch_add(local.angles[k], std::memory_order_relaxed);
+        escaped.fetch_add(local.escaped, std::memory_order_relaxed);
+    }
+};
+
+//------------------------------------------------------------
+// Monte Carlo run for one shape: 'balls' launches from the center at the right-click speed in
+// uniformly random directions, each followed for 'seconds' inside the rotating polygon of the
+// GUI. Balls are simulated in batches of independent (non-colliding) trials; batches are handed
+// out through an atomic counter and each is seeded by its own index, so the merged statistics
+// do not depend on the thread count.
+//------------------------------------------------------------
+void analyzeBounces(const PolygonGeometry &geometry, int balls, float seconds, unsigned threads,
+                    SharedBounceStatistics &shared)
+{
+    const int batchSize = 1024;
+    const float dt = 1.f / 60.f;
+    const float angularSpeed = ROTATION_SPEED * PI / 180.f;
+    const float cellSize = 2.f * geometry.radius / BounceStatistics::GRID;
+    const sf::Vector2f center(0.f, 0.f);
+    int batches = (balls + batchSize - 1) / batchSize;
+
+    std::atomic<int> nextBatch(0);
+    auto work = [&] {
+        BounceStatistics local;
+        Boundary<float> boundary;
+        for (int batch = nextBatch++; batch < batches; batch = nextBatch++) {
+            int count = std::min(batchSize, balls - batch * batchSize);
+            Simulation<float> sim;
+            sim.allowSleep = false;
+            sim.solver.ballCollisions = false;
+            Emitter<float> emitter;
+            emitter.origin = center;
+            emitter.spread = PI;
+            emitter.speedMin = emitter.speedMax = 300.f; // the right-click launch speed
+            emitter.seed = 0x9e3779b9u * static_cast<std::uint32_t>(batch + 1);
+            for (int n = 0; n < count; n++)
+                emitter.spawnOne(sim);
+
+            for (int step = 0; step < static_cast<int>(seconds / dt); step++) {
+                float angle = angularSpeed * dt * step;
+                boundary.setFromGeometry(geometry, angle, center, angularSpeed);
+                sim.step(boundary, dt);
+
+                // Outgoing angle of every bounce solved this step. A contact that persists
+                // from the previous step (a ball rolling or sliding along an edge) is the same
+                // bounce; both lists are in key order, so one merge pass finds those.
+                const WallContacts<float> &wall = sim.solver.wall, &previous = sim.solver.previousWall;
+                std::size_t p = 0;
+                for (std::size_t c = 0; c < wall.size(); c++) {
+                    while (p < previous.size() && previous.key(p) < wall.key(c))
+                        p++;
+                    bool persisting = p < previous.size() && previous.key(p) == wall.key(c);
+                    if (persisting || wall.normalImpulse[c] <= 0.f)
+                        continue;
+                    sf::Vector2f n = wall.normal[c];
+                    sf::Vector2f v = sim.balls.velocity[wall.ball[c]] - wall.wallVelocity[c];
+                    float degrees = std::atan2(std::abs(dot(v, sf::Vector2f(-n.y, n.x))), dot(v, n)) * 180.f / PI;
+                    local.angles[std::min(static_cast<int>(degrees), BounceStatistics::ANGLE_BINS - 1)]++;
+                }
+
+                // Positions in the polygon's frame: rotate back by the current angle
+                float c = std::cos(angle), s = std::sin(angle);
+                for (const sf::Vector2f &p : sim.balls.position) {
+                    int x = static_cast<int>((c * p.x + s * p.y + geometry.radius) / cellSize);
+                    int y = static_cast<int>((-s * p.x + c * p.y + geometry.radius) / cellSize);
+                    if (x >= 0 && x < BounceStatistics::GRID && y >= 0 && y < BounceStatistics::GRID)
+                        local.occupancy[y * BounceStatistics::GRID + x]++;
+                }
+            }
+            local.escaped += sim.culled.escaped;
+        }
+        shared.merge(local);
+    };
+    std::vector<std::thread> pool;
+    for (unsigned t = 1; t < threads; t++)
+        pool.emplace_back(work);
+    work();
+    for (std::thread &thread : pool)
+        thread.join();
+}
+
+//------------------------------------------------------------
+// Ergodicity report: for every tab's shape, how much of the polygon the launched balls cover
+// and how evenly (normalized entropy of the occupancy over the cells inside the polygon, 1 =
+// uniform), plus the bounce-angle distribution in 10 degree bins. Ends with the throughput
+// of the hexagon run at 1, 2, 4, ... threads.
+// Run with: ./bouncing_ball --analyze-bounces [balls per shape] [threads]
+//------------------------------------------------------------
+int runBounceAnalysis(int balls, unsigned threads)
+{
+    if (balls <= 0 || threads == 0) {
+        std::cerr << "Error: --analyze-bounces needs at least one ball and one thread\n";
+        return 1;
+    }
+    const float seconds = 10.f, polygonRadius = 250.f;
+    const int grid = BounceStatistics::GRID;
+    GeometryCache geometry;
+
+    std::cout << balls << " balls per shape, " << seconds << " s each, " << threads << " threads\n"
+              << "sides  coverage  uniformity  escaped  mean angle  bounces per 10 degrees (%)\n" << std::fixed;
+    for (int sides = 3; sides <= 10; sides++) {
+        const PolygonGeometry &shape = geometry.get(sides, polygonRadius);
+        SharedBounceStatistics stats;
+        analyzeBounces(shape, balls, seconds, threads, stats);
+
+        Boundary<float> local;
+        local.setFromGeometry(shape, 0.f, sf::Vector2f(0.f, 0.f), 0.f);
+        float cellSize = 2.f * polygonRadius / grid;
+        std::uint64_t total = 0;
+        int inside = 0, visited = 0;
+        for (int y = 0; y < grid; y++) {
+            for (int x = 0; x < grid; x++) {
+                sf::Vector2f cell((x + 0.5f) * cellSize - polygonRadius, (y + 0.5f) * cellSize - polygonRadius);
+                if (!local.contains(cell, -cellSize)) // wholly inside, so edge cells do not dilute the score
+                    continue;
+                std::uint64_t n = stats.occupancy[y * grid + x];
+                inside++;
+                visited += n > 0;
+                total += n;
+            }
+        }
+        double entropy = 0.0;
+        for (int y = 0; y < grid; y++) {
+            for (int x = 0; x < grid; x++) {
+                sf::Vector2f cell((x + 0.5f) * cellSize - polygonRadius, (y + 0.5f) * cellSize - polygonRadius);
+                std::uint64_t n = stats.occupancy[y * grid + x];
+                if (n == 0 || !local.contains(cell, -cellSize))
+                    continue;
+                double q = static_cast<double>(n) / total;
+                entropy -= q * std::log(q);
+            }
+        }
+
+        std::uint64_t bounces = 0;
+        double angleSum = 0.0;
+        for (int k = 0; k < BounceStatistics::ANGLE_BINS; k++) {
+            bounces += stats.angles[k];
+            angleSum += (k + 0.5) * stats.angles[k];
+        }
+        std::cout << std::setw(5) << sides << std::setprecision(1) << std::setw(9) << 100.0 * visited / inside << "%"
+                  << std::setprecision(3) << std::setw(12) << entropy / std::log(static_cast<double>(inside))
+                  << std::setw(9) << stats.escaped
+                  << std::setprecision(1) << std::setw(12) << angleSum / std::max<std::uint64_t>(bounces, 1) << "  ";
+        for (int k = 0; k < BounceStatistics::ANGLE_BINS; k += 10) {
+            std::uint64_t n = 0;
+            for (int j = k; j < k + 10; j++)
+                n += stats.angles[j];
+            std::cout << std::setw(5) << 100.0 * n / std::max<std::uint64_t>(bounces, 1);
+        }
+        std::cout << "\n";
+    }
+
+    // Scaling: the same hexagon run at increasing thread counts
+    std::cout << "threads  balls/s  speedup\n";
+    float referenceRate = 0.f;
+    std::vector<unsigned> threadCounts;
+    for (unsigned t = 1; t < threads; t *= 2)
+        threadCounts.push_back(t);
+    threadCounts.push_back(threads); // always finish with the full thread count
+    for (unsigned t : threadCounts) {
+        SharedBounceStatistics stats;
+        sf::Clock clock;
+        analyzeBounces(geometry.get(6, polygonRadius), balls, seconds, t, stats);
+        float rate = balls / clock.getElapsedTime().asSeconds();
+        if (t == 1)
+            referenceRate = rate;
+        std::cout << std::setw(7) << t << std::setprecision(0) << std::setw(9) << rate
+                  << std::setprecision(2) << std::setw(9) << rate / referenceRate << "\n";
+    }
+    return 0;
+}
+
+//------------------------------------------------------------
+// Benchmark: cost of keeping the occupancy heatmap against the step it observes. A large
+// rotating hexagon holds 'population' balls (about a fifth of its area) moving in random
+// directions; every step is followed by a heatmap update, and with an output prefix the
+// grids are flushed to PGM once a simulated second.
+// Run with: ./bouncing_ball --bench-heatmap [population] [output prefix]
+//------------------------------------------------------------
+int runHeatmapBenchmark(int population, const std::string &prefix)
+{
+    const int steps = 240, flushEvery = 60;
+    const float dt = 1.f / 60.f, angularSpeed = ROTATION_SPEED * PI / 180.f;
+    std::mt19937 rng(1234);
+    std::uniform_real_distribution<float> unit(0.f, 1.f);
+    Simulation<float> sim;
+    const float ballArea = PI * sim.ballRadius * sim.ballRadius;
+    const float worldRadius = std::sqrt(population * ballArea / 0.2f / 2.598f);
+    const sf::Vector2f center(0.f, 0.f);
+
+    // A square lattice filling a disc well inside the hexagon
+    float spacing = std::sqrt(PI * 0.64f * worldRadius * worldRadius / population);
+    int side = static_cast<int>(0.8f * worldRadius / spacing) + 1;
+    for (int row = -side; row <= side && static_cast<int>(sim.balls.size()) < population; row++) {
+        for (int col = -side; col <= side && static_cast<int>(sim.balls.size()) < population; col++) {
+            sf::Vector2f offset(col * spacing, row * spacing);
+            if (length(offset) < 0.8f * worldRadius)
+                sim.balls.add(center + offset, 300.f * sf::Vector2f(unit(rng) - 0.5f, unit(rng) - 0.5f));
+        }
+    }
+
+    OccupancyHeatmap heatmap(sf::FloatRect(-worldRadius, -worldRadius, 2.f * worldRadius, 2.f * worldRadius),
+                             2.f * worldRadius / 256.f, worldRadius, 256);
+    Boundary<float> boundary;
+    sf::Time stepTime, heatmapTime, flushTime;
+    for (int step = 0; step < steps; step++) {
+        float angle = angularSpeed * dt * step;
+        boundary.setRegular(6, worldRadius, angle, center, angularSpeed);
+        sf::Clock clock;
+        sim.step(boundary, dt);
+        stepTime += clock.restart();
+        heatmap.add(sim.balls.position, center, angle);
+        heatmapTime += clock.restart();
+        if (!prefix.empty() && (step + 1) % flushEvery == 0) {
+            heatmap.flush(prefix);
+            flushTime += clock.restart();
+        }
+    }
+
+    float stepMs = stepTime.asSeconds() * 1000.f / steps, heatmapMs = heatmapTime.asSeconds() * 1000.f / steps;
+    std::cout << "balls: " << sim.balls.size() << ", grids: " << heatmap.worldWidth << "x" << heatmap.worldHeight
+              << " world, " << heatmap.localSize << "x" << heatmap.localSize << " local\n"
+              << std::fixed << std::setprecision(3)
+              << "step:    " << stepMs << " ms\n"
+              << "heatmap: " << heatmapMs << " ms (" << std::setprecision(2) << 100.f * heatmapMs / stepMs << "% of the step)\n";
+    if (!prefix.empty())
+        std::cout << "flush:   " << std::setprecision(3) << flushTime.asSeconds() * 1000.f / (steps / flushEvery)
+                  << " ms every " << flushEvery << " steps, to " << prefix << "_world.pgm and " << prefix << "_local.pgm\n";
+    return 0;
+}
+
+//------------------------------------------------------------
+// Precision report for one build of the core: throughput, how far any ball ever got past an
+// edge, how many ended outside the polygon, and the RMS distance from a reference run.
+//------------------------------------------------------------
+struct PrecisionReport {
+    float msPerStep = 0.f;
+    double deepestOverlap = 0.0; // pixels past the wall line, worst over the whole run
+    int escaped = 0;
+    std::vector<sf::Vector2<double>> positions;
+};
+
+template <typename T, typename P>
+PrecisionReport runPrecisionScenario(int steps)
+{
+    PrecisionReport report;
+    Simulation<T, P> sim;
+    sim.cullEscaped = false; // escapes are part of what is being measured
+    auto track = [&](const Boundary<P> &boundary) {
+        std::size_t count = boundary.points.size();
+        for (std::size_t i = 0; i < sim.balls.size(); i++) {
+            for (std::size_t e = 0; e < count; e++) {
+                sf::Vector2<double> a(boundary.points[e]), b(boundary.points[(e + 1) % count]);
+                sf::Vector2<double> normal = normalize(sf::Vector2<double>(a.y - b.y, b.x - a.x));
+                double dist = dot(sf::Vector2<double>(sim.balls.position[i]) - a, normal);
+                report.deepestOverlap = std::max(report.deepestOverlap, static_cast<double>(sim.ballRadius) - dist);
+            }
+        }
+    };
+    runReplayScenario(sim, steps, report.msPerStep, track);
+
+    Boundary<P> boundary;
+    P angle = P(ROTATION_SPEED * PI / 180.f) * P(T(1) / T(60)) * P(steps);
+    boundary.setRegular(6, P(250), angle, sf::Vector2<P>(P(400), P(320)), P(0));
+    for (std::size_t i = 0; i < sim.balls.size(); i++) {
+        report.positions.push_back(sf::Vector2<double>(sim.balls.position[i]));
+        report.escaped += !boundary.contains(sim.balls.position[i], P(0));
+    }
+    return report;
+}
+
+//------------------------------------------------------------
+// Benchmark: float, double and mixed (double positions, float contact math) builds of the
+// core on the replay scenario. Accuracy is the RMS distance from the double run after 0.5 s
+// (before the chaotic pile amplifies rounding into unrelated trajectories) plus containment
+// over a long run. Run with: ./bouncing_ball --bench-precision
+//------------------------------------------------------------
+int runPrecisionBenchmark()
+{
+    const int shortSteps = 30;   // half a simulated second
+    const int longSteps = 18000; // five simulated minutes
+
+    PrecisionReport reference = runPrecisionScenario<double, double>(shortSteps);
+    PrecisionReport shortRuns[3] = {runPrecisionScenario<float, float>(shortSteps),
+                                    reference,
+                                    runPrecisionScenario<float, double>(shortSteps)};
+    PrecisionReport longRuns[3] = {runPrecisionScenario<float, float>(longSteps),
+                                   runPrecisionScenario<double, double>(longSteps),
+                                   runPrecisionScenario<float, double>(longSteps)};
+    const char *names[3] = {"float", "double", "mixed"};
+
+    std::size_t ballCount = reference.positions.size();
+    std::cout << "balls: " << ballCount << ", long run: " << longSteps << " steps\n"
+              << "mode    ms/step  Mball-steps/s  rms error @0.5s (px)  deepest overlap (px)  escaped\n"
+              << std::fixed;
+    for (int m = 0; m < 3; m++) {
+        double sum = 0.0;
+        for (std::size_t i = 0; i < ballCount; i++) {
+            sf::Vector2<double> d = shortRuns[m].positions[i] - reference.positions[i];
+            sum += dot(d, d);
+        }
+        const PrecisionReport &r = longRuns[m];
+        std::cout << std::left << std::setw(6) << names[m] << std::right
+                  << std::setprecision(3) << std::setw(9) << r.msPerStep
+                  << std::setw(15) << ballCount / (r.msPerStep * 1000.f)
+                  << std::scientific << std::setprecision(2) << std::setw(22) << std::sqrt(sum / ballCount)
+                  << std::fixed << std::setprecision(3) << std::setw(22) << r.deepestOverlap
+                  << std::setw(9) << r.escaped << "\n";
+    }
+    return 0;
+}
+
+//------------------------------------------------------------
+// Headless mode: render the simulation into an offscreen sf::RenderTexture (or with the
+// software rasterizer when 'software' is set) and write every frame to 'outputDir' without
+// opening a window. Balls start on a lattice around the center and are launched outward in
+// fanned-out directions.
+// Run with: ./bouncing_ball --render-frames <dir> [frames] [png|ppm|raw] [--software]
+//------------------------------------------------------------
+const unsigned HEADLESS_WIDTH = 800, HEADLESS_HEIGHT = 600;
+
+void setupHeadlessScene(Simulation<float> &sim, sf::ConvexShape &polygon, sf::CircleShape &ball)
+{
+    const float ballRadius = 10.f;
+    const sf::Vector2f center(400.f, 320.f);
+
+    polygon = createPolygon(6, 250.f);
+    polygon.setPosition(center);
+    ball.setRadius(ballRadius);
+    ball.setFillColor(sf::Color::Red);
+
+    sim.ballRadius = ballRadius;
+    for (int n = 0; n < 37; n++) {
+        int ring = n == 0 ? 0 : (n <= 6 ? 1 : (n <= 18 ? 2 : 3));
+        float angle = n * 2.39996323f; // golden angle
+        sf::Vector2f dir(std::cos(angle), std::sin(angle));
+        sim.balls.add(center + dir * (ring * 2.5f * ballRadius), dir * 300.f);
+    }
+}
+
+int runHeadless(const std::string &outputDir, int frames, FrameWriter::Format format, bool software)
+{
+    const unsigned width = HEADLESS_WIDTH, height = HEADLESS_HEIGHT;
+    const float dt = 1.f / 60.f;
+
+    sf::RenderTexture target;
+    if (!software) {
+        sf::ContextSettings settings;
+        settings.antialiasingLevel = 8;
+        if (!target.create(width, height, settings)) {
+            std::cerr << "Error: Could not create an offscreen render target.\n";
+            return 1;
+        }
+    }
+
+    sf::ConvexShape polygon;
+    sf::CircleShape ball;
+    Simulation<float> sim;
+    setupHeadlessScene(sim, polygon, ball);
+    Boundary<float> boundary;
+
+    // hardware_concurrency() may report 0
+    unsigned cores = std::max(1u, std::thread::hardware_concurrency());
+    unsigned threads = std::max(1u, cores - 1);
+    FrameWriter writer(width, height, 2 * threads + 2, threads, outputDir, format);
+    SoftwareRasterizer canvas(width, height, cores);
+
+    sf::Clock clock;
+    for (int frame = 0; frame < frames; frame++) {
+        polygon.rotate(ROTATION_SPEED * dt);
+        boundary.setFromShape(polygon, ROTATION_SPEED * PI / 180.f);
+        sim.step(boundary, dt);
+
+        int slot;
+        if (software) {
+            canvas.clear(sf::Color::Black);
+            drawPolygon(canvas, polygon);
+            drawBalls(canvas, ball, sim.balls, sim.ballRadius);
+            slot = writer.acquire();
+            canvas.render(writer.pixels(slot));
+        } else {
+            target.clear(sf::Color::Black);
+            target.draw(polygon);
+            drawBalls(target, ball, sim.balls, sim.ballRadius);
+            target.display();
+
+            // display() resolves the multisampled frame into the texture; read that back,
+            // since the multisample buffer itself cannot be read with glReadPixels
+            sf::Image image = target.getTexture().copyToImage();
+            slot = writer.acquire();
+            std::memcpy(writer.pixels(slot), image.getPixelsPtr(), static_cast<std::size_t>(width) * height * 4);
+        }
+        writer.submit(slot, frame);
+    }
+    float renderSeconds = clock.getElapsedTime().asSeconds();
+
+    std::cout << "rendered " << frames << " frames in " << renderSeconds << " s ("
+              << frames / renderSeconds << " fps), render loop waited on the encoders "
+              << writer.stalls << " times\n";
+    return 0;
+}
+
+//------------------------------------------------------------
+// Golden-image check: render the same headless frames (plus a dotted aim line) with SFML
+// and with the software rasterizer and compare them pixel by pixel. Both images of the
+// worst frame are written to the working directory for inspection. Fails when the mean
+// per-channel difference goes above 'tolerance'; edges differ slightly because SFML
+// approximates circles with 30-gons and the GPU picks its own sample pattern.
+// Run with: ./bouncing_ball --compare-render [frames] [tolerance]
+//------------------------------------------------------------
+int runRenderComparison(int frames, double tolerance)
+{
+    const unsigned width = HEADLESS_WIDTH, height = HEADLESS_HEIGHT;
+    const float dt = 1.f / 60.f;
+
+    sf::ContextSettings settings;
+    settings.antialiasingLevel = 8;
+    sf::RenderTexture target;
+    if (!target.create(width, height, settings)) {
+        std::cerr << "Error: Could not create an offscreen render target.\n";
+        return 1;
+    }
+
+    sf::ConvexShape polygon;
+    sf::CircleShape ball;
+    Simulation<float> sim;
+    setupHeadlessScene(sim, polygon, ball);
+    Boundary<float> boundary;
+    SoftwareRasterizer canvas(width, height, std::max(1u, std::thread::hardware_concurrency()));
+
+    std::size_t bytes = static_cast<std::size_t>(width) * height * 4;
+    std::vector<sf::Uint8> gpu(bytes), cpu(bytes);
+    double worstMean = 0.0;
+    int worstFrame = 0, worstMax = 0;
+    for (int frame = 0; frame < frames; frame++) {
+        polygon.rotate(ROTATION_SPEED * dt);
+        boundary.setFromShape(polygon, ROTATION_SPEED * PI / 180.f);
+        sim.step(boundary, dt);
+        sf::Vector2f aimStart = sim.balls.position[0], aimEnd(700.f, 120.f);
+
+        target.clear(sf::Color::Black);
+        target.draw(polygon);
+        drawBalls(target, ball, sim.balls, sim.ballRadius);
+        drawDottedLine(target, aimStart, aimEnd);
+        target.display();
+        sf::Image image = target.getTexture().copyToImage(); // resolved samples, top row first
+        std::copy(image.getPixelsPtr(), image.getPixelsPtr() + bytes, gpu.begin());
+
+        canvas.clear(sf::Color::Black);
+        drawPolygon(canvas, polygon);
+        drawBalls(canvas, ball, sim.balls, sim.ballRadius);
+        drawDottedLine(canvas, aimStart, aimEnd);
+        canvas.render(cpu.data());
+
+        std::uint64_t total = 0;
+        int maxDiff = 0;
+        for (std::size_t k = 0; k < bytes; k++) {
+            if (k % 4 == 3)
+                continue;
+            int diff = std::abs(gpu[k] - cpu[k]);
+            total += diff;
+            maxDiff = std::max(maxDiff, diff);
+        }
+        double mean = static_cast<double>(total) / (width * height * 3);
+        if (frame == 0 || mean > worstMean) {
+            worstMean = mean;
+            worstMax = maxDiff;
+            worstFrame = frame;
+            sf::Image image;
+            image.create(width, height, gpu.data());
+            image.saveToFile("compare_sfml.png");
+            image.create(width, height, cpu.data());
+            image.saveToFile("compare_software.png");
+        }
+    }
+
+    bool pass = worstMean <= tolerance;
+    std::cout << std::fixed << std::setprecision(3)
+              << "worst frame " << worstFrame << ": mean channel difference " << worstMean
+              << " (tolerance " << tolerance << "), max " << worstMax << "\n"
+              << (pass ? "PASS" : "FAIL") << " (images in compare_sfml.png / compare_software.png)\n";
+    return pass ? 0 : 1;
+}
+
+//------------------------------------------------------------
+// Bulk state handed to control clients through POSIX shared memory instead of the socket:
+// a header followed by the ball arrays (x, y, vx, vy, each ballCount floats). 'sequence' is
+// odd while the server is rewriting the segment, so a reader that sees the same even value
+// before and after copying has a consistent snapshot.
+//------------------------------------------------------------
+const std::uint32_t STATE_MAGIC = 0x42424c31; // "BBL1"
+
+struct SharedStateHeader {
+    std::uint32_t magic;
+    std::uint32_t ballCount;
+    std::atomic<std::uint64_t> sequence;
+    std::uint64_t step;
+    float ballRadius;
+    float polygonRadius;
+    float polygonAngle; // radians
+    float centerX, centerY;
+    std::int32_t sides;
+};
+
+inline std::size_t sharedStateBytes(std::size_t ballCount)
+{
+    return sizeof(SharedStateHeader) + 4 * ballCount * sizeof(float);
+}
+
+// The server's end: creates the segment and replaces it with one twice the size as the
+// population grows. macOS sizes a shared memory object only once, so a bigger state always
+// goes into a new segment (<base>.<generation>); clients learn its name from 'state'.
+struct SharedState {
+    std::string baseName;
+    std::string name;
+    int generation = 0;
+    void *data = nullptr;
+    std::size_t bytes = 0;
+    std::uint64_t sequence = 0;
+
+    ~SharedState() { release(); }
+
+    bool create(const std::string &segmentName)
+    {
+        baseName = segmentName;
+        return reserve(1024);
+    }
+
+    bool reserve(std::size_t ballCount)
+    {
+        std::size_t needed = sharedStateBytes(ballCount);
+        if (needed <= bytes)
+            return true;
+        std::size_t grown = std::max(needed, 2 * bytes);
+        std::string grownName = baseName + "." + std::to_string(generation++);
+        int fd = shm_open(grownName.c_str(), O_CREAT | O_RDWR | O_TRUNC, 0600);
+        if (fd < 0)
+            return false;
+        void *mapped = MAP_FAILED;
+        if (ftruncate(fd, static_cast<off_t>(grown)) == 0)
+            mapped = mmap(nullptr, grown, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+        close(fd);
+        if (mapped == MAP_FAILED) {
+            shm_unlink(grownName.c_str());
+            return false;
+        }
+        // A client still reading the old segment keeps its mapping; the name goes at once
+        release();
+        name = grownName;
+        data = mapped;
+        bytes = grown;
+        return true;
+    }
+
+    void release()
+    {
+        if (!data)
+            return;
+        munmap(data, bytes);
+        shm_unlink(name.c_str());
+        data = nullptr;
+        bytes = 0;
+    }
+
+    bool publish(const Simulation<float> &sim, std::uint64_t step, int sides, float polygonRadius,
+                 float polygonAngle, const sf::Vector2f &center)
+    {
+        std::size_t count = sim.balls.size();
+        if (!reserve(count))
+            return false;
+        SharedStateHeader *header = static_cast<SharedStateHeader *>(data);
+        header->sequence.store(++sequence, std::memory_order_relaxed); // odd: write in progress
+        std::atomic_thread_fence(std::memory_order_release);
+        header->magic = STATE_MAGIC;
+        header->ballCount = static_cast<std::uint32_t>(count);
+        header->step = step;
+        header->ballRadius = sim.ballRadius;
+        header->polygonRadius = polygonRadius;
+        header->polygonAngle = polygonAngle;
+        header->centerX = center.x;
+        header->centerY = center.y;
+        header->sides = sides;
+        float *x = reinterpret_cast<float *>(header + 1), *y = x + count, *vx = y + count, *vy = vx + count;
+        for (std::size_t i = 0; i < count; i++) {
+            x[i] = sim.balls.position[i].x;
+            y[i] = sim.balls.position[i].y;
+            vx[i] = sim.balls.velocity[i].x;
+            vy[i] = sim.balls.velocity[i].y;
+        }
+        header->sequence.store(++sequence, std::memory_order_release);
+        return true;
+    }
+};
+
+// A client's copy of one published snapshot
+struct StateSnapshot {
+    std::uint64_t sequence = 0, step = 0;
+    int sides = 0;
+    float polygonAngle = 0.f;
+    std::vector<float> x, y, vx, vy;
+
+    // Map the segment named in a 'state' reply and copy it out, retrying if the server
+    // was rewriting it at the time
+    bool read(const std::string &name, std::size_t bytes)
+    {
+        int fd = shm_open(name.c_str(), O_RDONLY, 0);
+        if (fd < 0)
+            return false;
+        void *mapped = mmap(nullptr, bytes, PROT_READ, MAP_SHARED, fd, 0);
+        close(fd);
+        if (mapped == MAP_FAILED)
+            return false;
+        const SharedStateHeader *header = static_cast<const SharedStateHeader *>(mapped);
+        bool ok = false;
+        for (int attempt = 0; attempt < 100 && !ok; attempt++) {
+            std::uint64_t before = header->sequence.load(std::memory_order_acquire);
+            if (before & 1 || header->magic != STATE_MAGIC || sharedStateBytes(header->ballCount) > bytes)
+                continue;
+            std::size_t count = header->ballCount;
+            const float *px = reinterpret_cast<const float *>(header + 1);
+            x.assign(px, px + count);
+            y.assign(px + count, px + 2 * count);
+            vx.assign(px + 2 * count, px + 3 * count);
+            vy.assign(px + 3 * count, px + 4 * count);
+            step = header->step;
+            sides = header->sides;
+            polygonAngle = header->polygonAngle;
+            std::atomic_thread_fence(std::memory_order_acquire);
+            sequence = before;
+            ok = header->sequence.load(std::memory_order_relaxed) == before;
+        }
+        munmap(mapped, bytes);
+        return ok;
+    }
+};
+
+//------------------------------------------------------------
+// Whole-token number parsing for commands and command-line arguments: false on an empty,
+// malformed, partly numeric or out-of-range token, leaving 'value' unchanged
+//------------------------------------------------------------
+bool parseNumber(const char *text, long minimum, long maximum, long &value)
+{
+    char *end = nullptr;
+    errno = 0;
+    long parsed = std::strtol(text, &end, 10);
+    if (errno != 0 || end == text || *end != '\0' || parsed < minimum || parsed > maximum)
+        return false;
+    value = parsed;
+    return true;
+}
+
+bool parseReal(const char *text, double minimum, double maximum, double &value)
+{
+    char *end = nullptr;
+    errno = 0;
+    double parsed = std::strtod(text, &end);
+    if (errno != 0 || end == text || *end != '\0' || !(parsed >= minimum && parsed <= maximum))
+        return false;
+    value = parsed;
+    return true;
+}
+
+//------------------------------------------------------------
+// Control server: drives one simulation from commands sent over a Unix-domain stream socket.
+// Commands are text lines, and a client may send any number of them in one write; each gets
+// exactly one reply line, in order, starting with "ok" or "error". A malformed, out-of-range
+// or extra argument gets "error usage: ...".
+//
+//   load <sides> [radius]        new scene: empty polygon of 3..64 sides centered at (400, 320)
+//   launch <count> [speed] [seed] balls around the center, in random directions (default 300 px/s)
+//   step <n>                     advance n steps of 1/60 s
+//   start | pause                run in real time between commands, or only on 'step'
+//   stats                        ok steps=<n> balls=<n> awake=<n> escaped=<n> running=<0|1>
+//   state                        ok <segment> <bytes> <sequence> <balls>: map the segment
+//   quit                         stop the server
+//------------------------------------------------------------
+struct ControlServer {
+    const float dt = 1.f / 60.f;
+    const sf::Vector2f center = sf::Vector2f(400.f, 320.f);
+
+    std::unique_ptr<Simulation<float>> sim;
+    GeometryCache geometry;
+    const PolygonGeometry *shape = nullptr;
+    Boundary<float> boundary;
+    SharedState state;
+    std::uint64_t steps = 0;
+    bool running = false;
+    bool quit = false;
+    JobSystem *jobs = nullptr;           // handed to every loaded simulation
+    std::uint32_t seed = 0x9e3779b9u;    // for launches that give none
+    // When set, 'step' only validates and leaves its count in deferredSteps with an empty
+    // reply, so the socket loop can run it in slices between polls
+    bool deferSteps = false;
+    long deferredSteps = 0;
+
+    // Limits on one command, so no client can exhaust memory with a scene
+    static constexpr long MAX_SIDES = 64;
+    static constexpr double MIN_RADIUS = 50.0, MAX_RADIUS = 5000.0;
+    static constexpr long MAX_BALLS = 1000000; // population after a launch
+    static constexpr double MAX_SPEED = 5000.0;
+    static constexpr long MAX_STEP = 100000000;
+
+    ControlServer() { load(6, 250.f); }
+
+    void load(int sides, float radius)
+    {
+        sim.reset(new Simulation<float>());
+        sim->jobs = jobs;
+        geometry.entries.clear(); // only the current shape is kept
+        shape = &geometry.get(sides, radius);
+        steps = 0;
+    }
+
+    void advance(int n)
+    {
+        const float angularSpeed = ROTATION_SPEED * PI / 180.f;
+        for (int k = 0; k < n; k++) {
+            boundary.setFromGeometry(*shape, angularSpeed * dt * static_cast<float>(steps), center, angularSpeed);
+            sim->step(boundary, dt);
+            steps++;
+        }
+    }
+
+    std::string execute(const std::string &line)
+    {
+        std::istringstream in(line);
+        std::vector<std::string> words;
+        for (std::string word; in >> word;)
+            words.push_back(word);
+        const std::string command = words.empty() ? std::string() : words[0];
+        // Argument k, if given; false if it is malformed or out of range
+        auto number = [&](std::size_t k, long minimum, long maximum, long &value) {
+            return k >= words.size() || parseNumber(words[k].c_str(), minimum, maximum, value);
+        };
+        auto real = [&](std::size_t k, double minimum, double maximum, double &value) {
+            return k >= words.size() || parseReal(words[k].c_str(), minimum, maximum, value);
+        };
+        std::ostringstream reply;
+        if (command == "load") {
+            long sides = 0;
+            double radius = 250.0;
+            if (words.size() < 2 || words.size() > 3 || !number(1, 3, MAX_SIDES, sides)
+                || !real(2, MIN_RADIUS, MAX_RADIUS, radius))
+                return "error usage: load <sides 3-64> [radius 50-5000]";
+            load(static_cast<int>(sides), static_cast<float>(radius));
+            reply << "ok";
+        } else if (command == "launch") {
+            long count = 0, launchSeed = seed;
+            double speed = 300.0;
+            const long room = MAX_BALLS - static_cast<long>(sim->balls.size());
+            if (words.size() < 2 || words.size() > 4 || !number(1, 1, MAX_BALLS, count)
+                || !real(2, 0.0, MAX_SPEED, speed) || !number(3, 0, 0xffffffffL, launchSeed))
+                return "error usage: launch <count 1-1000000> [speed 0-5000] [seed 0-4294967295]";
+            if (count > room)
+                return "error launch would take the population past " + std::to_string(MAX_BALLS);
+            Emitter<float> emitter;
+            emitter.origin = center;
+            emitter.spread = PI;
+            emitter.speedMin = emitter.speedMax = static_cast<float>(speed);
+            emitter.seed = static_cast<std::uint32_t>(launchSeed);
+            // Start the balls on a sunflower spiral about the center rather than on one point,
+            // where the solver has no normal to push them apart along. Neighbours are at least
+            // 2.1 radii apart. A launch that more than fills the polygon's inscribed circle
+            // starts the spiral over, turned, and those balls do overlap.
+            const float ballRadius = sim->ballRadius, spacing = 2.1f * ballRadius / 1.54f;
+            float inner = shape->radius * std::cos(PI / shape->sides) - ballRadius;
+            std::size_t fits = std::max<std::size_t>(1, static_cast<std::size_t>(inner * inner / (spacing * spacing)));
+            for (long n = 0; n < count; n++) {
+                emitter.spawnOne(*sim);
+                std::size_t k = sim->balls.size() - 1, turn = k / fits;
+                float r = spacing * std::sqrt((k % fits) + 0.5f), a = (k % fits) * 2.39996323f + turn * 0.5f;
+                sim->balls.position[k] = center + r * sf::Vector2f(std::cos(a), std::sin(a));
+            }
+            reply << "ok " << sim->balls.size();
+        } else if (command == "step") {
+            long n = 0;
+            if (words.size() != 2 || !number(1, 1, MAX_STEP, n))
+                return "error usage: step <n>";
+            if (deferSteps) {
+                deferredSteps = n;
+                return std::string();
+            }
+            for (; n > 0; n -= 1000)
+                advance(static_cast<int>(std::min(n, 1000L)));
+            reply << "ok " << steps;
+        } else if (words.size() > 1 && (command == "start" || command == "pause" || command == "stats"
+                                        || command == "state" || command == "quit")) {
+            reply << "error usage: " << command << " takes no arguments";
+        } else if (command == "start" || command == "pause") {
+            running = command == "start";
+            reply << "ok";
+        } else if (command == "stats") {
+            reply << "ok steps=" << steps << " balls=" << sim->balls.size() << " awake=" << sim->awakeCount()
+                  << " escaped=" << sim->culled.escaped << " running=" << running;
+        } else if (command == "state") {
+            const float angle = ROTATION_SPEED * PI / 180.f * dt * static_cast<float>(steps);
+            if (!state.publish(*sim, steps, shape->sides, shape->radius, angle, center))
+                return "error could not write shared memory";
+            reply << "ok " << state.name << " " << state.bytes << " " << state.sequence << " " << sim->balls.size();
+        } else if (command == "quit") {
+            quit = true;
+            reply << "ok";
+        } else {
+            reply << "error unknown command '" << command << "'";
+        }
+        return reply.str();
+    }
+};
+
+int listenOn(const std::string &path)
+{
+    sockaddr_un address = {};
+    address.sun_family = AF_UNIX;
+    if (path.size() >= sizeof(address.sun_path)) {
+        std::cerr << "Error: Socket path too long: " << path << "\n";
+        return -1;
+    }
+    std::strcpy(address.sun_path, path.c_str());
+    unlink(path.c_str());
+    int fd = socket(AF_UNIX, SOCK_STREAM, 0);
+    if (fd < 0 || bind(fd, reinterpret_cast<sockaddr *>(&address), sizeof(address)) != 0 || listen(fd, 8) != 0) {
+        std::cerr << "Error: Could not listen on " << path << ": " << std::strerror(errno) << "\n";
+        if (fd >= 0)
+            close(fd);
+        return -1;
+    }
+    return fd;
+}
+
+int connectTo(const std::string &path)
+{
+    sockaddr_un address = {};
+    address.sun_family = AF_UNIX;
+    if (path.size() >= sizeof(address.sun_path))
+        return -1;
+    std::strcpy(address.sun_path, path.c_str());
+    int fd = socket(AF_UNIX, SOCK_STREAM, 0);
+    if (fd >= 0 && connect(fd, reinterpret_cast<sockaddr *>(&address), sizeof(address)) != 0) {
+        close(fd);
+        fd = -1;
+    }
+    return fd;
+}
+
+bool setNonBlocking(int fd)
+{
+    int flags = fcntl(fd, F_GETFL, 0);
+    return flags >= 0 && fcntl(fd, F_SETFL, flags | O_NONBLOCK) == 0;
+}
+
+// Write as much of a non-blocking socket's outbox as it will take and drop what was sent.
+// Returns false only if the connection failed.
+bool flushOutbox(int fd, std::string &outbox)
+{
+    std::size_t sent = 0;
+    while (sent < outbox.size()) {
+        ssize_t n = write(fd, outbox.data() + sent, outbox.size() - sent);
+        if (n < 0 && errno == EINTR)
+            continue;
+        if (n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK))
+            break;
+        if (n <= 0)
+            return false;
+        sent += static_cast<std::size_t>(n);
+    }
+    outbox.erase(0, sent);
+    return true;
+}
+
+// Serve clients until one sends 'quit'. While running, the simulation advances in real time
+// between commands; otherwise only 'step' moves it. Client sockets are non-blocking and replies
+// wait in an outbox until poll says the socket can take them, so a client that writes a long
+// batch before reading anything cannot stall the server. A client whose outbox backs up is
+// not read from until it drains. A 'step' runs a few milliseconds at a time between polls,
+// so other clients are still served; its client's later commands wait until it finishes.
+int serveControl(ControlServer &server, int listener)
+{
+    const std::size_t OUTBOX_LIMIT = 1 << 20;
+    const float STEP_SLICE_SECONDS = 0.005f;
+    struct Client {
+        int fd;
+        std::string pending; // bytes received after the last complete line
+        std::string outbox;  // replies not yet accepted by the socket
+        long stepsLeft;      // of a 'step' still running
+    };
+    std::vector<Client> clients;
+    std::vector<pollfd> fds;
+    sf::Clock clock;
+    float lag = 0.f;
+    char buffer[4096];
+    server.deferSteps = true;
+
+    // Execute the client's complete lines, stopping after one that starts a 'step'
+    auto runLines = [&](Client &client) {
+        std::size_t start = 0, end;
+        while (client.stepsLeft == 0 && (end = client.pending.find('\n', start)) != std::string::npos) {
+            std::string line = client.pending.substr(start, end - start);
+            start = end + 1;
+            if (!line.empty() && line.back() == '\r')
+                line.pop_back();
+            if (line.empty())
+                continue;
+            std::string reply = server.execute(line);
+            if (reply.empty())
+                client.stepsLeft = server.deferredSteps;
+            else
+                client.outbox += reply + "\n";
+        }
+        client.pending.erase(0, start);
+    };
+
+    while (!server.quit) {
+        bool stepping = false;
+        fds.assign(1, pollfd{listener, POLLIN, 0});
+        for (const Client &client : clients) {
+            short events = client.outbox.size() < OUTBOX_LIMIT && client.stepsLeft == 0 ? POLLIN : 0;
+            if (!client.outbox.empty())
+                events |= POLLOUT;
+            fds.push_back(pollfd{client.fd, events, 0});
+            stepping = stepping || client.stepsLeft > 0;
+        }
+        if (poll(fds.data(), fds.size(), stepping ? 0 : server.running ? 4 : -1) < 0 && errno != EINTR)
+            break;
+
+        if (server.running) {
+            lag += clock.restart().asSeconds();
+            int due = static_cast<int>(lag / server.dt);
+            if (due > 0) {
+                server.advance(std::min(due, 10)); // drop time rather than spiral when behind
+                lag -= due * server.dt;
+            }
+        } else {
+            clock.restart();
+            lag = 0.f;
+        }
+        for (Client &client : clients) {
+            if (client.stepsLeft == 0 || client.fd < 0)
+                continue;
+            sf::Clock slice;
+            do {
+                server.advance(1);
+                client.stepsLeft--;
+            } while (client.stepsLeft > 0 && slice.getElapsedTime().asSeconds() < STEP_SLICE_SECONDS);
+            if (client.stepsLeft == 0) {
+                client.outbox += "ok " + std::to_string(server.steps) + "\n";
+                runLines(client);
+                if (!flushOutbox(client.fd, client.outbox)) {
+                    close(client.fd);
+                    client.fd = -1;
+                }
+            }
+        }
+
+        if (fds[0].revents & POLLIN) {
+            int fd = accept(listener, nullptr, nullptr);
+            if (fd >= 0 && setNonBlocking(fd))
+                clients.push_back(Client{fd, std::string(), std::string(), 0});
+            else if (fd >= 0)
+                close(fd);
+        }
+        for (std::size_t k = 1; k < fds.size(); k++) {
+            Client &client = clients[k - 1];
+            if (client.fd < 0)
+                continue; // closed while stepping
+            if ((fds[k].revents & POLLOUT) && !flushOutbox(client.fd, client.outbox)) {
+                close(client.fd);
+                client.fd = -1;
+                continue;
+            }
+            if (!(fds[k].revents & (POLLIN | POLLHUP | POLLERR)))
+                continue;
+            ssize_t n = read(client.fd, buffer, sizeof(buffer));
+            if (n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR))
+                continue;
+            if (n <= 0) {
+                close(client.fd);
+                client.fd = -1;
+                continue;
+            }
+            client.pending.append(buffer, static_cast<std::size_t>(n));
+            runLines(client);
+            if (!flushOutbox(client.fd, client.outbox)) {
+                close(client.fd);
+                client.fd = -1;
+            }
+        }
+        clients.erase(std::remove_if(clients.begin(), clients.end(), [](const Client &c) { return c.fd < 0; }),
+                      clients.end());
+    }
+    for (const Client &client : clients)
+        close(client.fd);
+    return 0;
+}
+
+// Run with: ./bouncing_ball --serve [socket path]   (default /tmp/bouncing_ball.sock)
+int runControlServer(const std::string &path)
+{
+    std::signal(SIGPIPE, SIG_IGN); // a client hanging up mid-reply must not kill the server
+    ControlServer server;
+    if (!server.state.create("/bouncing_ball_" + std::to_string(getpid()))) {
+        std::cerr << "Error: Could not create shared memory: " << std::strerror(errno) << "\n";
+        return 1;
+    }
+    int listener = listenOn(path);
+    if (listener < 0)
+        return 1;
+    std::cout << "listening on " << path << "\n";
+    int result = serveControl(server, listener);
+    close(listener);
+    unlink(path.c_str());
+    return result;
+}
+
+//------------------------------------------------------------
+// Control client: sends a batch of commands in one write and prints each reply. Replies to
+// 'state' are followed by a summary of the snapshot read from shared memory.
+// Run with: ./bouncing_ball --client <socket path> [command ...]   (commands from stdin if none)
+//------------------------------------------------------------
+struct ControlClient {
+    int fd = -1;
+    std::string pending;
+
+    ~ControlClient()
+    {
+        if (fd >= 0)
+            close(fd);
+    }
+
+    bool connect(const std::string &path)
+    {
+        fd = connectTo(path);
+        if (fd >= 0 && !setNonBlocking(fd)) {
+            close(fd);
+            fd = -1;
+        }
+        return fd >= 0;
+    }
+
+    // Send every command and collect one reply line per command. Replies are read while the
+    // batch is still going out, so neither side can fill its socket buffer and wait on the other.
+    bool batch(const std::vector<std::string> &commands, std::vector<std::string> &replies)
+    {
+        std::string outbox;
+        for (const std::string &command : commands)
+            outbox += command + "\n";
+        replies.clear();
+        char buffer[4096];
+        while (replies.size() < commands.size()) {
+            std::size_t end = pending.find('\n');
+            if (end != std::string::npos) {
+                replies.push_back(pending.substr(0, end));
+                pending.erase(0, end + 1);
+                continue;
+            }
+            pollfd entry{fd, static_cast<short>(POLLIN | (outbox.empty() ? 0 : POLLOUT)), 0};
+            if (poll(&entry, 1, -1) < 0) {
+                if (errno == EINTR)
+                    continue;
+                return false;
+            }
+            if ((entry.revents & POLLOUT) && !flushOutbox(fd, outbox))
+                return false;
+            if (!(entry.revents & (POLLIN | POLLHUP | POLLERR)))
+                continue;
+            ssize_t n = read(fd, buffer, sizeof(buffer));
+            if (n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR))
+                continue;
+            if (n <= 0)
+                return false;
+            pending.append(buffer, static_cast<std::size_t>(n));
+        }
+        return true;
+    }
+};
+
+int runControlClient(const std::string &path, std::vector<std::string> commands)
+{
+    if (commands.empty()) {
+        std::string line;
+        while (std::getline(std::cin, line))
+            if (!line.empty())
+                commands.push_back(line);
+    }
+    ControlClient client;
+    if (!client.connect(path)) {
+        std::cerr << "Error: Could not connect to " << path << "\n";
+        return 1;
+    }
+    std::vector<std::string> replies;
+    if (!client.batch(commands, replies)) {
+        std::cerr << "Error: Connection closed before every command was answered\n";
+        return 1;
+    }
+    bool ok = true;
+    for (std::size_t k = 0; k < replies.size(); k++) {
+        std::cout << commands[k] << " -> " << replies[k] << "\n";
+        ok = ok && replies[k].compare(0, 2, "ok") == 0;
+        std::istringstream reply(replies[k]);
+        std::string status, name;
+        std::size_t bytes = 0;
+        if (commands[k] == "state" && reply >> status >> name >> bytes) {
+            StateSnapshot snapshot;
+            if (!snapshot.read(name, bytes)) {
+                std::cerr << "Error: Could not read " << name << "\n";
+                ok = false;
+                continue;
+            }
+            double meanX = 0.0, meanY = 0.0;
+            for (std::size_t i = 0; i < snapshot.x.size(); i++) {
+                meanX += snapshot.x[i];
+                meanY += snapshot.y[i];
+            }
+            std::size_t count = std::max<std::size_t>(1, snapshot.x.size());
+            std::cout << "   step " << snapshot.step << ", " << snapshot.x.size() << " balls in a "
+                      << snapshot.sides << "-gon, mean position (" << std::fixed << std::setprecision(1)
+                      << meanX / count << ", " << meanY / count << ")\n";
+        }
+    }
+    return ok ? 0 : 1;
+}
+
+//------------------------------------------------------------
+// Benchmark: the control protocol end to end with an in-process server thread. Measures
+// the round trip of single commands, a batch of commands in one write, and fetching the
+// state of a large population through shared memory.
+// Run with: ./bouncing_ball --bench-ipc
+//------------------------------------------------------------
+int runControlBenchmark()
+{
+    const int roundTrips = 2000, population = 100000;
+    const std::string path = "/tmp/bouncing_ball_bench_" + std::to_string(getpid()) + ".sock";
+    std::signal(SIGPIPE, SIG_IGN);
+    ControlServer server;
+    if (!server.state.create("/bouncing_ball_bench_" + std::to_string(getpid()))) {
+        std::cerr << "Error: Could not create shared memory: " << std::strerror(errno) << "\n";
+        return 1;
+    }
+    int listener = listenOn(path);
+    if (listener < 0)
+        return 1;
+    std::thread serverThread([&] { serveControl(server, listener); });
+
+    ControlClient client;
+    std::vector<std::string> replies;
+    bool ok = client.connect(path);
+
+    sf::Clock clock;
+    for (int k = 0; k < roundTrips && ok; k++)
+        ok = client.batch({"stats"}, replies);
+    float singleUs = clock.restart().asSeconds() * 1e6f / roundTrips;
+
+    std::vector<std::string> commands(roundTrips, "stats");
+    ok = ok && client.batch(commands, replies);
+    float batchedUs = clock.restart().asSeconds() * 1e6f / roundTrips;
+
+    // A short run, then a large population (just launched, so still at the center)
+    // fetched through shared memory
+    ok = ok && client.batch({"load 6", "launch 200 300 7", "step 120", "load 6 2000",
+                             "launch " + std::to_string(population) + " 300 7"}, replies);
+    for (const std::string &reply : replies)
+        ok = ok && reply.compare(0, 2, "ok") == 0;
+    StateSnapshot snapshot;
+    const int fetches = 20;
+    std::string name;
+    std::size_t bytes = 0;
+    clock.restart();
+    for (int k = 0; k < fetches && ok; k++) {
+        ok = client.batch({"state"}, replies);
+        std::istringstream reply(replies[0]);
+        std::string status;
+        ok = ok && reply >> status >> name >> bytes && snapshot.read(name, bytes);
+    }
+    float fetchMs = clock.getElapsedTime().asSeconds() * 1000.f / fetches;
+
+    ok = client.batch({"quit"}, replies) && ok; // even after a failed command, so the server stops
+    serverThread.join();
+    close(listener);
+    unlink(path.c_str());
+    if (!ok) {
+        std::cerr << "Error: The control session failed\n";
+        return 1;
+    }
+
+    std::cout << std::fixed << std::setprecision(2)
+              << "single command round trip:   " << singleUs << " us\n"
+              << "batched (" << roundTrips << " per write): " << batchedUs << " us per command\n"
+              << "state fetch, " << snapshot.x.size() << " balls (" << bytes / 1024 << " KiB segment): "
+              << fetchMs << " ms\n";
+    return 0;
+}
+
+//------------------------------------------------------------
+// State publication for external viewers: every step the producer writes the balls and the
+// polygon into the next slot of a ring in POSIX shared memory. Each slot has its own sequence
+// counter (2 * frame + 1 while being written, 2 * frame + 2 once complete) and the ring
+// header counts completed frames. Viewers map the segment read-only, use the newest slot in
+// place and check afterwards that its sequence did not move, so they never copy, lock or
+// signal the producer, and any number of them can come and go. A slot is only rewritten
+// 'slotCount' frames later, which gives a viewer that long to finish with it.
+//------------------------------------------------------------
+const std::uint32_t RING_MAGIC = 0x42424c52; // "BBLR"
+const int MAX_PUBLISHED_VERTICES = 64;
+
+struct StateRingHeader {
+    std::uint32_t magic;
+    std::uint32_t slotCount;
+    std::uint32_t capacity;  // balls per slot
+    std::uint32_t slotBytes;
+    std::atomic<std::uint64_t> published; // frames completed; the newest is in slot (published - 1) % slotCount
+};
+
+struct StateSlot {
+    std::atomic<std::uint64_t> sequence;
+    std::uint64_t step;
+    std::uint32_t ballCount;  // balls stored, at most the ring capacity
+    std::uint32_t totalBalls; // balls in the simulation
+    float ballRadius;
+    float polygonRadius;
+    float polygonAngle; // radians
+    float centerX, centerY;
+    std::int32_t sides;
+    double checksum; // sum of the stored x and y, so readers can verify what they used
+    float vertices[2 * MAX_PUBLISHED_VERTICES];
+
+    // x, y, vx and vy follow the slot, 'capacity' floats each
+    const float *x() const { return reinterpret_cast<const float *>(this + 1); }
+    const float *y(std::uint32_t capacity) const { return x() + capacity; }
+    const float *vx(std::uint32_t capacity) const { return x() + 2 * capacity; }
+    const float *vy(std::uint32_t capacity) const { return x() + 3 * capacity; }
+};
+
+inline std::size_t ringSlotBytes(std::uint32_t capacity)
+{
+    std::size_t bytes = sizeof(StateSlot) + 4 * static_cast<std::size_t>(capacity) * sizeof(float);
+    return (bytes + 63) / 64 * 64; // slots start on their own cache lines
+}
+
+struct StatePublisher {
+    std::string name;
+    int fd = -1;
+    void *data = nullptr;
+    std::size_t bytes = 0;
+    StateRingHeader *header = nullptr;
+    std::uint64_t frame = 0;
+
+    ~StatePublisher()
+    {
+        if (data)
+            munmap(data, bytes);
+        if (fd >= 0) {
+            close(fd);
+            shm_unlink(name.c_str());
+        }
+    }
+
+    bool create(const std::string &segmentName, std::uint32_t slotCount, std::uint32_t capacity)
+    {
+        name = segmentName;
+        std::size_t slotBytes = ringSlotBytes(capacity);
+        bytes = 64 + slotCount * slotBytes;
+        fd = shm_open(name.c_str(), O_CREAT | O_RDWR | O_TRUNC, 0644);
+        if (fd < 0 || ftruncate(fd, static_cast<off_t>(bytes)) != 0)
+            return false;
+        void *mapped = mmap(nullptr, bytes, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+        if (mapped == MAP_FAILED)
+            return false;
+        data = mapped;
+        header = static_cast<StateRingHeader *>(data);
+        header->slotCount = slotCount;
+        header->capacity = capacity;
+        header->slotBytes = static_cast<std::uint32_t>(slotBytes);
+        header->published.store(0, std::memory_order_relaxed);
+        std::atomic_thread_fence(std::memory_order_release);
+        header->magic = RING_MAGIC; // last, so a viewer never sees a half-initialized header
+        return true;
+    }
+
+    // Balls beyond the ring capacity are left out (totalBalls still counts them)
+    void publish(const Simulation<float> &sim, const Boundary<float> &boundary, std::uint64_t step,
+                 float polygonRadius, float polygonAngle)
+    {
+        std::uint32_t capacity = header->capacity;
+        StateSlot *slot = reinterpret_cast<StateSlot *>(static_cast<char *>(data) + 64
+                                                        + (frame % header->slotCount) * header->slotBytes);
+        slot->sequence.store(2 * frame + 1, std::memory_order_relaxed);
+        std::atomic_thread_fence(std::memory_order_release);
+
+        std::uint32_t count = static_cast<std::uint32_t>(std::min<std::size_t>(sim.balls.size(), capacity));
+        float *x = const_cast<float *>(slot->x()), *y = x + capacity, *vx = y + capacity, *vy = vx + capacity;
+        double checksum = 0.0;
+        for (std::uint32_t i = 0; i < count; i++) {
+            x[i] = sim.balls.position[i].x;
+            y[i] = sim.balls.position[i].y;
+            vx[i] = sim.balls.velocity[i].x;
+            vy[i] = sim.balls.velocity[i].y;
+            checksum += static_cast<double>(x[i]) + y[i];
+        }
+        int sides = static_cast<int>(std::min<std::size_t>(boundary.points.size(), MAX_PUBLISHED_VERTICES));
+        for (int k = 0; k < sides; k++) {
+            slot->vertices[2 * k] = boundary.points[k].x;
+            slot->vertices[2 * k + 1] = boundary.points[k].y;
+        }
+        slot->step = step;
+        slot->ballCount = count;
+        slot->totalBalls = static_cast<std::uint32_t>(sim.balls.size());
+        slot->ballRadius = sim.ballRadius;
+        slot->polygonRadius = polygonRadius;
+        slot->polygonAngle = polygonAngle;
+        slot->centerX = boundary.pivot.x;
+        slot->centerY = boundary.pivot.y;
+        slot->sides = sides;
+        slot->checksum = checksum;
+
+        slot->sequence.store(2 * frame + 2, std::memory_order_release);
+        header->published.store(++frame, std::memory_order_release);
+    }
+};
+
+struct StateViewer {
+    const void *data = nullptr;
+    std::size_t bytes = 0;
+    const StateRingHeader *header = nullptr;
+
+    ~StateViewer()
+    {
+        if (data)
+            munmap(const_cast<void *>(data), bytes);
+    }
+
+    bool attach(const std::string &name)
+    {
+        int fd = shm_open(name.c_str(), O_RDONLY, 0);
+        if (fd < 0)
+            return false;
+        struct stat info;
+        bool ok = fstat(fd, &info) == 0 && info.st_size >= 64;
+        void *mapped = ok ? mmap(nullptr, info.st_size, PROT_READ, MAP_SHARED, fd, 0) : MAP_FAILED;
+        close(fd);
+        if (mapped == MAP_FAILED)
+            return false;
+        data = mapped;
+        bytes = static_cast<std::size_t>(info.st_size);
+        header = static_cast<const StateRingHeader *>(data);
+        std::atomic_thread_fence(std::memory_order_acquire);
+        return header->magic == RING_MAGIC && 64 + header->slotCount * header->slotBytes <= bytes;
+    }
+
+    std::uint64_t published() const { return header->published.load(std::memory_order_acquire); }
+
+    // The slot of 'frame' and the sequence it must still have when the reader is done with
+    // it, or nullptr if that frame has not been completed or was already overwritten
+    const StateSlot *slot(std::uint64_t frame, std::uint64_t &sequence) const
+    {
+        const StateSlot *s = reinterpret_cast<const StateSlot *>(static_cast<const char *>(data) + 64
+                                                                 + (frame % header->slotCount) * header->slotBytes);
+        sequence = s->sequence.load(std::memory_order_acquire);
+        return sequence == 2 * frame + 2 ? s : nullptr;
+    }
+
+    // True if nothing read from the slot since slot() can have been torn by the producer
+    bool unchanged(const StateSlot *s, std::uint64_t sequence) const
+    {
+        std::atomic_thread_fence(std::memory_order_acquire);
+        return s->sequence.load(std::memory_order_relaxed) == sequence;
+    }
+};
+
+//------------------------------------------------------------
+// Publishing producer: a headless simulation stepping as fast as it can, writing every
+// step into the ring. A large hexagon holds 'population' balls (about a fifth of its area)
+// moving in random directions; 'steps' 0 runs until interrupted. SIGINT and SIGTERM end
+// the loop rather than the process, so the segment is still unlinked on the way out.
+// Run with: ./bouncing_ball --publish <segment> [population] [steps]   (segment like /balls)
+//------------------------------------------------------------
+// Calls add(position, velocity) for each ball of the scene in order and returns the radius
+// of the hexagon that holds them
+template <typename Add>
+float layOutPublishScene(int population, float ballRadius, Add add)
+{
+    std::mt19937 rng(1234);
+    std::uniform_real_distribution<float> unit(0.f, 1.f);
+    const float ballArea = PI * ballRadius * ballRadius;
+    const float worldRadius = std::sqrt(population * ballArea / 0.2f / 2.598f);
+    float spacing = std::sqrt(PI * 0.64f * worldRadius * worldRadius / population);
+    int side = static_cast<int>(0.8f * worldRadius / spacing) + 1;
+    int placed = 0;
+    for (int row = -side; row <= side && placed < population; row++) {
+        for (int col = -side; col <= side && placed < population; col++) {
+            sf::Vector2f offset(col * spacing, row * spacing);
+            if (length(offset) < 0.8f * worldRadius) {
+                add(offset, 300.f * sf::Vector2f(unit(rng) - 0.5f, unit(rng) - 0.5f));
+                placed++;
+            }
+        }
+    }
+    return worldRadius;
+}
+
+void setupPublishScene(Simulation<float> &sim, int population, float &worldRadius)
+{
+    worldRadius = layOutPublishScene(population, sim.ballRadius, [&](sf::Vector2f position, sf::Vector2f velocity) {
+        sim.balls.add(position, velocity);
+    });
+}
+
+volatile std::sig_atomic_t publisherStop = 0;
+
+extern "C" void stopPublisher(int)
+{
+    publisherStop = 1;
+}
+
+int runPublisher(const std::string &segment, int population, long long steps)
+{
+    const float dt = 1.f / 60.f, angularSpeed = ROTATION_SPEED * PI / 180.f;
+    Simulation<float> sim;
+    float worldRadius = 0.f;
+    setupPublishScene(sim, population, worldRadius);
+    StatePublisher publisher;
+    if (!publisher.create(segment, 8, static_cast<std::uint32_t>(population))) {
+        std::cerr << "Error: Could not create shared memory " << segment << ": " << std::strerror(errno) << "\n";
+        return 1;
+    }
+    std::cout << "publishing " << sim.balls.size() << " balls to " << segment << "\n";
+    std::signal(SIGINT, stopPublisher);
+    std::signal(SIGTERM, stopPublisher);
+
+    Boundary<float> boundary;
+    sf::Clock clock;
+    long long reported = 0;
+    for (long long step = 0; (steps == 0 || step < steps) && !publisherStop; step++) {
+        float angle = angularSpeed * dt * static_cast<float>(step);
+        boundary.setRegular(6, worldRadius, angle, sf::Vector2f(0.f, 0.f), angularSpeed);
+        sim.step(boundary, dt);
+        publisher.publish(sim, boundary, static_cast<std::uint64_t>(step), worldRadius, angle);
+        if (clock.getElapsedTime().asSeconds() >= 1.f) {
+            std::cout << std::fixed << std::setprecision(0) << (step - reported) / clock.restart().asSeconds()
+                      << " steps/s, " << sim.balls.size() << " balls\n";
+            reported = step;
+        }
+    }
+    std::signal(SIGINT, SIG_DFL);
+    std::signal(SIGTERM, SIG_DFL);
+    return 0;
+}
+
+//------------------------------------------------------------
+// Viewer: attaches to a publishing producer and draws its newest frame with the polygon and
+// ball shapes of the app, scaled to fit the window. Frames the producer finished in between
+// are skipped; a frame overwritten while being drawn is simply not counted as shown.
+// Run with: ./bouncing_ball --view <segment>
+//------------------------------------------------------------
+int runViewer(const std::string &segment)
+{
+    StateViewer viewer;
+    if (!viewer.attach(segment)) {
+        std::cerr << "Error: Nothing is publishing to " << segment << "\n";
+        return 1;
+    }
+    sf::ContextSettings settings;
+    settings.antialiasingLevel = 8;
+    sf::RenderWindow window(sf::VideoMode(800, 600), "Viewer: " + segment, sf::Style::Default, settings);
+    window.setVerticalSyncEnabled(true);
+
+    sf::ConvexShape polygon;
+    polygon.setFillColor(sf::Color::Transparent);
+    polygon.setOutlineColor(sf::Color::White);
+    sf::CircleShape ball;
+    ball.setFillColor(sf::Color::Red);
+    std::uint64_t shown = 0, torn = 0;
+    sf::Clock titleClock;
+
+    while (window.isOpen()) {
+        sf::Event event;
+        while (window.pollEvent(event))
+            if (event.type == sf::Event::Closed)
+                window.close();
+
+        std::uint64_t published = viewer.published(), sequence = 0;
+        const StateSlot *slot = published > 0 ? viewer.slot(published - 1, sequence) : nullptr;
+        window.clear(sf::Color::Black);
+        if (slot) {
+            // Fit the polygon's circumcircle into the window
+            float extent = 2.2f * slot->polygonRadius;
+            float aspect = static_cast<float>(window.getSize().x) / window.getSize().y;
+            sf::View view(sf::FloatRect(slot->centerX - extent * aspect / 2.f, slot->centerY - extent / 2.f,
+                                        extent * aspect, extent));
+            window.setView(view);
+            float pixel = extent / window.getSize().y;
+
+            polygon.setPointCount(slot->sides);
+            for (int k = 0; k < slot->sides; k++)
+                polygon.setPoint(k, sf::Vector2f(slot->vertices[2 * k], slot->vertices[2 * k + 1]));
+            polygon.setOutlineThickness(2.f * pixel);
+            window.draw(polygon);
+
+            std::uint32_t capacity = viewer.header->capacity;
+            const float *x = slot->x(), *y = slot->y(capacity);
+            ball.setRadius(std::max(slot->ballRadius, pixel));
+            for (std::uint32_t i = 0; i < slot->ballCount; i++) {
+                ball.setPosition(x[i] - ball.getRadius(), y[i] - ball.getRadius());
+                window.draw(ball);
+            }
+            if (viewer.unchanged(slot, sequence))
+                shown++;
+            else
+                torn++;
+        }
+        window.display();
+
+        if (titleClock.getElapsedTime().asSeconds() >= 0.5f) {
+            titleClock.restart();
+            window.setTitle("Viewer: " + segment + "  frame " + std::to_string(published) + "  shown "
+                            + std::to_string(shown) + "  torn " + std::to_string(torn));
+        }
+    }
+    return 0;
+}
+
+//------------------------------------------------------------
+// Benchmark: producer cost of publishing, alone and with viewer processes attached. The
+// viewers are forked processes that read the newest frame in place as fast as they can and
+// verify each one against its checksum; a verified frame whose checksum disagrees would
+// mean a torn read slipped through.
+// Run with: ./bouncing_ball --bench-publish [population] [viewers]
+//------------------------------------------------------------
+int runPublishBenchmark(int population, int viewerCount)
+{
+    const int steps = 300;
+    const float dt = 1.f / 60.f, angularSpeed = ROTATION_SPEED * PI / 180.f;
+    const std::string segment = "/bouncing_ball_ring_" + std::to_string(getpid());
+
+    // One producer run: plain steps, or steps followed by a publish
+    auto produce = [&](StatePublisher *publisher) {
+        Simulation<float> sim;
+        float worldRadius = 0.f;
+        setupPublishScene(sim, population, worldRadius);
+        Boundary<float> boundary;
+        sf::Time stepTime, publishTime;
+        for (int step = 0; step < steps; step++) {
+            float angle = angularSpeed * dt * step;
+            boundary.setRegular(6, worldRadius, angle, sf::Vector2f(0.f, 0.f), angularSpeed);
+            sf::Clock clock;
+            sim.step(boundary, dt);
+            stepTime += clock.restart();
+            if (publisher) {
+                publisher->publish(sim, boundary, static_cast<std::uint64_t>(step), worldRadius, angle);
+                publishTime += clock.restart();
+            }
+        }
+        return std::make_pair(stepTime.asSeconds() * 1000.f / steps, publishTime.asSeconds() * 1000.f / steps);
+    };
+
+    StatePublisher publisher;
+    if (!publisher.create(segment, 8, static_cast<std::uint32_t>(population))) {
+        std::cerr << "Error: Could not create shared memory: " << std::strerror(errno) << "\n";
+        return 1;
+    }
+    std::pair<float, float> alone = produce(nullptr);
+    std::pair<float, float> unwatched = produce(&publisher);
+
+    // Viewers report (frames verified, torn reads caught, checksum errors) through a pipe
+    int results[2];
+    if (pipe(results) != 0)
+        return 1;
+    std::vector<pid_t> children;
+    for (int v = 0; v < viewerCount; v++) {
+        pid_t pid = fork();
+        if (pid == 0) {
+            close(results[0]);
+            StateViewer viewer;
+            std::uint64_t counts[3] = {0, 0, 0};
+            if (viewer.attach(segment)) {
+                std::uint64_t last = viewer.published();
+                // Until the producer stops (no new frame for a while)
+                sf::Clock idle;
+                while (idle.getElapsedTime().asSeconds() < 0.5f) {
+                    std::uint64_t published = viewer.published(), sequence = 0;
+                    if (published == last) {
+                        std::this_thread::yield();
+                        continue;
+                    }
+                    last = published;
+                    idle.restart();
+                    const StateSlot *slot = viewer.slot(published - 1, sequence);
+                    if (!slot)
+                        continue;
+                    std::uint32_t capacity = viewer.header->capacity, count = slot->ballCount;
+                    const float *x = slot->x(), *y = slot->y(capacity);
+                    double checksum = 0.0;
+                    for (std::uint32_t i = 0; i < std::min(count, capacity); i++)
+                        checksum += static_cast<double>(x[i]) + y[i];
+                    bool matches = checksum == slot->checksum;
+                    if (!viewer.unchanged(slot, sequence))
+                        counts[1]++;
+                    else if (matches)
+                        counts[0]++;
+                    else
+                        counts[2]++;
+                }
+            }
+            ssize_t written = write(results[1], counts, sizeof(counts));
+            _exit(written == sizeof(counts) ? 0 : 1);
+        }
+        children.push_back(pid);
+    }
+    close(results[1]);
+    std::this_thread::sleep_for(std::chrono::milliseconds(100)); // let the viewers attach
+    std::pair<float, float> watched = produce(&publisher);
+
+    std::uint64_t verified = 0, torn = 0, mismatched = 0;
+    for (std::size_t v = 0; v < children.size(); v++) {
+        std::uint64_t counts[3] = {0, 0, 0};
+        if (read(results[0], counts, sizeof(counts)) == sizeof(counts)) {
+            verified += counts[0];
+            torn += counts[1];
+            mismatched += counts[2];
+        }
+    }
+    for (pid_t pid : children)
+        waitpid(pid, nullptr, 0);
+    close(results[0]);
+
+    std::cout << "balls: " << population << ", ring: " << publisher.header->slotCount << " slots of "
+              << publisher.header->slotBytes / 1024 << " KiB, " << steps << " steps per run\n"
+              << std::fixed << std::setprecision(3)
+              << "step only:                 " << alone.first << " ms\n"
+              << "step + publish:            " << unwatched.first << " + " << unwatched.second << " ms\n"
+              << "step + publish, " << viewerCount << " viewers: " << watched.first << " + " << watched.second << " ms\n"
+              << "viewer frames verified: " << verified << ", torn reads caught: " << torn
+              << ", checksum errors: " << mismatched << "\n";
+    return 0;
+}
+
+//------------------------------------------------------------
+// Sharded simulation: the polygon is cut into angular sectors around its center and each
+// sector's balls are simulated by a separate worker process. Everything the processes share
+// lives in one anonymous shared mapping made before forking:
+//
+//   - a barrier that the workers and the coordinator pass four times per step
+//   - the sector bounds, rewritten by the coordinator to balance the load
+//   - the fastest ball of the last step, which sets how far a halo reaches
+//   - per sector, a halo: copies of its balls within reach of another sector, which the
+//     other workers add as ghost balls for the step so contacts across a cut are seen
+//   - per sector, an inbox of balls migrating into it. Any worker may push (a slot is
+//     claimed with fetch_add) and the owner drains it after the next barrier.
+//
+// Ghosts are simulated like any ball and then discarded, so a contact across a cut is
+// resolved by both workers, each keeping only its own ball's result. That is the usual
+// halo approximation: momentum is not exactly conserved across a cut, but no ball is ever
+// missed or duplicated.
+//------------------------------------------------------------
+const int MAX_SHARDS = 64;
+const int SHARD_ANGLE_BINS = 256;
+
+// A barrier across processes. A party that dies leaves the others spinning, so waiters
+// call 'othersAlive' every so often; once it fails the barrier is broken for good and every
+// wait returns false.
+struct SpinBarrier {
+    std::atomic<std::uint32_t> waiting;
+    std::atomic<std::uint32_t> generation;
+    std::atomic<std::uint32_t> broken;
+    std::uint32_t parties;
+
+    template <typename Check>
+    bool wait(Check othersAlive)
+    {
+        std::uint32_t gen = generation.load(std::memory_order_acquire);
+        if (waiting.fetch_add(1, std::memory_order_acq_rel) + 1 == parties) {
+            waiting.store(0, std::memory_order_relaxed);
+            generation.fetch_add(1, std::memory_order_release);
+            return !broken.load(std::memory_order_acquire);
+        }
+        for (std::uint32_t spins = 1; generation.load(std::memory_order_acquire) == gen; spins++) {
+            if (broken.load(std::memory_order_acquire))
+                return false;
+            if (spins % 1024 == 0 && !othersAlive()) {
+                breakAll();
+                return false;
+            }
+            std::this_thread::yield();
+        }
+        return !broken.load(std::memory_order_acquire);
+    }
+
+    void breakAll() { broken.store(1, std::memory_order_release); }
+};
+
+struct MigratingBall {
+    float x, y, vx, vy, angle, angularVelocity;
+};
+
+struct ShardStats {
+    std::uint32_t balls;
+    std::uint32_t ghosts;
+    std::uint32_t emigrated;
+    std::uint32_t stalled;       // balls that stayed a step longer because an inbox was full
+    std::uint32_t droppedGhosts; // halo overflow
+    std::uint32_t escaped;
+    float stepMs;
+    float maxSpeed; // of the shard's last step, ghosts included
+    std::uint32_t histogram[SHARD_ANGLE_BINS]; // the shard's balls by angle around the center
+};
+
+struct ShardControl {
+    SpinBarrier barrier;
+    float bounds[MAX_SHARDS + 1]; // sector k is [bounds[k], bounds[k + 1]), bounds[0] = 0, bounds[shards] = 2 pi
+    float maxSpeed;               // of any ball in the last step, set with the bounds
+    ShardStats stats[MAX_SHARDS];
+};
+
+struct BallBuffer {
+    std::atomic<std::uint32_t> count;
+    // 'capacity' MigratingBall entries follow
+
+    MigratingBall *entries() { return reinterpret_cast<MigratingBall *>(this + 1); }
+};
+
+struct ShardSegment {
+    int shards = 0;
+    std::uint32_t capacity = 0; // entries per halo and per inbox
+    void *base = nullptr;
+    std::size_t bytes = 0;
+
+    ~ShardSegment()
+    {
+        if (base)
+            munmap(base, bytes);
+    }
+
+    std::size_t bufferBytes() const { return (sizeof(BallBuffer) + capacity * sizeof(MigratingBall) + 63) / 64 * 64; }
+
+    bool create(int shardCount, std::uint32_t entries)
+    {
+        shards = shardCount;
+        capacity = entries;
+        bytes = (sizeof(ShardControl) + 63) / 64 * 64 + 2 * shards * bufferBytes();
+        void *mapped = mmap(nullptr, bytes, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+        if (mapped == MAP_FAILED)
+            return false;
+        base = mapped; // zero-filled, which is a valid empty state for every field
+        control()->barrier.parties = static_cast<std::uint32_t>(shards + 1);
+        for (int k = 0; k <= shards; k++)
+            control()->bounds[k] = 2.f * PI * k / shards;
+        return true;
+    }
+
+    ShardControl *control() { return static_cast<ShardControl *>(base); }
+
+    BallBuffer *buffer(int index)
+    {
+        return reinterpret_cast<BallBuffer *>(static_cast<char *>(base) + (sizeof(ShardControl) + 63) / 64 * 64
+                                              + index * bufferBytes());
+    }
+    BallBuffer *halo(int shard) { return buffer(shard); }
+    BallBuffer *inbox(int shard) { return buffer(shards + shard); }
+
+    // Lock-free multi-producer push; fails once the inbox is full
+    bool push(int shard, const MigratingBall &ball)
+    {
+        BallBuffer *box = inbox(shard);
+        std::uint32_t slot = box->count.fetch_add(1, std::memory_order_relaxed);
+        if (slot >= capacity)
+            return false;
+        box->entries()[slot] = ball;
+        return true;
+    }
+};
+
+// Angle of 'p' around 'center' in [0, 2 pi)
+inline float angleAround(const sf::Vector2f &p, const sf::Vector2f &center)
+{
+    float a = std::atan2(p.y - center.y, p.x - center.x);
+    return a < 0.f ? a + 2.f * PI : a;
+}
+
+inline int sectorOf(float angle, const float *bounds, int shards)
+{
+    int k = static_cast<int>(std::upper_bound(bounds + 1, bounds + shards, angle) - (bounds + 1));
+    return std::min(k, shards - 1);
+}
+
+// Distance from 'p' to the wedge between the rays at angles a0 and a1 (0 inside it)
+inline float distanceToSector(const sf::Vector2f &p, const sf::Vector2f &center, float a0, float a1)
+{
+    sf::Vector2f d = p - center;
+    float angle = angleAround(p, center);
+    if (angle >= a0 && angle < a1)
+        return 0.f;
+    float best = length(d);
+    for (float a : {a0, a1}) {
+        sf::Vector2f ray(std::cos(a), std::sin(a));
+        if (dot(d, ray) > 0.f)
+            best = std::min(best, std::abs(ray.x * d.y - ray.y * d.x));
+    }
+    return best;
+}
+
+// Returns false if the coordinator or another worker went away mid-run
+bool runShardWorker(ShardSegment &segment, int me, int population, int steps, pid_t coordinator)
+{
+    const float dt = 1.f / 60.f, angularSpeed = ROTATION_SPEED * PI / 180.f;
+    const sf::Vector2f center(0.f, 0.f);
+    ShardControl &control = *segment.control();
+    const int shards = segment.shards;
+    auto coordinatorAlive = [coordinator] { return getppid() == coordinator; };
+
+    // Every worker lays out the same scene but spawns only the balls in its own sector
+    Simulation<float> sim;
+    const float worldRadius =
+        layOutPublishScene(population, sim.ballRadius, [&](sf::Vector2f position, sf::Vector2f velocity) {
+            if (sectorOf(angleAround(position, center), control.bounds, shards) == me)
+                sim.spawn(position, velocity);
+        });
+    // Within a step a ball speeds up by at most gravity and a kick from the rotating wall,
+    // whose normal speed peaks at a corner
+    const float speedGain = length(sim.gravity) * dt
+                            + (1.f + RESTITUTION) * angularSpeed * worldRadius * std::sin(PI / 6.f);
+    float bounds[MAX_SHARDS + 1];
+    Boundary<float> boundary;
+    std::vector<BallHandle> ghosts;
+    std::vector<std::uint8_t> isGhost;
+
+    for (int step = 0; step < steps; step++) {
+        if (!control.barrier.wait(coordinatorAlive)) // bounds are settled
+            return false;
+        std::copy(control.bounds, control.bounds + shards + 1, bounds);
+        ShardStats &stats = control.stats[me];
+        // Two balls on either side of a cut close in by at most twice the fastest speed per
+        // step, so a ball this near another sector may touch one of its balls
+        const float reach = 2.f * sim.ballRadius + 2.f * (control.maxSpeed + speedGain) * dt;
+
+        // Export the balls another sector can touch (including any left outside this one)
+        BallBuffer *halo = segment.halo(me);
+        std::uint32_t exported = 0, dropped = 0;
+        for (std::size_t i = 0; i < sim.balls.size(); i++) {
+            sf::Vector2f p = sim.balls.position[i];
+            sf::Vector2f d = p - center;
+            float angle = angleAround(p, center);
+            bool near = sectorOf(angle, bounds, shards) != me || length(d) < reach;
+            for (int edge = me; edge <= me + 1 && !near; edge++) {
+                sf::Vector2f ray(std::cos(bounds[edge]), std::sin(bounds[edge]));
+                near = std::abs(ray.x * d.y - ray.y * d.x) < reach;
+            }
+            if (!near)
+                continue;
+            if (exported == segment.capacity) {
+                dropped++;
+                continue;
+            }
+            halo->entries()[exported++] = MigratingBall{p.x, p.y, sim.balls.velocity[i].x, sim.balls.velocity[i].y,
+                                                        sim.balls.angle[i], sim.balls.angularVelocity[i]};
+        }
+        halo->count.store(exported, std::memory_order_release);
+        if (!control.barrier.wait(coordinatorAlive)) // every halo is complete
+            return false;
+
+        // Import the other sectors' balls within reach as ghosts, then step
+        ghosts.clear();
+        for (int k = 0; k < shards && shards > 1; k++) {
+            if (k == me)
+                continue;
+            BallBuffer *other = segment.halo(k);
+            std::uint32_t count = other->count.load(std::memory_order_acquire);
+            for (std::uint32_t e = 0; e < count; e++) {
+                const MigratingBall &b = other->entries()[e];
+                if (distanceToSector(sf::Vector2f(b.x, b.y), center, bounds[me], bounds[me + 1]) < reach)
+                    ghosts.push_back(sim.spawn(sf::Vector2f(b.x, b.y), sf::Vector2f(b.vx, b.vy)));
+            }
+        }
+        float angle = angularSpeed * dt * step;
+        boundary.setRegular(6, worldRadius, angle, center, angularSpeed);
+        sf::Clock clock;
+        sim.step(boundary, dt);
+        stats.stepMs = clock.getElapsedTime().asSeconds() * 1000.f;
+        stats.maxSpeed = static_cast<float>(sim.metrics.maxSpeed);
+
+        // Hand balls that left the sector to their new owner, drop the ghosts
+        isGhost.assign(sim.balls.size(), 0);
+        for (const BallHandle &ghost : ghosts) {
+            int i = sim.indexOf(ghost);
+            if (i >= 0)
+                isGhost[i] = 1;
+        }
+        std::uint32_t emigrated = 0, stalled = 0;
+        for (std::size_t i = 0; i < sim.balls.size(); i++) {
+            if (isGhost[i])
+                continue;
+            int owner = sectorOf(angleAround(sim.balls.position[i], center), bounds, shards);
+            if (owner == me)
+                continue;
+            MigratingBall b{sim.balls.position[i].x, sim.balls.position[i].y, sim.balls.velocity[i].x,
+                            sim.balls.velocity[i].y, sim.balls.angle[i], sim.balls.angularVelocity[i]};
+            if (segment.push(owner, b)) {
+                sim.despawn(sim.handleOf(static_cast<int>(i)));
+                emigrated++;
+            } else {
+                stalled++;
+            }
+        }
+        for (const BallHandle &ghost : ghosts)
+            sim.despawn(ghost);
+        sim.compact();
+        if (!control.barrier.wait(coordinatorAlive)) // every migrant is in its inbox
+            return false;
+
+        BallBuffer *inbox = segment.inbox(me);
+        std::uint32_t arrived = std::min(inbox->count.load(std::memory_order_acquire), segment.capacity);
+        for (std::uint32_t e = 0; e < arrived; e++) {
+            const MigratingBall &b = inbox->entries()[e];
+            int i = sim.indexOf(sim.spawn(sf::Vector2f(b.x, b.y), sf::Vector2f(b.vx, b.vy)));
+            sim.balls.angle[i] = b.angle;
+            sim.balls.angularVelocity[i] = b.angularVelocity;
+        }
+        inbox->count.store(0, std::memory_order_relaxed);
+
+        stats.balls = static_cast<std::uint32_t>(sim.balls.size());
+        stats.ghosts = static_cast<std::uint32_t>(ghosts.size());
+        stats.emigrated = emigrated;
+        stats.stalled = stalled;
+        stats.droppedGhosts = dropped;
+        stats.escaped = static_cast<std::uint32_t>(sim.culled.escaped);
+        std::fill(stats.histogram, stats.histogram + SHARD_ANGLE_BINS, 0);
+        for (const sf::Vector2f &p : sim.balls.position)
+            stats.histogram[std::min(static_cast<int>(angleAround(p, center) / (2.f * PI) * SHARD_ANGLE_BINS),
+                                     SHARD_ANGLE_BINS - 1)]++;
+        if (!control.barrier.wait(coordinatorAlive)) // stats are in
+            return false;
+    }
+    return true;
+}
+
+// Re-cut the sectors at the quantiles of the ball angles so each gets an equal share.
+// Returns the largest sector's share relative to a perfect split, before the re-cut.
+float rebalanceShards(ShardControl &control, int shards, bool apply)
+{
+    std::uint64_t histogram[SHARD_ANGLE_BINS] = {};
+    std::uint64_t total = 0, largest = 0;
+    for (int k = 0; k < shards; k++) {
+        for (int b = 0; b < SHARD_ANGLE_BINS; b++)
+            histogram[b] += control.stats[k].histogram[b];
+        total += control.stats[k].balls;
+        largest = std::max<std::uint64_t>(largest, control.stats[k].balls);
+    }
+    float imbalance = total ? static_cast<float>(largest) * shards / total : 1.f;
+    if (!apply || total == 0)
+        return imbalance;
+    std::uint64_t cumulative = 0;
+    int next = 1;
+    for (int b = 0; b < SHARD_ANGLE_BINS && next < shards; b++) {
+        cumulative += histogram[b];
+        while (next < shards && cumulative * shards >= total * static_cast<std::uint64_t>(next))
+            control.bounds[next++] = 2.f * PI * (b + 1) / SHARD_ANGLE_BINS;
+    }
+    for (; next < shards; next++)
+        control.bounds[next] = 2.f * PI;
+    return imbalance;
+}
+
+//------------------------------------------------------------
+// Sharded run: forks one worker process per sector and coordinates them from this process,
+// re-cutting the sectors every 'rebalanceEvery' steps when the largest holds over 10% more
+// than its share. Checks that every ball is accounted for at the end and compares the wall
+// time per step with the same scene in a single process.
+// Run with: ./bouncing_ball --shards [workers] [population] [steps]
+//------------------------------------------------------------
+int runShardedSimulation(int shards, int population, int steps)
+{
+    const int rebalanceEvery = 20;
+    shards = std::max(1, std::min(shards, MAX_SHARDS));
+    ShardSegment segment;
+    if (!segment.create(shards, static_cast<std::uint32_t>(2 * population / shards + 1024))) {
+        std::cerr << "Error: Could not map shared memory: " << std::strerror(errno) << "\n";
+        return 1;
+    }
+    ShardControl &control = *segment.control();
+    control.maxSpeed = 0.f;
+    layOutPublishScene(population, Simulation<float>().ballRadius, [&control](sf::Vector2f, sf::Vector2f velocity) {
+        control.maxSpeed = std::max(control.maxSpeed, length(velocity));
+    });
+
+    // A worker that exits early (it crashed, or saw the barrier break) is reaped here and
+    // breaks the barrier for everyone else
+    std::vector<pid_t> workers;
+    auto workersAlive = [&workers] {
+        for (pid_t &pid : workers) {
+            if (pid > 0 && waitpid(pid, nullptr, WNOHANG) == pid) {
+                pid = -1;
+                return false;
+            }
+        }
+        return true;
+    };
+    auto stopWorkers = [&workers, &control] {
+        control.barrier.breakAll();
+        for (pid_t pid : workers)
+            if (pid > 0)
+                kill(pid, SIGKILL);
+        for (pid_t pid : workers)
+            if (pid > 0)
+                waitpid(pid, nullptr, 0);
+    };
+
+    const pid_t coordinator = getpid();
+    for (int k = 0; k < shards; k++) {
+        pid_t pid = fork();
+        if (pid == 0) {
+#ifdef __linux__
+            prctl(PR_SET_PDEATHSIG, SIGKILL); // the barrier's parent check covers other systems
+#endif
+            _exit(runShardWorker(segment, k, population, steps, coordinator) ? 0 : 1);
+        }
+        if (pid < 0) {
+            std::cerr << "Error: fork failed: " << std::strerror(errno) << "\n";
+            stopWorkers();
+            return 1;
+        }
+        workers.push_back(pid);
+    }
+
+    float firstImbalance = 0.f, lastImbalance = 0.f;
+    std::uint64_t emigrated = 0, stalled = 0, ghosts = 0, dropped = 0;
+    double slowestStepMs = 0.0;
+    int rebalances = 0;
+    sf::Clock clock;
+    for (int step = 0; step < steps; step++) {
+        bool passed = control.barrier.wait(workersAlive)  // bounds settled
+                      && control.barrier.wait(workersAlive) // halos
+                      && control.barrier.wait(workersAlive) // migrants
+                      && control.barrier.wait(workersAlive); // stats
+        if (!passed) {
+            std::cerr << "Error: a worker exited at step " << step << "\n";
+            stopWorkers();
+            return 1;
+        }
+        float slowest = 0.f;
+        control.maxSpeed = 0.f;
+        for (int k = 0; k < shards; k++) {
+            const ShardStats &s = control.stats[k];
+            control.maxSpeed = std::max(control.maxSpeed, s.maxSpeed);
+            emigrated += s.emigrated;
+            stalled += s.stalled;
+            ghosts += s.ghosts;
+            dropped += s.droppedGhosts;
+            slowest = std::max(slowest, s.stepMs);
+        }
+        slowestStepMs += slowest;
+        bool due = (step + 1) % rebalanceEvery == 0;
+        float imbalance = rebalanceShards(control, shards, false);
+        if (due && imbalance > 1.1f) {
+            rebalanceShards(control, shards, true);
+            rebalances++;
+        }
+        if (step == 0)
+            firstImbalance = imbalance;
+        lastImbalance = imbalance;
+    }
+    float shardedMs = clock.getElapsedTime().asSeconds() * 1000.f / steps;
+    bool workersOk = true;
+    for (pid_t pid : workers) {
+        int status = 0;
+        if (pid > 0 && (waitpid(pid, &status, 0) != pid || !WIFEXITED(status) || WEXITSTATUS(status) != 0))
+            workersOk = false;
+    }
+
+    std::uint64_t total = 0, escaped = 0;
+    std::cout << "shard   balls  escaped\n";
+    for (int k = 0; k < shards; k++) {
+        total += control.stats[k].balls;
+        escaped += control.stats[k].escaped;
+        std::cout << std::setw(5) << k << std::setw(8) << control.stats[k].balls << std::setw(9)
+                  << control.stats[k].escaped << "\n";
+    }
+
+    // The same scene in one process, for reference
+    Simulation<float> single;
+    float worldRadius = 0.f;
+    setupPublishScene(single, population, worldRadius);
+    Boundary<float> boundary;
+    clock.restart();
+    for (int step = 0; step < steps; step++) {
+        float angularSpeed = ROTATION_SPEED * PI / 180.f;
+        boundary.setRegular(6, worldRadius, angularSpeed * step / 60.f, sf::Vector2f(0.f, 0.f), angularSpeed);
+        single.step(boundary, 1.f / 60.f);
+    }
+    float singleMs = clock.getElapsedTime().asSeconds() * 1000.f / steps;
+
+    std::size_t initial = single.balls.size() + single.culled.escaped;
+    bool conserved = total + escaped == initial;
+    if (!workersOk)
+        std::cerr << "Error: a worker did not exit cleanly\n";
+    if (!conserved)
+        std::cerr << "Error: the shards lost or duplicated balls\n";
+    std::cout << std::fixed << std::setprecision(2)
+              << "balls: " << initial << " at the start, " << total << " + " << escaped << " escaped at the end\n"
+              << "imbalance (largest shard / fair share): " << firstImbalance << " at the start, "
+              << lastImbalance << " at the end, " << rebalances << " rebalances\n"
+              << "per step: " << static_cast<double>(emigrated) / steps << " migrations, "
+              << static_cast<double>(ghosts) / steps << " ghosts, " << static_cast<double>(stalled) / steps
+              << " stalled, " << static_cast<double>(dropped) / steps << " ghosts dropped\n"
+              << std::setprecision(3) << "wall time per step: " << shardedMs << " ms with " << shards
+              << " processes (slowest shard step " << slowestStepMs / steps << " ms), " << singleMs
+              << " ms in one process\n";
+    return conserved && workersOk ? 0 : 1;
+}
+
+//------------------------------------------------------------
+// Job system scaling: steps the same crowded scene on 1, 2, 4, ... threads and reports the
+// time per step, the speedup over one thread and the chunks stolen. The parallel step ends
+// in the same state on every thread count; the serial step is shown for reference (its
+// contact order differs, so its state does too).
+// Run with: ./bouncing_ball --bench-jobs [population] [max threads]
+//------------------------------------------------------------
+int runJobBenchmark(int population, unsigned maxThreads)
+{
+    const int warmup = 20, steps = 60;
+    const float dt = 1.f / 60.f, angularSpeed = ROTATION_SPEED * PI / 180.f;
+
+    std::vector<unsigned> threadCounts{0}; // 0 is the serial step
+    for (unsigned threads = 1; threads <= std::max(1u, maxThreads); threads *= 2)
+        threadCounts.push_back(threads);
+
+    std::cout << "balls: " << population << ", " << std::thread::hardware_concurrency() << " hardware threads\n"
+              << "threads  ms/step  speedup  steals/step  colors  energy             state\n";
+    double oneThreadMs = 0.0;
+    for (unsigned threads : threadCounts) {
+        Simulation<float> sim;
+        float worldRadius = 0.f;
+        setupPublishScene(sim, population, worldRadius);
+        std::unique_ptr<JobSystem> jobs;
+        if (threads > 0) {
+            jobs.reset(new JobSystem(threads));
+            sim.jobs = jobs.get();
+        }
+        Boundary<float> boundary;
+        sf::Clock clock;
+        std::size_t stealsBefore = 0;
+        for (int step = 0; step < warmup + steps; step++) {
+            if (step == warmup) {
+                clock.restart();
+                stealsBefore = jobs ? jobs->steals() : 0;
+            }
+            boundary.setRegular(6, worldRadius, angularSpeed * dt * step, sf::Vector2f(0.f, 0.f), angularSpeed);
+            sim.step(boundary, dt);
+        }
+        double ms = clock.getElapsedTime().asSeconds() * 1000.0 / steps;
+        if (threads == 1)
+            oneThreadMs = ms;
+
+        std::cout << std::setw(7);
+        if (threads == 0)
+            std::cout << "serial";
+        else
+            std::cout << threads;
+        std::cout << std::fixed << std::setprecision(3) << std::setw(9) << ms << std::setprecision(2)
+                  << std::setw(9) << (threads > 0 ? oneThreadMs / ms : 0.0) << std::setprecision(1) << std::setw(13)
+                  << (jobs ? static_cast<double>(jobs->steals() - stealsBefore) / steps : 0.0) << std::setw(8)
+                  << sim.metrics.colors << std::setprecision(6) << std::setw(19) << sim.metrics.kineticEnergy
+                  << "  " << std::hex << stateHash(sim.balls) << std::dec << "\n";
+    }
+    return 0;
+}
+
+//------------------------------------------------------------
+// Trajectory output cost: steps a scene and writes every step's positions and velocities
+// to 'path', with a plain write() per step and through AsyncFileWriter with a generous and
+// a tiny buffer budget. Reports the time per step, the time the step loop spent handing
+// off output, and the writer's backpressure counters.
+// Run with: ./bouncing_ball --bench-io [population] [budget MiB] [path]
+//------------------------------------------------------------
+int runIoBenchmark(int population, int budgetMiB, const std::string &path)
+{
+    const int steps = 300;
+    const float dt = 1.f / 60.f, angularSpeed = ROTATION_SPEED * PI / 180.f;
+
+    enum Mode { NONE, SYNC, ASYNC };
+    struct Run {
+        const char *name;
+        Mode mode;
+        std::size_t blockBytes, blocks;
+    };
+    const Run runs[] = {
+        {"step only", NONE, 0, 0},
+        {"write() per step", SYNC, 0, 0},
+        {"async, large budget", ASYNC, 1 << 20, static_cast<std::size_t>(std::max(2, budgetMiB))},
+        {"async, 128 KiB budget", ASYNC, 64 << 10, 2},
+    };
+
+    std::cout << "balls: " << population << ", " << steps << " steps, " << std::fixed << std::setprecision(2)
+              << (8.0 + 16.0 * population) / (1 << 20) << " MiB per step record\n";
+    bool written = true;
+    for (const Run &run : runs) {
+        Simulation<float> sim;
+        float worldRadius = 0.f;
+        setupPublishScene(sim, population, worldRadius);
+        Boundary<float> boundary;
+
+        int fd = -1;
+        std::unique_ptr<AsyncFileWriter> writer;
+        if (run.mode == SYNC)
+            fd = open(path.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0644);
+        if (run.mode == ASYNC)
+            writer.reset(new AsyncFileWriter(path, run.blockBytes, run.blocks));
+        if ((run.mode == SYNC && fd < 0) || (writer && !writer->ok())) {
+            std::cerr << "Error: Could not open " << path << ": " << std::strerror(errno) << "\n";
+            return 1;
+        }
+
+        std::vector<char> record;
+        double outputMs = 0.0;
+        sf::Clock total;
+        for (int step = 0; step < steps; step++) {
+            boundary.setRegular(6, worldRadius, angularSpeed * dt * step, sf::Vector2f(0.f, 0.f), angularSpeed);
+            sim.step(boundary, dt);
+            if (run.mode == NONE)
+                continue;
+
+            std::uint32_t header[2] = {static_cast<std::uint32_t>(step), static_cast<std::uint32_t>(sim.balls.size())};
+            record.resize(sizeof(header) + 16 * sim.balls.size());
+            std::memcpy(record.data(), header, sizeof(header));
+            float *out = reinterpret_cast<float *>(record.data() + sizeof(header));
+            for (std::size_t i = 0; i < sim.balls.size(); i++) {
+                *out++ = sim.balls.position[i].x;
+                *out++ = sim.balls.position[i].y;
+                *out++ = sim.balls.velocity[i].x;
+                *out++ = sim.balls.velocity[i].y;
+            }
+
+            sf::Clock clock;
+            if (writer) {
+                writer->append(record.data(), record.size());
+            } else if (::write(fd, record.data(), record.size()) != static_cast<ssize_t>(record.size())) {
+                std::cerr << "Error: Short write to " << path << "\n";
+                written = false;
+            }
+            outputMs += clock.getElapsedTime().asSeconds() * 1000.0;
+        }
+        AsyncFileWriter::Stats stats;
+        if (writer) {
+            if (!writer->close()) {
+                std::cerr << "Error: Writing " << path << " failed\n";
+                written = false;
+            }
+            stats = writer->stats();
+        }
+        if (fd >= 0)
+            close(fd);
+        double msPerStep = total.getElapsedTime().asSeconds() * 1000.0 / steps;
+
+        std::cout << std::setw(22) << std::left << run.name << std::right << std::setprecision(3) << std::setw(8)
+                  << msPerStep << " ms/step, output " << outputMs / steps << " ms/step";
+        if (run.mode == NONE) {
+            std::cout << "\n";
+            continue;
+        }
+
+        if (writer)
+            std::cout << ", " << writer->backend() << ", " << writer->budget() / 1024 << " KiB budget, "
+                      << stats.blocks << " blocks in " << stats.batches << " batches, peak " << stats.peakQueued
+                      << " queued, " << stats.stalls << " stalls (" << std::setprecision(1) << stats.stallMs << " ms)";
+        std::cout << "\n";
+    }
+    std::remove(path.c_str());
+    return written ? 0 : 1;
+}
+
 //------------------------------------------------------------
-// Utility functions for vector math
+// Trajectory compression: records a scene's positions into a trajectory file and reports
+// its size against raw float positions and the encode time against the step time. It then
+// reads the file back in order and at random steps, and reports the decode time and the
+// worst error in the positions it kept a copy of.
+// Run with: ./bouncing_ball --bench-trajectory [population] [steps] [bits] [path]
 //------------------------------------------------------------
-inline float dot(const sf::Vector2f &a, const sf::Vector2f &b) {
-    return a.x * b.x + a.y * b.y;
-}
+int runTrajectoryBenchmark(int population, int steps, int bits, const std::string &path)
+{
+    const float dt = 1.f / 60.f, angularSpeed = ROTATION_SPEED * PI / 180.f;
+    const int keepEvery = 7; // steps whose positions are kept for checking
+    Simulation<float> sim;
+    float worldRadius = 0.f;
+    setupPublishScene(sim, population, worldRadius);
+    Boundary<float> boundary;
 
-inline float length(const sf::Vector2f &v) {
-    return std::sqrt(v.x * v.x + v.y * v.y);
-}
+    std::map<int, std::vector<sf::Vector2f>> kept;
+    double stepMs = 0.0, encodeMs = 0.0;
+    TrajectoryWriter::Stats stats;
+    float scale = 0.f;
+    {
+        TrajectoryWriter writer(path, worldRadius, sf::Vector2f(0.f, 0.f), sim.ballRadius, bits);
+        if (!writer.ok()) {
+            std::cerr << "Error: Could not open " << path << ": " << std::strerror(errno) << "\n";
+            return 1;
+        }
+        scale = writer.scale();
+        for (int step = 0; step < steps; step++) {
+            sf::Clock clock;
+            boundary.setRegular(6, worldRadius, angularSpeed * dt * step, sf::Vector2f(0.f, 0.f), angularSpeed);
+            sim.step(boundary, dt);
+            stepMs += clock.restart().asSeconds() * 1000.0;
+            TrajectoryFrame frame;
+            frame.time = dt * (step + 1);
+            frame.angle = angularSpeed * dt * step;
+            frame.sides = 6;
+            writer.add(sim.balls.position, frame);
+            encodeMs += clock.getElapsedTime().asSeconds() * 1000.0;
+            if (step % keepEvery == 0)
+                kept[step] = sim.balls.position;
+        }
+        if (!writer.close()) {
+            std::cerr << "Error: Writing " << path << " failed\n";
+            return 1;
+        }
+        stats = writer.stats();
+    }
+
+    TrajectoryReader reader;
+    if (!reader.open(path)) {
+        std::cerr << "Error: " << path << " is not a readable trajectory file\n";
+        return 1;
+    }
+    const float bound = 0.5f / scale + 1e-3f; // half a quantization step, plus float rounding
+    float worstError = 0.f;
+    bool ok = true;
+    auto check = [&](int step, std::vector<sf::Vector2f> &positions) {
+        if (!reader.read(static_cast<std::uint32_t>(step), positions)) {
+            ok = false;
+            return;
+        }
+        auto it = kept.find(step);
+        if (it == kept.end())
+            return;
+        for (std::size_t i = 0; i < positions.size() && i < it->second.size(); i++) {
+            sf::Vector2f d = positions[i] - it->second[i];
+            worstError = std::max(worstError, std::max(std::abs(d.x), std::abs(d.y)));
+        }
+    };
+
+    std::vector<sf::Vector2f> positions;
+    sf::Clock clock;
+    for (int step = 0; step < steps; step++)
+        check(step, positions);
+    double sequentialMs = clock.restart().asSeconds() * 1000.0 / steps;
+    std::mt19937 rng(7);
+    const int seeks = 200;
+    for (int k = 0; k < seeks; k++)
+        check(static_cast<int>(rng() % steps / keepEvery * keepEvery), positions);
+    double seekMs = clock.getElapsedTime().asSeconds() * 1000.0 / seeks;
+    std::remove(path.c_str());
+    if (!ok) {
+        std::cerr << "Error: Could not decode " << path << "\n";
+        return 1;
+    }
 
-inline sf::Vector2f normalize(const sf::Vector2f &v) {
-    float len = length(v);
-    if (len != 0)
-        return sf::Vector2f(v.x / len, v.y / len);
-    return sf::Vector2f(0.f, 0.f);
+    double ballSteps = static_cast<double>(stats.rawBytes) / 8.0;
+    std::cout << std::fixed << std::setprecision(2) << "balls: " << population << ", steps: " << steps << ", "
+              << bits << "-bit positions (" << 1.f / scale << " px steps), " << stats.blocks << " blocks\n"
+              << "raw float positions: " << stats.rawBytes / 1048576.0 << " MiB, file: " << stats.storedBytes / 1048576.0
+              << " MiB (" << static_cast<double>(stats.rawBytes) / stats.storedBytes << "x, "
+              << 8.0 * stats.storedBytes / ballSteps << " bits per ball per step)\n"
+              << std::setprecision(3) << "step: " << stepMs / steps << " ms, encode: " << encodeMs / steps
+              << " ms per step\n"
+              << "decode: " << sequentialMs << " ms per step in order, " << seekMs << " ms per random seek\n"
+              << std::setprecision(4) << "worst position error: " << worstError << " px (bound " << bound << ")\n";
+    return 0;
 }
 
 //------------------------------------------------------------
-// Draw a dotted line between two points
+// Trajectory player: opens a recording (press R in the app to make one) and draws it with
+// the app's polygon and ball drawing, without simulating anything. Space plays and pauses,
+// Left/Right jump a second, comma/period step one recorded step while paused, 1/2/3 play
+// at 1x/10x/100x, Backspace reverses, Home/End go to either end, and clicking or dragging
+// on the timeline seeks. Ball spin is not recorded, so spin markers stay still.
+// Run with: ./bouncing_ball --play <file>
 //------------------------------------------------------------
-void drawDottedLine(sf::RenderWindow &window,
-                    const sf::Vector2f &start,
-                    const sf::Vector2f &end,
-                    float dotSpacing = 10.f,
-                    float dotRadius = 2.f)
+int runPlayback(const std::string &path)
 {
-    sf::Vector2f dir = end - start;
-    float dist = length(dir);
-    if (dist == 0.f)
-        return;
+    TrajectoryReader reader;
+    if (!reader.open(path) || reader.steps() == 0) {
+        std::cerr << "Error: " << path << " is not a readable trajectory file\n";
+        return 1;
+    }
+    const TrajectoryHeader &header = reader.header;
+    const sf::Vector2f center(header.centerX, header.centerY);
+    const float duration = reader.duration();
 
-    dir = normalize(dir);
-    for (float d = 0.f; d < dist; d += dotSpacing) {
-        sf::CircleShape dot(dotRadius);
-        dot.setFillColor(sf::Color::White);
-        dot.setPosition(start + dir * d - sf::Vector2f(dotRadius, dotRadius));
-        window.draw(dot);
+    sf::ContextSettings settings;
+    settings.antialiasingLevel = 8;
+    sf::RenderWindow window(sf::VideoMode(800, 600), "Trajectory: " + path, sf::Style::Default, settings);
+    window.setVerticalSyncEnabled(true);
+    window.setFramerateLimit(60);
+
+    sf::Font font;
+    if (!font.loadFromFile("./Arial.ttf"))
+        std::cerr << "Error: Could not load font from ./Arial.ttf.\n";
+    const unsigned hudSize = 12;
+    GlyphAtlas atlas;
+    if (!atlas.bake(font, {hudSize}))
+        std::cerr << "Error: Could not create the glyph atlas texture.\n";
+    TextBatch textBatch(atlas);
+    TextLayout hud;
+    char hudText[128];
+
+    GeometryCache geometry;
+    std::uint32_t shownSides = 3;
+    PolygonShape polygon(geometry.get(static_cast<int>(shownSides), header.polygonRadius));
+    polygon.setPosition(center);
+    sf::CircleShape ball(header.ballRadius);
+    ball.setFillColor(sf::Color::Red);
+    Balls<float> balls;
+
+    // Timeline along the bottom edge
+    const float margin = 9.f;
+    sf::RectangleShape track(sf::Vector2f(window.getSize().x - 2.f * margin, 6.f));
+    track.setPosition(margin, window.getSize().y - 40.f);
+    track.setFillColor(sf::Color(80, 80, 80));
+    sf::RectangleShape playhead(sf::Vector2f(4.f, 16.f));
+    playhead.setFillColor(sf::Color::White);
+    sf::FloatRect trackArea(track.getPosition().x, track.getPosition().y - 10.f, track.getSize().x, 26.f);
+    bool dragging = false;
+
+    TrajectoryPlayback playback(reader);
+    std::vector<sf::Vector2f> positions;
+    std::vector<float> ahead(4);
+    TrajectoryFrame frame;
+    std::uint32_t step = 0;
+    float time = 0.f, speed = 1.f;
+    bool playing = true;
+    auto seekTo = [&](float x) {
+        time = std::max(0.f, std::min((x - track.getPosition().x) / track.getSize().x, 1.f)) * duration;
+    };
+
+    sf::Clock clock;
+    while (window.isOpen()) {
+        float dt = clock.restart().asSeconds();
+        sf::Event event;
+        while (window.pollEvent(event)) {
+            if (event.type == sf::Event::Closed) {
+                window.close();
+            } else if (event.type == sf::Event::KeyPressed) {
+                switch (event.key.code) {
+                case sf::Keyboard::Space: playing = !playing; break;
+                case sf::Keyboard::Left: time -= 1.f; break;
+                case sf::Keyboard::Right: time += 1.f; break;
+                case sf::Keyboard::Num1: speed = std::copysign(1.f, speed); break;
+                case sf::Keyboard::Num2: speed = std::copysign(10.f, speed); break;
+                case sf::Keyboard::Num3: speed = std::copysign(100.f, speed); break;
+                case sf::Keyboard::BackSpace: speed = -speed; break;
+                case sf::Keyboard::Home: time = 0.f; break;
+                case sf::Keyboard::End: time = duration; break;
+                case sf::Keyboard::Comma:
+                case sf::Keyboard::Period: {
+                    // One recorded step either way: land just past the neighbouring step's time
+                    std::vector<sf::Vector2f> unused;
+                    TrajectoryFrame neighbour;
+                    std::uint32_t target = event.key.code == sf::Keyboard::Comma ? (step > 0 ? step - 1 : 0)
+                                                                                 : std::min(step + 1, reader.steps() - 1);
+                    if (reader.read(target, unused, &neighbour))
+                        time = neighbour.time;
+                    playing = false;
+                    break;
+                }
+                default: break;
+                }
+            } else if (event.type == sf::Event::MouseButtonPressed && event.mouseButton.button == sf::Mouse::Left) {
+                sf::Vector2f mouse(static_cast<float>(event.mouseButton.x), static_cast<float>(event.mouseButton.y));
+                dragging = trackArea.contains(mouse);
+                if (dragging)
+                    seekTo(mouse.x);
+            } else if (event.type == sf::Event::MouseButtonReleased) {
+                dragging = false;
+            } else if (event.type == sf::Event::MouseMoved && dragging) {
+                seekTo(static_cast<float>(event.mouseMove.x));
+            }
+        }
+
+        if (playing && !dragging)
+            time += dt * speed;
+        if (time <= 0.f || time >= duration)
+            playing = playing && !((time <= 0.f && speed < 0.f) || (time >= duration && speed > 0.f));
+        time = std::max(0.f, std::min(time, duration));
+
+        // Decode ahead of where the next frames will land
+        float frameTime = std::max(dt, 1.f / 60.f);
+        for (std::size_t k = 0; k < ahead.size(); k++)
+            ahead[k] = time + (playing ? speed : 0.f) * frameTime * (k + 1);
+        if (playing)
+            playback.prefetch(ahead);
+        if (!playback.frameAt(time, positions, frame, step)) {
+            std::cerr << "Error: Could not decode " << path << "\n";
+            return 1;
+        }
+
+        balls.position.swap(positions);
+        balls.angle.assign(balls.position.size(), 0.f);
+        if (frame.sides != shownSides && frame.sides >= 3) {
+            shownSides = frame.sides;
+            polygon.setGeometry(geometry.get(static_cast<int>(shownSides), header.polygonRadius));
+        }
+        polygon.setRotation(frame.angle * 180.f / PI);
+
+        window.clear(sf::Color::Black);
+        window.draw(polygon);
+        drawBalls(window, ball, balls, header.ballRadius);
+        positions.swap(balls.position);
+
+        window.draw(track);
+        playhead.setPosition(track.getPosition().x + (duration > 0.f ? time / duration : 0.f) * track.getSize().x - 2.f,
+                             track.getPosition().y - 5.f);
+        window.draw(playhead);
+        std::size_t lookups = playback.hits + playback.misses;
+        std::snprintf(hudText, sizeof(hudText), "%.2f / %.2f s   step %u / %u   %gx   %s   %zu balls   %.1f%% decoded late",
+                      time, duration, step + 1, reader.steps(), speed, playing ? "playing" : "paused",
+                      positions.size(), lookups ? 100.0 * playback.misses / lookups : 0.0);
+        textBatch.layout(hud, hudText, hudSize);
+        textBatch.add(hud, sf::Vector2f(margin, window.getSize().y - 24.f), sf::Color(200, 200, 200));
+        textBatch.draw(window);
+        window.display();
     }
+    return 0;
 }
 
 //------------------------------------------------------------
-// Check collision of the ball with a line segment defined by points a and b, and reflect velocity
+// Scrubbing cost: records a scene and replays it through TrajectoryPlayback at 1x and 100x,
+// with and without the prefetch thread, then at random seeks. Each frame is followed by a
+// short pause standing in for drawing. Reports the frame lookup latency and how many frames
+// had to decode their block themselves.
+// Run with: ./bouncing_ball --bench-playback [population] [steps] [path]
 //------------------------------------------------------------
-void checkCollisionWithEdge(const sf::Vector2f &a, const sf::Vector2f &b,
-                              sf::Vector2f &ballPos, sf::Vector2f &velocity, float ballRadius)
+int runPlaybackBenchmark(int population, int steps, const std::string &path)
 {
-    sf::Vector2f edge = b - a;
-    // In a convex polygon defined in counterclockwise order, the inward normal is the left-hand normal.
-    sf::Vector2f normal(-edge.y, edge.x);
-    normal = normalize(normal);
+    const float dt = 1.f / 60.f, angularSpeed = ROTATION_SPEED * PI / 180.f;
+    {
+        Simulation<float> sim;
+        float worldRadius = 0.f;
+        setupPublishScene(sim, population, worldRadius);
+        Boundary<float> boundary;
+        TrajectoryWriter writer(path, worldRadius, sf::Vector2f(0.f, 0.f), sim.ballRadius);
+        if (!writer.ok()) {
+            std::cerr << "Error: Could not open " << path << ": " << std::strerror(errno) << "\n";
+            return 1;
+        }
+        for (int step = 0; step < steps; step++) {
+            float angle = angularSpeed * dt * step;
+            boundary.setRegular(6, worldRadius, angle, sf::Vector2f(0.f, 0.f), angularSpeed);
+            sim.step(boundary, dt);
+            TrajectoryFrame frame;
+            frame.time = dt * (step + 1);
+            frame.angle = angle;
+            frame.sides = 6;
+            writer.add(sim.balls.position, frame);
+        }
+        if (!writer.close()) {
+            std::cerr << "Error: Writing " << path << " failed\n";
+            return 1;
+        }
+    }
 
-    // Signed distance from ball center to the line
-    float dist = dot(ballPos - a, normal);
-    if (dist < ballRadius) {
-        if (dot(velocity, normal) < 0) { // Ball moving toward the edge
-            velocity = velocity - 2.f * dot(velocity, normal) * normal;
-            ballPos += (ballRadius - dist) * normal; // Push ball out
+    TrajectoryReader reader;
+    if (!reader.open(path)) {
+        std::cerr << "Error: " << path << " is not a readable trajectory file\n";
+        return 1;
+    }
+    std::cout << "balls: " << population << ", " << reader.steps() << " steps (" << std::fixed << std::setprecision(1)
+              << reader.duration() << " s) in " << reader.blockCount() << " blocks\n"
+              << "playback            frames  mean ms  worst ms  decoded late\n";
+
+    bool ok = true;
+    std::vector<sf::Vector2f> positions;
+    auto run = [&](const char *name, float speed, bool prefetch, bool randomSeeks) {
+        TrajectoryPlayback playback(reader, 8, prefetch);
+        std::mt19937 rng(11);
+        const int maxFrames = 600;
+        std::vector<float> ahead(4);
+        double totalMs = 0.0, worstMs = 0.0;
+        int frames = 0;
+        for (float time = 0.f; frames < maxFrames && time <= reader.duration(); frames++) {
+            if (randomSeeks)
+                time = reader.duration() * (rng() % 10000) / 10000.f;
+            for (std::size_t k = 0; k < ahead.size(); k++)
+                ahead[k] = time + speed * dt * (k + 1);
+            if (prefetch && !randomSeeks)
+                playback.prefetch(ahead);
+
+            TrajectoryFrame frame;
+            std::uint32_t step;
+            sf::Clock clock;
+            bool found = playback.frameAt(time, positions, frame, step);
+            double ms = clock.getElapsedTime().asSeconds() * 1000.0;
+            totalMs += ms;
+            worstMs = std::max(worstMs, ms);
+            ok = ok && found;
+
+            std::this_thread::sleep_for(std::chrono::milliseconds(4)); // drawing the frame
+            time += speed * dt;
         }
+        std::cout << std::setw(18) << std::left << name << std::right << std::setw(8) << frames << std::setprecision(3)
+                  << std::setw(9) << totalMs / frames << std::setw(10) << worstMs << std::setw(14) << playback.misses
+                  << "\n";
+    };
+    run("1x", 1.f, false, false);
+    run("1x, prefetch", 1.f, true, false);
+    run("100x", 100.f, false, false);
+    run("100x, prefetch", 100.f, true, false);
+    run("random seeks", 0.f, false, true);
+    std::remove(path.c_str());
+    if (!ok) {
+        std::cerr << "Error: Could not decode " << path << "\n";
+        return 1;
     }
+    return 0;
 }
 
 //------------------------------------------------------------
-// Create a regular polygon (ConvexShape) with the given number of sides and radius.
-// The polygon is created with its center at (0,0).
+// Self-tests: the deterministic checks behind the benchmarks, at sizes that run in a few
+// seconds. They are compiled only with -DBOUNCING_BALL_TESTS, so the shipping binary carries
+// none of them. Each check prints ok or FAIL, and any failure fails the run.
+// Run with: ./bouncing_ball --test   (from a build with -DBOUNCING_BALL_TESTS)
 //------------------------------------------------------------
-sf::ConvexShape createPolygon(int sides, float radius)
+#ifdef BOUNCING_BALL_TESTS
+struct TestReport {
+    int failures = 0;
+
+    void check(bool passed, const std::string &what)
+    {
+        std::cout << (passed ? "ok    " : "FAIL  ") << what << "\n";
+        failures += !passed;
+    }
+};
+
+void testResidualCodec(TestReport &report)
 {
-    sf::ConvexShape polygon;
-    polygon.setPointCount(sides);
-    for (int i = 0; i < sides; i++) {
-        float angle = 2 * PI * i / sides - PI / 2; // start at the top
-        float x = radius * std::cos(angle);
-        float y = radius * std::sin(angle);
-        polygon.setPoint(i, sf::Vector2f(x, y));
+    std::mt19937 rng(5);
+    std::vector<std::int32_t> values(300); // two full groups and a partial one
+    for (std::size_t i = 0; i < values.size(); i++) {
+        int width = static_cast<int>(i / 128 * 13); // a different width per group
+        std::int32_t magnitude = width ? static_cast<std::int32_t>(rng() % (1u << width)) : 0;
+        values[i] = rng() & 1 ? -magnitude : magnitude;
     }
-    polygon.setFillColor(sf::Color::Transparent);
-    polygon.setOutlineColor(sf::Color::White);
-    polygon.setOutlineThickness(2.f);
-    return polygon;
+    values[299] = INT32_MIN;
+    values[298] = INT32_MAX;
+    std::vector<unsigned char> packed;
+    packResiduals(values.data(), values.size(), packed);
+    std::vector<std::int32_t> unpacked(values.size());
+    const unsigned char *p = packed.data(), *end = p + packed.size();
+    report.check(unpackResiduals(p, end, values.size(), unpacked.data()) && p == end && unpacked == values,
+                 "residual codec round-trips every width");
+    p = packed.data();
+    report.check(!unpackResiduals(p, end - 1, values.size(), unpacked.data()), "residual codec rejects truncated input");
+}
+
+void testLzCodec(TestReport &report)
+{
+    std::mt19937 rng(3);
+    std::vector<std::vector<unsigned char>> inputs(4);
+    for (int k = 0; k < 5000; k++)
+        inputs[0].push_back(static_cast<unsigned char>(rng())); // incompressible
+    inputs[1].assign(70000, 0);                                    // one run, past the 64 KiB window
+    for (int k = 0; k < 20000; k++)
+        inputs[2].push_back(static_cast<unsigned char>("rotating polygon "[k % 17] + (k % 1000 == 0)));
+    inputs[3].assign(3, 7); // too short for any match
+    std::vector<unsigned char> packed, unpacked;
+    std::vector<std::uint32_t> table;
+    bool roundTrips = true, rejectsBadSize = true, rejectsTruncated = true;
+    for (const std::vector<unsigned char> &input : inputs) {
+        lzCompress(input.data(), input.size(), packed, table);
+        unpacked.assign(input.size() + 1, 0);
+        roundTrips = roundTrips && lzDecompress(packed.data(), packed.size(), unpacked.data(), input.size())
+                     && std::equal(input.begin(), input.end(), unpacked.begin());
+        rejectsBadSize = rejectsBadSize && !lzDecompress(packed.data(), packed.size(), unpacked.data(), input.size() + 1)
+                         && !lzDecompress(packed.data(), packed.size(), unpacked.data(), input.size() - 1);
+        rejectsTruncated = rejectsTruncated && !lzDecompress(packed.data(), packed.size() - 1, unpacked.data(), input.size());
+    }
+    report.check(roundTrips, "LZ codec round-trips random, run-length, repetitive and tiny inputs");
+    report.check(rejectsBadSize, "LZ decoder rejects a wrong output size");
+    report.check(rejectsTruncated, "LZ decoder rejects truncated input");
+}
+
+void testTrajectoryFile(TestReport &report)
+{
+    const std::string path = "/tmp/bouncing_ball_test_" + std::to_string(getpid()) + ".bbt";
+    const int steps = 100;
+    const float dt = 1.f / 60.f, angularSpeed = ROTATION_SPEED * PI / 180.f;
+    Simulation<float> sim;
+    float worldRadius = 0.f, scale = 0.f;
+    setupPublishScene(sim, 500, worldRadius);
+    Boundary<float> boundary;
+    std::vector<std::vector<sf::Vector2f>> kept;
+    {
+        TrajectoryWriter writer(path, worldRadius, sf::Vector2f(0.f, 0.f), sim.ballRadius);
+        scale = writer.scale();
+        for (int step = 0; step < steps; step++) {
+            boundary.setRegular(6, worldRadius, angularSpeed * dt * step, sf::Vector2f(0.f, 0.f), angularSpeed);
+            sim.step(boundary, dt);
+            TrajectoryFrame frame;
+            frame.time = dt * (step + 1);
+            frame.angle = angularSpeed * dt * step;
+            frame.sides = 6;
+            writer.add(sim.balls.position, frame);
+            kept.push_back(sim.balls.position);
+        }
+        report.check(writer.close(), "trajectory writer closes cleanly");
+    }
+
+    TrajectoryReader reader;
+    bool opened = reader.open(path) && reader.steps() == static_cast<std::uint32_t>(steps);
+    report.check(opened, "trajectory reader opens the file");
+    if (!opened) {
+        std::remove(path.c_str());
+        return;
+    }
+    const float bound = 0.5f / scale + 1e-3f; // half a quantization step, plus float rounding
+    std::vector<sf::Vector2f> positions;
+    bool withinBound = true;
+    std::mt19937 rng(7);
+    for (int k = 0; k < 2 * steps; k++) {
+        int step = k < steps ? k : static_cast<int>(rng() % steps); // in order, then seeking
+        withinBound = withinBound && reader.read(static_cast<std::uint32_t>(step), positions)
+                      && positions.size() == kept[step].size();
+        for (std::size_t i = 0; withinBound && i < positions.size(); i++) {
+            sf::Vector2f d = positions[i] - kept[step][i];
+            withinBound = std::abs(d.x) <= bound && std::abs(d.y) <= bound;
+        }
+    }
+    report.check(withinBound, "trajectory positions read back within half a quantization step");
+
+    TrajectoryPlayback playback(reader, 2, false);
+    bool framesMatch = true;
+    for (int k = 0; k < 50; k++) {
+        float time = reader.duration() * static_cast<float>(rng() % 1000) / 1000.f;
+        TrajectoryFrame frame;
+        std::uint32_t step = 0;
+        std::vector<sf::Vector2f> expected;
+        framesMatch = framesMatch && playback.frameAt(time, positions, frame, step) && reader.read(step, expected)
+                      && expected == positions && (frame.time <= time + 1e-6f || step == 0);
+    }
+    report.check(framesMatch, "playback shows the last step at or before the requested time");
+
+    // Swap two index entries: the blocks no longer tile the steps in order
+    std::vector<char> bytes;
+    {
+        std::ifstream in(path, std::ios::binary);
+        bytes.assign(std::istreambuf_iterator<char>(in), std::istreambuf_iterator<char>());
+    }
+    TrajectoryFooter footer;
+    std::memcpy(&footer, bytes.data() + bytes.size() - sizeof(footer), sizeof(footer));
+    char *entries = bytes.data() + footer.indexOffset;
+    std::swap_ranges(entries, entries + sizeof(TrajectoryBlockEntry), entries + sizeof(TrajectoryBlockEntry));
+    std::ofstream(path, std::ios::binary | std::ios::trunc).write(bytes.data(), static_cast<std::streamsize>(bytes.size()));
+    TrajectoryReader reordered;
+    report.check(footer.blockCount >= 2 && !reordered.open(path), "trajectory reader rejects an out-of-order index");
+    std::remove(path.c_str());
+}
+
+void testAsyncWriter(TestReport &report)
+{
+    const std::string path = "/tmp/bouncing_ball_test_" + std::to_string(getpid()) + ".bin";
+    std::mt19937 rng(9);
+    std::vector<char> expected;
+    bool written;
+    {
+        AsyncFileWriter writer(path, 64 << 10, 2); // a tiny budget, so appends wait for the disk
+        std::vector<char> record;
+        for (int k = 0; k < 200; k++) {
+            record.resize(rng() % 40000);
+            for (char &c : record)
+                c = static_cast<char>(rng());
+            writer.append(record.data(), record.size());
+            expected.insert(expected.end(), record.begin(), record.end());
+        }
+        written = writer.close();
+    }
+    std::ifstream in(path, std::ios::binary);
+    std::vector<char> actual((std::istreambuf_iterator<char>(in)), std::istreambuf_iterator<char>());
+    report.check(written && actual == expected, "async writer output reads back byte for byte");
+    std::remove(path.c_str());
+}
+
+void testStateRing(TestReport &report)
+{
+    const std::string segment = "/bouncing_ball_test_ring_" + std::to_string(getpid());
+    Simulation<float> sim;
+    for (int i = 0; i < 10; i++)
+        sim.balls.add(sf::Vector2f(10.f * i, 5.f * i), sf::Vector2f(1.f, 2.f));
+    Boundary<float> boundary;
+    boundary.setRegular(6, 250.f, 0.f, sf::Vector2f(0.f, 0.f), 0.f);
+    StatePublisher publisher;
+    StateViewer viewer;
+    bool ready = publisher.create(segment, 2, 16) && viewer.attach(segment);
+    report.check(ready, "state ring is created and attached");
+    if (!ready)
+        return;
+    for (int frame = 0; frame < 3; frame++)
+        publisher.publish(sim, boundary, static_cast<std::uint64_t>(frame), 250.f, 0.f);
+
+    std::uint64_t sequence = 0;
+    const StateSlot *newest = viewer.slot(2, sequence);
+    double checksum = 0.0;
+    for (std::uint32_t i = 0; newest && i < newest->ballCount; i++)
+        checksum += static_cast<double>(newest->x()[i]) + newest->y(16)[i];
+    report.check(viewer.published() == 3 && newest && newest->ballCount == 10 && checksum == newest->checksum
+                     && viewer.unchanged(newest, sequence),
+                 "state ring hands out the newest complete frame");
+    report.check(!viewer.slot(0, sequence), "state ring refuses a frame that was overwritten");
+    const StateSlot *older = viewer.slot(1, sequence);
+    publisher.publish(sim, boundary, 3, 250.f, 0.f); // frame 3 reuses frame 1's slot
+    report.check(older && !viewer.unchanged(older, sequence), "state ring flags a frame rewritten while read");
+}
+
+void testControlSnapshot(TestReport &report)
+{
+    ControlServer server;
+    bool created = server.state.create("/bouncing_ball_test_state_" + std::to_string(getpid()));
+    report.check(created, "control server creates its shared memory");
+    if (!created)
+        return;
+    std::string firstName;
+    bool matches = true;
+    for (const char *launch : {"launch 200 300 7", "launch 5000 300 7"}) { // the second outgrows the segment
+        server.execute("load 6 2000");
+        server.execute(launch);
+        server.execute("step 30");
+        std::istringstream reply(server.execute("state"));
+        std::string status, name;
+        std::size_t bytes = 0;
+        StateSnapshot snapshot;
+        matches = matches && reply >> status >> name >> bytes && status == "ok" && snapshot.read(name, bytes);
+        const Balls<float> &balls = server.sim->balls;
+        matches = matches && snapshot.x.size() == balls.size();
+        for (std::size_t i = 0; matches && i < balls.size(); i++)
+            matches = snapshot.x[i] == balls.position[i].x && snapshot.y[i] == balls.position[i].y
+                      && snapshot.vx[i] == balls.velocity[i].x && snapshot.vy[i] == balls.velocity[i].y;
+        if (firstName.empty())
+            firstName = name;
+        else
+            matches = matches && name != firstName;
+    }
+    report.check(matches, "state snapshots match the server's balls, also after the segment grows");
+}
+
+void testDeterminism(TestReport &report)
+{
+    const float dt = 1.f / 60.f, angularSpeed = ROTATION_SPEED * PI / 180.f;
+    float ms = 0.f;
+    auto noCheck = [](const auto &) {};
+    Simulation<Fixed> fixedFirst, fixedSecond;
+    runReplayScenario(fixedFirst, 300, ms, noCheck);
+    runReplayScenario(fixedSecond, 300, ms, noCheck);
+    report.check(stateHash(fixedFirst.balls) == stateHash(fixedSecond.balls), "fixed-point replays end in the same state");
+
+    // Contacts are colored into independent sets, so the parallel solve must not depend on
+    // how many threads share them
+    std::uint64_t hashes[2];
+    double energies[2];
+    unsigned threadCounts[2] = {1, 3};
+    for (int run = 0; run < 2; run++) {
+        Simulation<float> sim;
+        JobSystem jobs(threadCounts[run]);
+        sim.jobs = &jobs;
+        float worldRadius = 0.f;
+        setupPublishScene(sim, 5000, worldRadius);
+        Boundary<float> boundary;
+        for (int step = 0; step < 30; step++) {
+            boundary.setRegular(6, worldRadius, angularSpeed * dt * step, sf::Vector2f(0.f, 0.f), angularSpeed);
+            sim.step(boundary, dt);
+        }
+        hashes[run] = stateHash(sim.balls);
+        energies[run] = sim.metrics.kineticEnergy;
+    }
+    report.check(hashes[0] == hashes[1] && energies[0] == energies[1],
+                 "parallel step ends in the same state on 1 and 3 threads");
+
+    GeometryCache geometry;
+    std::uint64_t statistics[2];
+    for (int run = 0; run < 2; run++) {
+        SharedBounceStatistics stats;
+        analyzeBounces(geometry.get(6, 250.f), 2000, 2.f, threadCounts[run], stats);
+        std::uint64_t hash = 1469598103934665603ull;
+        for (const std::atomic<std::uint64_t> &n : stats.occupancy)
+            hash = (hash ^ n.load()) * 1099511628211ull;
+        for (const std::atomic<std::uint64_t> &n : stats.angles)
+            hash = (hash ^ n.load()) * 1099511628211ull;
+        statistics[run] = hash;
+    }
+    report.check(statistics[0] == statistics[1], "bounce statistics merge the same on 1 and 3 threads");
+}
+
+void testBallPool(TestReport &report)
+{
+    const int steps = 2000, warmup = 200, population = 200, churn = 8;
+    const float dt = 1.f / 60.f;
+    const sf::Vector2f center(400.f, 320.f);
+    std::mt19937 rng(1234);
+    std::uniform_real_distribution<float> unit(0.f, 1.f);
+    Simulation<float> sim;
+    // A random point inside the polygon, away from existing balls when one can be found
+    auto randomInside = [&] {
+        sf::Vector2f p;
+        for (int attempt = 0; attempt < 32; attempt++) {
+            float a = unit(rng) * 2.f * PI, r = 180.f * std::sqrt(unit(rng));
+            p = center + r * sf::Vector2f(std::cos(a), std::sin(a));
+            bool clear = true;
+            for (std::size_t i = 0; i < sim.balls.size() && clear; i++)
+                clear = length(sim.balls.position[i] - p) >= 2.f * sim.ballRadius;
+            if (clear)
+                break;
+        }
+        return p;
+    };
+    Boundary<float> boundary;
+    std::vector<BallHandle> live, dead;
+    live.reserve(population);
+    dead.reserve(churn);
+    std::vector<sf::Vector2f> expected(population);
+    for (int n = 0; n < population; n++)
+        live.push_back(sim.spawn(randomInside(), 200.f * sf::Vector2f(unit(rng) - 0.5f, unit(rng) - 0.5f)));
+    std::size_t errors = 0, steadyAllocations = 0;
+    for (int step = 0; step < steps; step++) {
+        std::size_t before = heapAllocations;
+        // Despawn a few random balls and remember where the survivors are
+        dead.clear();
+        for (int k = 0; k < churn; k++) {
+            std::size_t pick = static_cast<std::size_t>(unit(rng) * live.size()) % live.size();
+            dead.push_back(live[pick]);
+            sim.despawn(live[pick]);
+            live[pick] = live.back();
+            live.pop_back();
+        }
+        for (std::size_t k = 0; k < live.size(); k++)
+            expected[k] = sim.balls.position[sim.indexOf(live[k])];
+        sim.compact();
+        for (std::size_t k = 0; k < live.size(); k++) {
+            int i = sim.indexOf(live[k]);
+            errors += i < 0 || sim.balls.position[i] != expected[k];
+        }
+        for (const BallHandle &handle : dead)
+            errors += sim.indexOf(handle) >= 0;
+        errors += sim.balls.size() != live.size();
+        while (static_cast<int>(live.size()) < population)
+            live.push_back(sim.spawn(randomInside(), 200.f * sf::Vector2f(unit(rng) - 0.5f, unit(rng) - 0.5f)));
+        boundary.setRegular(6, 250.f, ROTATION_SPEED * PI / 180.f * dt * step, center, ROTATION_SPEED * PI / 180.f);
+        sim.step(boundary, dt);
+        if (step >= warmup)
+            steadyAllocations += heapAllocations - before;
+    }
+    report.check(errors == 0, "ball handles find their balls after compaction, and despawned ones do not");
+    if (COUNTING_ALLOCATIONS)
+        report.check(steadyAllocations == 0, "ball pool churn stops allocating once warmed up");
+}
+
+void testSteadyStateAllocations(TestReport &report)
+{
+    if (!COUNTING_ALLOCATIONS)
+        return;
+    const int warmup = 300;
+    Simulation<float> sim;
+    float ms = 0.f;
+    int step = 0;
+    std::size_t before = heapAllocations, steadyAllocations = 0;
+    runReplayScenario(sim, 600, ms, [&](const Boundary<float> &) {
+        if (step++ >= warmup)
+            steadyAllocations += heapAllocations - before;
+        before = heapAllocations;
+    });
+    report.check(steadyAllocations == 0, "the step loop stops allocating once warmed up");
+}
+
+int runSelfTests()
+{
+    TestReport report;
+    testResidualCodec(report);
+    testLzCodec(report);
+    testTrajectoryFile(report);
+    testAsyncWriter(report);
+    testStateRing(report);
+    testControlSnapshot(report);
+    testDeterminism(report);
+    testBallPool(report);
+    testSteadyStateAllocations(report);
+    if (report.failures)
+        std::cout << report.failures << " failed\n";
+    return report.failures ? 1 : 0;
+}
+#else
+int runSelfTests()
+{
+    std::cerr << "Error: --test needs a build with -DBOUNCING_BALL_TESTS\n";
+    return 1;
 }
+#endif
 
 //------------------------------------------------------------
-// Struct representing a UI tab for shape selection
+// Command line. Each mode above is an entry in MODES: its option name, a synopsis for --help
+// and a runner that reads the mode's positional arguments through ModeArgs before starting
+// it, so a malformed or out-of-range number is reported instead of read as zero. A mode
+// option must come first and takes every argument after it. The app and batch mode take
+// named options instead:
+//
+//   --headless               run without a window (batch mode)
+//   --scene <file>           control commands, one per line, run before stepping
+//   --steps <n>              steps of 1/60 s after the scene (default 600)
+//   --threads <n>            step on a job system of n threads (default 1)
+//   --seed <n>               seed for launches that give none
+//   --record <file>          write a trajectory of every step, for --play
+//   --stats <file>           write per-step CSV: step, time, balls, awake, energy, ...
+//   --bench <name> [args]    same as --bench-<name> [args]
+//
+// A scene file uses the control server's commands ('load', 'launch', 'step', 'stats'), so a
+// scene can be tried interactively with --client first. Blank lines and '#' comments are
+// skipped. Without a scene the batch loads a hexagon and launches 200 balls.
 //------------------------------------------------------------
-struct Tab {
-    sf::RectangleShape rect;
-    sf::Text text;
-    int sides; // Number of sides for this shape
+// A mode's positional arguments. Reads past the end give the default; the first malformed
+// argument sets 'error', after which every read gives its default.
+struct ModeArgs {
+    std::string mode;
+    std::vector<std::string> args;
+    std::string error;
+    std::size_t used = 0;
+
+    ModeArgs(const std::string &name, const std::vector<std::string> &arguments) : mode(name), args(arguments) {}
+
+    // Remove 'name' wherever it appears among the arguments; true if it was there
+    bool flag(const std::string &name)
+    {
+        auto it = std::find(args.begin(), args.end(), name);
+        if (it == args.end())
+            return false;
+        args.erase(it);
+        return true;
+    }
+
+    long number(std::size_t k, long fallback, long minimum, long maximum)
+    {
+        used = std::max(used, k + 1);
+        long value = fallback;
+        if (k < args.size() && error.empty() && !parseNumber(args[k].c_str(), minimum, maximum, value)) {
+            fail("argument " + std::to_string(k + 1) + " must be a whole number from " + std::to_string(minimum)
+                 + " to " + std::to_string(maximum) + ", not '" + args[k] + "'");
+            value = fallback;
+        }
+        return value;
+    }
+
+    double real(std::size_t k, double fallback, double minimum, double maximum)
+    {
+        used = std::max(used, k + 1);
+        double value = fallback;
+        if (k < args.size() && error.empty() && !parseReal(args[k].c_str(), minimum, maximum, value)) {
+            std::ostringstream range;
+            range << minimum << " to " << maximum;
+            fail("argument " + std::to_string(k + 1) + " must be a number from " + range.str() + ", not '"
+                 + args[k] + "'");
+            value = fallback;
+        }
+        return value;
+    }
+
+    std::string text(std::size_t k, const std::string &fallback)
+    {
+        used = std::max(used, k + 1);
+        return k < args.size() ? args[k] : fallback;
+    }
+
+    // An argument the mode cannot run without
+    std::string required(std::size_t k, const char *what)
+    {
+        if (k >= args.size())
+            fail("needs " + std::string(what));
+        return text(k, "");
+    }
+
+    // Every argument from k on
+    std::vector<std::string> rest(std::size_t k)
+    {
+        used = std::max(used, args.size());
+        return k < args.size() ? std::vector<std::string>(args.begin() + k, args.end()) : std::vector<std::string>();
+    }
+
+    void fail(const std::string &message)
+    {
+        if (error.empty())
+            error = "--" + mode + " " + message;
+    }
+
+    // True if every argument was read and none was malformed
+    bool ok()
+    {
+        if (args.size() > used)
+            fail(used == 0 ? std::string("takes no arguments")
+                           : "takes at most " + std::to_string(used) + " arguments");
+        return error.empty();
+    }
+};
+
+struct Mode {
+    const char *name;     // the option, without its leading dashes
+    const char *synopsis; // its arguments, for --help
+    int (*run)(ModeArgs &);
+};
+
+const long MAX_POPULATION = 100000000;
+const long MAX_STEPS = 100000000;
+
+const Mode MODES[] = {
+    {"bench-contacts", "", [](ModeArgs &a) { return a.ok() ? runContactBenchmark() : 2; }},
+    {"bench-pile", "", [](ModeArgs &a) { return a.ok() ? runPileBenchmark() : 2; }},
+    {"bench-sleep", "", [](ModeArgs &a) { return a.ok() ? runSleepBenchmark() : 2; }},
+    {"bench-fixed", "", [](ModeArgs &a) { return a.ok() ? runFixedPointBenchmark() : 2; }},
+    {"bench-allocs", "", [](ModeArgs &a) { return a.ok() ? runAllocationBenchmark() : 2; }},
+    {"bench-pool", "", [](ModeArgs &a) { return a.ok() ? runPoolBenchmark() : 2; }},
+    {"bench-emit", "[population]",
+     [](ModeArgs &a) {
+         int population = static_cast<int>(a.number(0, 20000, 1, MAX_POPULATION));
+         return a.ok() ? runEmitterBenchmark(population) : 2;
+     }},
+    {"bench-escape", "", [](ModeArgs &a) { return a.ok() ? runEscapeBenchmark() : 2; }},
+    {"analyze-bounces", "[balls per shape] [threads]",
+     [](ModeArgs &a) {
+         int balls = static_cast<int>(a.number(0, 20000, 1, MAX_POPULATION));
+         long threads = a.number(1, std::max(1u, std::thread::hardware_concurrency()), 1, 1024);
+         return a.ok() ? runBounceAnalysis(balls, static_cast<unsigned>(threads)) : 2;
+     }},
+    {"bench-heatmap", "[population] [output prefix]",
+     [](ModeArgs &a) {
+         int population = static_cast<int>(a.number(0, 100000, 1, MAX_POPULATION));
+         std::string prefix = a.text(1, "");
+         return a.ok() ? runHeatmapBenchmark(population, prefix) : 2;
+     }},
+    {"bench-ipc", "", [](ModeArgs &a) { return a.ok() ? runControlBenchmark() : 2; }},
+    {"serve", "[socket path]",
+     [](ModeArgs &a) {
+         std::string path = a.text(0, "/tmp/bouncing_ball.sock");
+         return a.ok() ? runControlServer(path) : 2;
+     }},
+    {"client", "<socket path> [command ...]",
+     [](ModeArgs &a) {
+         std::string path = a.required(0, "a socket path");
+         std::vector<std::string> commands = a.rest(1);
+         return a.ok() ? runControlClient(path, commands) : 2;
+     }},
+    {"bench-publish", "[population] [viewers]",
+     [](ModeArgs &a) {
+         int population = static_cast<int>(a.number(0, 20000, 1, MAX_POPULATION));
+         int viewers = static_cast<int>(a.number(1, 3, 0, 64));
+         return a.ok() ? runPublishBenchmark(population, viewers) : 2;
+     }},
+    {"publish", "<segment> [population] [steps]",
+     [](ModeArgs &a) {
+         std::string segment = a.required(0, "a segment name like /balls");
+         int population = static_cast<int>(a.number(1, 5000, 1, MAX_POPULATION));
+         long steps = a.number(2, 0, 0, LONG_MAX);
+         return a.ok() ? runPublisher(segment, population, steps) : 2;
+     }},
+    {"view", "<segment>",
+     [](ModeArgs &a) {
+         std::string segment = a.required(0, "a segment name like /balls");
+         return a.ok() ? runViewer(segment) : 2;
+     }},
+    {"shards", "[workers] [population] [steps]",
+     [](ModeArgs &a) {
+         int shards = static_cast<int>(a.number(0, 4, 1, MAX_SHARDS));
+         int population = static_cast<int>(a.number(1, 20000, 1, MAX_POPULATION));
+         int steps = static_cast<int>(a.number(2, 300, 1, MAX_STEPS));
+         return a.ok() ? runShardedSimulation(shards, population, steps) : 2;
+     }},
+    {"bench-jobs", "[population] [max threads]",
+     [](ModeArgs &a) {
+         int population = static_cast<int>(a.number(0, 50000, 1, MAX_POPULATION));
+         long threads = a.number(1, 64, 1, 1024);
+         return a.ok() ? runJobBenchmark(population, static_cast<unsigned>(threads)) : 2;
+     }},
+    {"bench-io", "[population] [budget MiB] [path]",
+     [](ModeArgs &a) {
+         int population = static_cast<int>(a.number(0, 20000, 1, MAX_POPULATION));
+         int budget = static_cast<int>(a.number(1, 64, 1, 65536));
+         std::string path = a.text(2, "io_bench.bin");
+         return a.ok() ? runIoBenchmark(population, budget, path) : 2;
+     }},
+    {"bench-trajectory", "[population] [steps] [bits] [path]",
+     [](ModeArgs &a) {
+         int population = static_cast<int>(a.number(0, 20000, 1, MAX_POPULATION));
+         int steps = static_cast<int>(a.number(1, 600, 1, MAX_STEPS));
+         int bits = static_cast<int>(a.number(2, 16, 8, 28));
+         std::string path = a.text(3, "trajectory_bench.bbt");
+         return a.ok() ? runTrajectoryBenchmark(population, steps, bits, path) : 2;
+     }},
+    {"bench-playback", "[population] [steps] [path]",
+     [](ModeArgs &a) {
+         int population = static_cast<int>(a.number(0, 2000, 1, MAX_POPULATION));
+         int steps = static_cast<int>(a.number(1, 12000, 1, MAX_STEPS));
+         std::string path = a.text(2, "playback_bench.bbt");
+         return a.ok() ? runPlaybackBenchmark(population, steps, path) : 2;
+     }},
+    {"play", "<file.bbt>",
+     [](ModeArgs &a) {
+         std::string path = a.required(0, "a trajectory file");
+         return a.ok() ? runPlayback(path) : 2;
+     }},
+    {"bench-precision", "", [](ModeArgs &a) { return a.ok() ? runPrecisionBenchmark() : 2; }},
+    {"render-frames", "<directory> [frames] [png|ppm|raw] [--software]",
+     [](ModeArgs &a) {
+         bool software = a.flag("--software"); // may come anywhere after the directory
+         std::string directory = a.required(0, "an output directory");
+         int frames = static_cast<int>(a.number(1, 600, 1, MAX_STEPS));
+         std::string format = a.text(2, "png");
+         if (format != "png" && format != "ppm" && format != "raw")
+             a.fail("format must be png, ppm or raw, not '" + format + "'");
+         return a.ok() ? runHeadless(directory, frames,
+                                     format == "ppm" ? FrameWriter::PPM
+                                     : format == "raw" ? FrameWriter::RAW : FrameWriter::PNG,
+                                     software)
+                       : 2;
+     }},
+    {"compare-render", "[frames] [tolerance]",
+     [](ModeArgs &a) {
+         int frames = static_cast<int>(a.number(0, 120, 1, MAX_STEPS));
+         double tolerance = a.real(1, 1.0, 0.0, 255.0);
+         return a.ok() ? runRenderComparison(frames, tolerance) : 2;
+     }},
+    {"test", "", [](ModeArgs &a) { return a.ok() ? runSelfTests() : 2; }},
 };
 
-int main()
+const Mode *findMode(const std::string &name)
+{
+    for (const Mode &mode : MODES)
+        if (name == mode.name)
+            return &mode;
+    return nullptr;
+}
+
+struct CommandLine {
+    bool headless = false;
+    bool help = false;
+    std::string scene;
+    long steps = 600;
+    unsigned threads = 1;
+    bool seeded = false;
+    std::uint32_t seed = 0;
+    std::string record;
+    std::string stats;
+    const Mode *mode = nullptr;
+    std::vector<std::string> modeArgs;
+    bool batchOnly() const { return !scene.empty() || !record.empty() || !stats.empty(); }
+};
+
+bool parseCommandLine(int argc, char **argv, CommandLine &options, std::string &error)
+{
+    for (int k = 1; k < argc; k++) {
+        std::string arg = argv[k];
+        bool hasValue = k + 1 < argc;
+        long number = 0;
+        const Mode *mode = arg.compare(0, 2, "--") == 0 ? findMode(arg.substr(2)) : nullptr;
+        if (mode || arg == "--bench") {
+            if (k != 1) {
+                error = arg + " must come first";
+                return false;
+            }
+            if (!mode && !hasValue) {
+                error = "--bench needs a benchmark name";
+                return false;
+            }
+            if (!mode && !(mode = findMode("bench-" + std::string(argv[++k])))) {
+                error = "unknown benchmark '" + std::string(argv[k]) + "'";
+                return false;
+            }
+            options.mode = mode;
+            options.modeArgs.assign(argv + k + 1, argv + argc);
+            return true;
+        } else if (arg == "--headless") {
+            options.headless = true;
+        } else if (arg == "--help" || arg == "-h") {
+            options.help = true;
+        } else if (!hasValue && (arg == "--scene" || arg == "--steps" || arg == "--threads" || arg == "--seed" ||
+                                 arg == "--record" || arg == "--stats")) {
+            error = arg + " needs a value";
+            return false;
+        } else if (arg == "--scene") {
+            options.scene = argv[++k];
+        } else if (arg == "--record") {
+            options.record = argv[++k];
+        } else if (arg == "--stats") {
+            options.stats = argv[++k];
+        } else if (arg == "--steps") {
+            if (!parseNumber(argv[++k], 0, LONG_MAX, options.steps)) {
+                error = "--steps needs a count, not '" + std::string(argv[k]) + "'";
+                return false;
+            }
+        } else if (arg == "--threads") {
+            if (!parseNumber(argv[++k], 1, 1024, number)) {
+                error = "--threads needs a count from 1 to 1024, not '" + std::string(argv[k]) + "'";
+                return false;
+            }
+            options.threads = static_cast<unsigned>(number);
+        } else if (arg == "--seed") {
+            if (!parseNumber(argv[++k], 0, 0xffffffffL, number)) {
+                error = "--seed needs a number from 0 to 4294967295, not '" + std::string(argv[k]) + "'";
+                return false;
+            }
+            options.seed = static_cast<std::uint32_t>(number);
+            options.seeded = true;
+        } else {
+            error = "unknown option '" + arg + "'";
+            return false;
+        }
+    }
+    if (options.batchOnly() && !options.headless) {
+        error = "--scene, --record and --stats need --headless";
+        return false;
+    }
+    return true;
+}
+
+void printUsage(std::ostream &out)
+{
+    out << "Usage:\n"
+           "  bouncing_ball [--threads n]                interactive\n"
+           "  bouncing_ball --headless [--scene file] [--steps n] [--threads n] [--seed n]\n"
+           "                [--record file.bbt] [--stats file.csv]\n"
+           "  bouncing_ball --bench <name> [args]        same as --bench-<name> [args]\n";
+    for (const Mode &mode : MODES)
+        out << "  bouncing_ball --" << mode.name << (*mode.synopsis ? " " : "") << mode.synopsis << "\n";
+}
+
+// Batch mode: run the scene through a ControlServer, then step it, optionally recording a
+// trajectory and per-step statistics. Prints a summary and the state hash at the end, which
+// is the same for the same scene, steps and seed on any thread count.
+int runBatch(const CommandLine &options)
+{
+    ControlServer server;
+    JobSystem jobs(options.threads); // even one thread, so every count takes the same path
+    server.jobs = &jobs;
+    server.sim->jobs = &jobs;
+    if (options.seeded)
+        server.seed = options.seed;
+
+    std::vector<std::string> lines;
+    if (options.scene.empty()) {
+        lines = {"load 6", "launch 200"};
+    } else {
+        std::ifstream in(options.scene);
+        if (!in) {
+            std::cerr << "Error: Could not open scene " << options.scene << "\n";
+            return 1;
+        }
+        for (std::string line; std::getline(in, line);)
+            lines.push_back(line);
+    }
+    sf::Clock sceneClock;
+    for (std::size_t k = 0; k < lines.size() && !server.quit; k++) {
+        std::string line = lines[k].substr(0, lines[k].find('#'));
+        if (line.find_first_not_of(" \t\r") == std::string::npos)
+            continue;
+        std::string reply = server.execute(line);
+        if (reply.compare(0, 5, "error") == 0) {
+            std::cerr << "Error: " << (options.scene.empty() ? "scene" : options.scene) << ":" << k + 1 << ": "
+                      << reply.substr(6) << "\n";
+            return 1;
+        }
+        if (line.find("stats") != std::string::npos)
+            std::cout << reply.substr(3) << "\n";
+    }
+    double sceneMs = sceneClock.getElapsedTime().asSeconds() * 1000.0;
+
+    const float angularSpeed = ROTATION_SPEED * PI / 180.f;
+    std::unique_ptr<TrajectoryWriter> writer;
+    if (!options.record.empty()) {
+        writer.reset(new TrajectoryWriter(options.record, server.shape->radius, server.center, server.sim->ballRadius));
+        if (!writer->ok()) {
+            std::cerr << "Error: Could not create " << options.record << ": " << std::strerror(errno) << "\n";
+            return 1;
+        }
+    }
+    std::ofstream stats;
+    if (!options.stats.empty()) {
+        stats.open(options.stats);
+        if (!stats) {
+            std::cerr << "Error: Could not create " << options.stats << "\n";
+            return 1;
+        }
+        stats << "step,time,balls,awake,escaped,kinetic_energy,max_speed,wall_contacts,ball_contacts,step_ms\n";
+    }
+
+    double slowestMs = 0.0;
+    sf::Clock clock;
+    for (long n = 0; n < options.steps; n++) {
+        float angle = angularSpeed * server.dt * static_cast<float>(server.steps);
+        sf::Clock stepClock;
+        server.advance(1);
+        double ms = stepClock.getElapsedTime().asSeconds() * 1000.0;
+        slowestMs = std::max(slowestMs, ms);
+        const Simulation<float> &sim = *server.sim;
+        if (writer) {
+            TrajectoryFrame frame;
+            frame.time = server.dt * static_cast<float>(server.steps);
+            frame.angle = angle;
+            frame.sides = static_cast<std::uint32_t>(server.shape->sides);
+            writer->add(sim.balls.position, frame);
+        }
+        if (stats)
+            stats << server.steps << "," << server.dt * static_cast<float>(server.steps) << "," << sim.balls.size()
+                  << "," << sim.awakeCount() << "," << sim.culled.escaped << "," << sim.metrics.kineticEnergy << ","
+                  << sim.metrics.maxSpeed << "," << sim.metrics.wallContacts << "," << sim.metrics.ballContacts << ","
+                  << ms << "\n";
+    }
+    double totalMs = clock.getElapsedTime().asSeconds() * 1000.0;
+    if (writer && !writer->close()) {
+        std::cerr << "Error: Writing " << options.record << " failed\n";
+        return 1;
+    }
+    if (stats && !stats.flush()) {
+        std::cerr << "Error: Writing " << options.stats << " failed\n";
+        return 1;
+    }
+
+    const Simulation<float> &sim = *server.sim;
+    std::cout << std::fixed << std::setprecision(3) << "steps: " << server.steps << " (" << options.steps
+              << " after a scene of " << sceneMs << " ms), threads: " << options.threads << "\n"
+              << "balls: " << sim.balls.size() << ", awake: " << sim.awakeCount()
+              << ", escaped: " << sim.culled.escaped << "\n"
+              << "ms/step: " << (options.steps > 0 ? totalMs / options.steps : 0.0) << ", slowest: " << slowestMs
+              << "\n"
+              << "state " << std::hex << std::setw(16) << std::setfill('0') << stateHash(sim.balls) << std::dec
+              << std::setfill(' ') << "\n";
+    return 0;
+}
+
+int main(int argc, char **argv)
 {
+    CommandLine options;
+    std::string error;
+    if (!parseCommandLine(argc, argv, options, error)) {
+        std::cerr << "Error: " << error << "\n";
+        printUsage(std::cerr);
+        return 2;
+    }
+    if (options.help) {
+        printUsage(std::cout);
+        return 0;
+    }
+    if (options.mode) {
+        ModeArgs args(options.mode->name, options.modeArgs);
+        int status = options.mode->run(args);
+        if (!args.error.empty()) {
+            std::cerr << "Error: " << args.error << "\n";
+            printUsage(std::cerr);
+            return 2;
+        }
+        return status;
+    }
+    if (options.headless)
+        return runBatch(options);
     // Enable anti-aliasing and vertical sync for smoother rendering
     sf::ContextSettings settings;
     settings.antialiasingLevel = 8; // Increase for even smoother edges if desired
@@ -119,15 +7996,19 @@ int main()
         std::cerr << "Error: Could not load font from ./Arial.ttf.\n";
     }
 
+    // Bake the glyphs of every character size the UI uses into one atlas; all text is
+    // laid out once and drawn through a TextBatch
+    const unsigned instructionsSize = 16, tabLabelSize = 14, hudSize = 12;
+    GlyphAtlas atlas;
+    if (!atlas.bake(font, {instructionsSize, tabLabelSize, hudSize}))
+        std::cerr << "Error: Could not create the glyph atlas texture.\n";
+    TextBatch textBatch(atlas);
+
     // Setup instructions text (centered at the top)
-    sf::Text instructions;
-    instructions.setFont(font);
-    instructions.setString("Aim with mouse, right-click to launch. Click a tab to change shape.");
-    instructions.setCharacterSize(16);
-    instructions.setFillColor(sf::Color::White);
-    sf::FloatRect instrRect = instructions.getLocalBounds();
-    instructions.setOrigin(instrRect.left + instrRect.width / 2.0f, instrRect.top + instrRect.height / 2.0f);
-    instructions.setPosition(window.getSize().x / 2.0f, 20.f + instrRect.height / 2.0f);
+    TextLayout instructions;
+    textBatch.layout(instructions, "Aim with mouse, right-click to launch. Click a tab to change shape. E: stream. H: heatmap. R: record.", instructionsSize);
+    sf::Vector2f instructionsPosition = instructions.centeredAt(
+        sf::Vector2f(window.getSize().x / 2.0f, 20.f + instructions.bounds.height / 2.0f));
 
     // Create tabs for shape selection
     std::vector<std::pair<int, std::string>> shapeOptions = {
@@ -140,7 +8021,7 @@ int main()
         {9, "Nonagon"},
         {10, "Decagon"}
     };
-    std::vector<Tab> tabs;
+    TabBar tabBar;
     float tabWidth = 90.f;
     float tabHeight = 30.f;
     float tabMargin = 9.f;
@@ -150,28 +8031,50 @@ int main()
         Tab tab;
         tab.sides = option.first;
         tab.rect.setSize(sf::Vector2f(tabWidth, tabHeight));
-        tab.rect.setFillColor(sf::Color(100, 100, 100));
+        tab.rect.setFillColor(TAB_COLOR);
         tab.rect.setOutlineColor(sf::Color::White);
         tab.rect.setOutlineThickness(1.f);
         tab.rect.setPosition(startX, startY);
 
-        tab.text.setFont(font);
-        tab.text.setString(option.second);
-        tab.text.setCharacterSize(14);
-        tab.text.setFillColor(sf::Color::White);
-        sf::FloatRect textRect = tab.text.getLocalBounds();
-        tab.text.setOrigin(textRect.left + textRect.width / 2.0f, textRect.top + textRect.height / 2.0f);
-        tab.text.setPosition(startX + tabWidth / 2.0f, startY + tabHeight / 2.0f);
+        textBatch.layout(tab.label, option.second, tabLabelSize);
+        tab.labelPosition = tab.label.centeredAt(sf::Vector2f(startX + tabWidth / 2.0f, startY + tabHeight / 2.0f));
 
-        tabs.push_back(tab);
+        tabBar.tabs.push_back(tab);
         startX += tabWidth + tabMargin;
     }
 
+    // Pre-render the instructions and tabs; afterwards only the tabs whose selection
+    // changes are redrawn
+    UiLayer ui;
+    if (!ui.create(window.getSize().x, window.getSize().y)) {
+        std::cerr << "Error: Could not create the UI layer texture.\n";
+        return 1;
+    }
+    tabBar.select(0, ui);
+    auto drawUi = [&](sf::RenderTarget &target, const sf::RenderStates &states) {
+        for (auto &tab : tabBar.tabs)
+            target.draw(tab.rect, states);
+        textBatch.add(instructions, instructionsPosition, sf::Color::White);
+        for (auto &tab : tabBar.tabs)
+            textBatch.add(tab.label, tab.labelPosition, sf::Color::White);
+        textBatch.draw(target, states);
+    };
+
+    // Stats overlay in the bottom-left corner, re-laid out every frame into the same storage
+    TextLayout hud;
+    char hudText[96];
+    sf::Vector2f hudPosition(tabMargin, window.getSize().y - 24.f);
+
     // Set up initial boundary shape (default: triangle)
     int currentSides = 3;
     float polygonRadius = 250.f;
     sf::Vector2f center(400.f, 320.f);
-    sf::ConvexShape polygon = createPolygon(currentSides, polygonRadius);
+    // Build the geometry of every tab's shape up front
+    GeometryCache geometry;
+    for (auto &tab : tabBar.tabs)
+        geometry.get(tab.sides, polygonRadius);
+    const PolygonGeometry *shape = &geometry.get(currentSides, polygonRadius);
+    PolygonShape polygon(*shape);
     // Position the polygon so that its center is at 'center'
     polygon.setPosition(center);
 
@@ -179,10 +8082,68 @@ int main()
     const float ballRadius = 10.f;
     sf::CircleShape ball(ballRadius);
     ball.setFillColor(sf::Color::Red);
-    sf::Vector2f ballPosition = center;
-    ball.setPosition(ballPosition - sf::Vector2f(ballRadius, ballRadius));
-    sf::Vector2f velocity(0.f, 0.f);
-    bool launched = false; // Ball remains stationary until launched
+    Simulation<float> sim;
+    sim.ballRadius = ballRadius;
+    std::unique_ptr<JobSystem> jobs;
+    if (options.threads > 1) {
+        jobs.reset(new JobSystem(options.threads));
+        sim.jobs = jobs.get();
+    }
+    Balls<float> &balls = sim.balls;
+    Boundary<float> boundary;
+    // The aimed ball rests at the center outside the simulation, so emitted balls cannot push
+    // it, and joins it when launched; its index then moves as other balls come and go
+    BallHandle player;
+    bool launched = false;
+    Balls<float> restingBall;
+    restingBall.add(center);
+
+    // Press E to stream balls outward from a ring around the center
+    Emitter<float> emitter;
+    emitter.shape = Emitter<float>::ARC;
+    emitter.origin = center;
+    emitter.radius = 150.f;
+    emitter.spread = PI;
+    emitter.rate = 8.f;
+    emitter.speedMin = 200.f;
+    emitter.speedMax = 350.f;
+    emitter.lifetime = 8.f;
+    emitter.enabled = false;
+
+    // Press H to cycle the occupancy overlay: off, screen frame, polygon frame (drawn rotating
+    // with the polygon). The overlay texture is refreshed a few times a second, and while the
+    // overlay is on the grids are flushed to heatmap_world.pgm / heatmap_local.pgm.
+    OccupancyHeatmap heatmap(sf::FloatRect(0.f, 0.f, static_cast<float>(window.getSize().x),
+                                           static_cast<float>(window.getSize().y)),
+                             4.f, polygonRadius, 128);
+    int heatmapView = 0;
+    int heatmapRefresh = 0;
+    std::vector<sf::Uint8> heatmapPixels;
+    sf::Texture heatmapTexture;
+    sf::Sprite heatmapSprite;
+    const float heatmapFlushInterval = 10.f; // seconds
+    float heatmapFlushTime = 0.f;
+
+    // Press R to start or stop recording into recording.bbt; play it back with --play
+    std::unique_ptr<TrajectoryWriter> recorder;
+    float recordTime = 0.f;
+
+    // Clicking a tab selects it and switches the boundary shape
+    UiInput input;
+    for (std::size_t k = 0; k < tabBar.tabs.size(); k++) {
+        input.add(tabBar.tabs[k].rect.getGlobalBounds(), [&, k] {
+            tabBar.select(static_cast<int>(k), ui);
+            currentSides = tabBar.tabs[k].sides;
+            shape = &geometry.get(currentSides, polygonRadius);
+            polygon.setGeometry(*shape);
+            // Put the ball back at the center when the shape changes
+            if (launched)
+                sim.despawn(player);
+            launched = false;
+            heatmap.clear();
+        });
+    }
+    input.build(window.getSize().x, window.getSize().y);
 
     sf::Clock clock;
     while (window.isOpen()) {
@@ -200,78 +8161,115 @@ int main()
             // Left-click: Check for tab selection (to change shape)
             if (event.type == sf::Event::MouseButtonPressed && event.mouseButton.button == sf::Mouse::Left) {
                 sf::Vector2f mousePos(static_cast<float>(event.mouseButton.x), static_cast<float>(event.mouseButton.y));
-                for (auto &tab : tabs) {
-                    if (tab.rect.getGlobalBounds().contains(mousePos)) {
-                        currentSides = tab.sides;
-                        polygon = createPolygon(currentSides, polygonRadius);
-                        polygon.setPosition(center);
-                        // Reset the ball when shape changes
-                        ballPosition = center;
-                        ball.setPosition(ballPosition - sf::Vector2f(ballRadius, ballRadius));
-                        velocity = sf::Vector2f(0.f, 0.f);
-                        launched = false;
-                    }
-                }
+                input.click(mousePos);
             }
             // Right-click: Launch the ball if not already launched
             else if (event.type == sf::Event::MouseButtonPressed &&
                      event.mouseButton.button == sf::Mouse::Right && !launched) {
                 sf::Vector2i mousePosInt = sf::Mouse::getPosition(window);
                 sf::Vector2f mousePos(static_cast<float>(mousePosInt.x), static_cast<float>(mousePosInt.y));
-                sf::Vector2f dir = mousePos - ballPosition;
+                sf::Vector2f dir = mousePos - center;
                 float dist = length(dir);
                 if (dist != 0.f)
                     dir = normalize(dir);
                 float speed = 300.f;  // initial launch speed
-                velocity = dir * speed;
+                player = sim.spawn(center, dir * speed);
                 launched = true;
             }
+            else if (event.type == sf::Event::KeyPressed && event.key.code == sf::Keyboard::E) {
+                emitter.enabled = !emitter.enabled;
+            }
+            else if (event.type == sf::Event::KeyPressed && event.key.code == sf::Keyboard::H) {
+                heatmapView = (heatmapView + 1) % 3;
+                heatmapRefresh = 0;
+            }
+            else if (event.type == sf::Event::KeyPressed && event.key.code == sf::Keyboard::R) {
+                if (recorder) {
+                    if (!recorder->close())
+                        std::cerr << "Error: Could not write recording.bbt\n";
+                    recorder.reset();
+                } else {
+                    recorder.reset(new TrajectoryWriter("recording.bbt", polygonRadius, center, ballRadius));
+                    recordTime = 0.f;
+                    if (!recorder->ok()) {
+                        std::cerr << "Error: Could not create recording.bbt\n";
+                        recorder.reset();
+                    }
+                }
+            }
         }
 
-        // Update ball position if launched (apply gravity and friction)
-        if (launched) {
-            // Apply gravity (downward acceleration)
-            velocity.y += GRAVITY * dt;
-            // Apply friction/damping to gradually slow down the ball
-            velocity *= (1.0f - FRICTION_COEFFICIENT * dt);
-            // Update ball position using the modified velocity
-            ballPosition += velocity * dt;
-
-            // Check collision with each edge of the polygon.
-            int count = polygon.getPointCount();
-            for (int i = 0; i < count; i++) {
-                int next = (i + 1) % count;
-                // Transform local points to world coordinates (accounting for rotation & position)
-                sf::Vector2f pt1 = polygon.getTransform().transformPoint(polygon.getPoint(i));
-                sf::Vector2f pt2 = polygon.getTransform().transformPoint(polygon.getPoint(next));
-                checkCollisionWithEdge(pt1, pt2, ballPosition, velocity, ballRadius);
-            }
-            ball.setPosition(ballPosition - sf::Vector2f(ballRadius, ballRadius));
+        // Update ball positions once anything is moving (apply gravity and friction)
+        emitter.update(sim, dt);
+        if (balls.size() > 0) {
+            boundary.setFromGeometry(*shape, polygon.getRotation() * PI / 180.f, center, ROTATION_SPEED * PI / 180.f);
+            sim.step(boundary, dt);
+            heatmap.add(balls.position, center, polygon.getRotation() * PI / 180.f);
+        }
+        if (heatmapView != 0 && (heatmapFlushTime += dt) >= heatmapFlushInterval) {
+            heatmap.flush("heatmap");
+            heatmapFlushTime = 0.f;
+        }
+        // An escaped player ball is culled like any other; bring it back at the center
+        if (launched && sim.indexOf(player) < 0)
+            launched = false;
+        if (recorder) {
+            TrajectoryFrame frame;
+            recordTime += dt;
+            frame.time = recordTime;
+            frame.angle = polygon.getRotation() * PI / 180.f;
+            frame.sides = static_cast<std::uint32_t>(currentSides);
+            recorder->add(balls.position, frame);
         }
 
         window.clear(sf::Color::Black);
+        if (heatmapView != 0) {
+            bool local = heatmapView == 2;
+            if (heatmapRefresh-- <= 0) {
+                unsigned w = local ? heatmap.localSize : heatmap.worldWidth;
+                unsigned h = local ? heatmap.localSize : heatmap.worldHeight;
+                OccupancyHeatmap::toOverlay(local ? heatmap.local : heatmap.world, heatmapPixels);
+                if (heatmapTexture.getSize() != sf::Vector2u(w, h))
+                    heatmapTexture.create(w, h);
+                heatmapTexture.update(heatmapPixels.data());
+                heatmapSprite.setTexture(heatmapTexture, true);
+                heatmapRefresh = 15;
+            }
+            float cell = local ? 2.f * heatmap.localRadius / heatmap.localSize : heatmap.worldCell;
+            heatmapSprite.setScale(cell, cell);
+            heatmapSprite.setOrigin(local ? sf::Vector2f(heatmap.localSize / 2.f, heatmap.localSize / 2.f) : sf::Vector2f(0.f, 0.f));
+            heatmapSprite.setPosition(local ? center : heatmap.worldOrigin);
+            heatmapSprite.setRotation(local ? polygon.getRotation() : 0.f);
+            window.draw(heatmapSprite);
+        }
         window.draw(polygon);
 
         // Draw the aiming dotted line if the ball hasn't been launched
         if (!launched) {
             sf::Vector2i mousePosInt = sf::Mouse::getPosition(window);
             sf::Vector2f mousePos(static_cast<float>(mousePosInt.x), static_cast<float>(mousePosInt.y));
-            sf::Vector2f diff = mousePos - ballPosition;
+            sf::Vector2f diff = mousePos - center;
             float dist = length(diff);
             sf::Vector2f dir(0.f, 0.f);
             if (dist > 0.f)
                 dir = diff / dist;
             float lineLength = std::min(dist, 100.f);
-            sf::Vector2f endPos = ballPosition + dir * lineLength;
-            drawDottedLine(window, ballPosition, endPos, 10.f, 2.f);
+            sf::Vector2f endPos = center + dir * lineLength;
+            drawDottedLine(window, center, endPos, 10.f, 2.f);
         }
 
-        window.draw(ball);
-        window.draw(instructions);
-        for (auto &tab : tabs) {
-            window.draw(tab.rect);
-            window.draw(tab.text);
-        }
+        drawBalls(window, ball, balls, ballRadius);
+        if (!launched)
+            drawBalls(window, ball, restingBall, ballRadius);
+        ui.update(drawUi);
+        ui.draw(window);
+
+        std::snprintf(hudText, sizeof(hudText), "%.0f fps   %zu balls   %zu awake   %zu escaped%s",
+                      dt > 0.f ? 1.f / dt : 0.f, balls.size(), sim.awakeCount(), sim.culled.escaped,
+                      recorder ? "   REC" : "");
+        textBatch.layout(hud, hudText, hudSize);
+        textBatch.add(hud, hudPosition, sf::Color(200, 200, 200));
+        textBatch.draw(window);
         window.display();
     }
 